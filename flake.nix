@@ -34,6 +34,7 @@
             mupdf
             sqlite
             yyjson
+            zlib
           ];
           preConfigure =
             let
@@ -0,0 +1,152 @@
+#include "project.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <yyjson.h>
+
+#include "malachi.h"
+
+#define MAXBENCHES 16
+
+enum
+{
+    NVOCAB = 8192,
+};
+
+static Bench const *benches[MAXBENCHES];
+static int nbenches = 0;
+
+/* The report being built, and the results array of the benchmark running now */
+static yyjson_mut_doc *report;
+static yyjson_mut_val *results;
+
+void benchadd(Bench const *ops)
+{
+    if (nbenches < MAXBENCHES - 1)
+    {
+        benches[nbenches++] = ops;
+        benches[nbenches] = NULL;
+    }
+}
+
+/* Units are string literals, metric names may be built on the stack */
+void benchreport(char const *metric, double value, char const *unit)
+{
+    if (results == NULL)
+        return;
+
+    yyjson_mut_val *r = yyjson_mut_arr_add_obj(report, results);
+    yyjson_mut_obj_add_strcpy(report, r, "metric", metric);
+    yyjson_mut_obj_add_real(report, r, "value", value);
+    yyjson_mut_obj_add_str(report, r, "unit", unit);
+    eprintf("  %s: %.1f %s\n", metric, value, unit);
+}
+
+/* splitmix64, so every run generates the same corpus */
+uint64_t benchrand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * One of NVOCAB made-up words, two to four syllables long, into out, which
+ * has room for MAXBENCHWORD bytes.  Low ranks are picked far more often, a
+ * rough stand-in for the skew of natural language.
+ */
+size_t benchword(uint64_t *state, char *out)
+{
+    static char const consonants[] = "bcdfghjklmnprstvz";
+    static char const vowels[] = "aeiou";
+
+    uint64_t const r = benchrand(state);
+    uint64_t k = (r % NVOCAB) % ((r >> 32) % NVOCAB + 1);
+
+    size_t n = 0;
+    int const nsyllables = 2 + (int)(k % 3);
+    for (int i = 0; i < nsyllables; ++i)
+    {
+        out[n++] = consonants[k % (sizeof(consonants) - 1)];
+        k /= sizeof(consonants) - 1;
+        out[n++] = vowels[k % (sizeof(vowels) - 1)];
+        k /= sizeof(vowels) - 1;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static int benchrun(yyjson_mut_val *list, Bench const *bench)
+{
+    yyjson_mut_val *obj = yyjson_mut_arr_add_obj(report, list);
+    yyjson_mut_obj_add_str(report, obj, "name", bench->name);
+    results = yyjson_mut_obj_add_arr(report, obj, "results");
+
+    eprintf("Running benchmark: %s\n", bench->name);
+    double const start = clocksec();
+    int const rc = bench->run();
+
+    yyjson_mut_obj_add_real(report, obj, "seconds", clocksec() - start);
+    yyjson_mut_obj_add_bool(report, obj, "ok", rc == 0);
+    results = NULL;
+
+    if (rc != 0)
+        eprintf("Benchmark %s failed\n", bench->name);
+    return rc != 0;
+}
+
+/*
+ * Runs the named benchmark, or every one, and prints a JSON report on
+ * standard output.  Progress goes to standard error.
+ */
+int benchmain(char const *name)
+{
+    int failed = 0;
+    int found = 0;
+
+    /* A benchmark feeding a pipe must not die when its reader gives up */
+    (void)signal(SIGPIPE, SIG_IGN);
+
+    report = yyjson_mut_doc_new(NULL);
+    if (report == NULL)
+        return 1;
+
+    char version[64];
+    (void)snprintf(version, sizeof(version), "%d.%d.%d%s%s", MALACHI_VERSION_MAJOR, MALACHI_VERSION_MINOR, MALACHI_VERSION_PATCH,
+                   sizeof(MALACHI_COMMIT_SHORT_HASH) > 1 ? "-" : "", MALACHI_COMMIT_SHORT_HASH);
+
+    yyjson_mut_val *root = yyjson_mut_obj(report);
+    yyjson_mut_doc_set_root(report, root);
+    yyjson_mut_obj_add_strcpy(report, root, "malachi", version);
+    yyjson_mut_obj_add_str(report, root, "platform", platformstr());
+    yyjson_mut_val *list = yyjson_mut_obj_add_arr(report, root, "benchmarks");
+
+    for (int i = 0; i < nbenches; ++i)
+    {
+        if (name && strcmp(benches[i]->name, name) != 0)
+            continue;
+        found++;
+        failed += benchrun(list, benches[i]);
+    }
+
+    if (found == 0)
+    {
+        eprintf("Benchmark '%s' not found\n", name ? name : "");
+        failed++;
+    }
+
+    size_t len = 0;
+    char *json = yyjson_mut_write(report, 0, &len);
+    if (json)
+        printf("%s\n", json);
+    else
+        failed++;
+
+    free(json);
+    yyjson_mut_doc_free(report);
+    report = NULL;
+    return failed;
+}
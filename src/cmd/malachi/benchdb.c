@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "malachi.h"
+
+enum
+{
+    TXNLEAVES = 10000,
+    DOCWORDS = 24,
+    PATHDEPTH = 3,
+    NQUERIES = 200,
+    MAXHITS = 100,
+};
+
+/* The index is grown to each size in turn and queried there */
+static int const tiers[] = { 10000, 100000, 1000000 };
+
+struct Corpus
+{
+    Database *db;
+    int64_t rootid;
+    uint64_t state;
+    int nleaves;
+};
+
+static char const *tiername(int n)
+{
+    return n >= 1000000 ? "1m" : n >= 100000 ? "100k" : "10k";
+}
+
+/* One synthetic file: a path a few directories deep and a document of skewed words */
+static int leafadd(struct Corpus *c)
+{
+    char hash[MAXHASHLEN];
+    char path[PATHDEPTH * (MAXBENCHWORD + 1) + 16];
+    char doc[DOCWORDS * MAXBENCHWORD];
+
+    size_t n = 0;
+    for (int i = 0; i < PATHDEPTH; ++i)
+    {
+        n += benchword(&c->state, path + n);
+        path[n++] = '/';
+    }
+    (void)snprintf(path + n, sizeof(path) - n, "%d.txt", c->nleaves);
+
+    n = 0;
+    for (int i = 0; i < DOCWORDS; ++i)
+    {
+        n += benchword(&c->state, doc + n);
+        doc[n++] = ' ';
+    }
+    doc[n - 1] = '\0';
+
+    (void)snprintf(hash, sizeof(hash), "%040d", c->nleaves);
+
+    Leaf const leaf = {
+        .hash = hash,
+        .path = path,
+        .size = (int64_t)n,
+        .filter = "text",
+        .content = doc,
+    };
+
+    int64_t const blobid = dbblobput(c->db, &leaf);
+    if (blobid < 0 || dbleafput(c->db, c->rootid, blobid, path) != 0)
+        return -1;
+
+    c->nleaves++;
+    return 0;
+}
+
+/* Inserts in transactions of TXNLEAVES, as the indexer commits */
+static int grow(struct Corpus *c, int target)
+{
+    while (c->nleaves < target)
+    {
+        if (dbbegin(c->db) != 0)
+            return -1;
+        for (int i = 0; i < TXNLEAVES && c->nleaves < target; ++i)
+        {
+            if (leafadd(c) != 0)
+            {
+                (void)dbrollback(c->db);
+                return -1;
+            }
+        }
+        if (dbcommit(c->db) != 0)
+        {
+            (void)dbrollback(c->db);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int hitcount(char const *root, char const *path, double score, void *arg)
+{
+    (void)root;
+    (void)path;
+    (void)score;
+    ++*(int *)arg;
+    return 0;
+}
+
+static int cmpdouble(void const *a, void const *b)
+{
+    double const x = *(double const *)a;
+    double const y = *(double const *)b;
+    return (x > y) - (x < y);
+}
+
+/* One and two word queries from the same vocabulary, each in its own read transaction */
+static int querytimes(Database *reader, uint64_t *state, double *times)
+{
+    for (int i = 0; i < NQUERIES; ++i)
+    {
+        char terms[2 * MAXBENCHWORD];
+        size_t n = benchword(state, terms);
+        if (i % 2)
+        {
+            terms[n++] = ' ';
+            (void)benchword(state, terms + n);
+        }
+
+        int nhits = 0;
+        double const start = clocksec();
+        if (dbbeginread(reader) != 0)
+            return -1;
+        int const rc = dbsearch(reader, terms, NULL, MAXHITS, hitcount, &nhits);
+        (void)dbcommit(reader);
+        times[i] = clocksec() - start;
+
+        if (rc < 0)
+        {
+            eprintf("query %s failed\n", terms);
+            return -1;
+        }
+    }
+
+    qsort(times, NQUERIES, sizeof(*times), cmpdouble);
+    return 0;
+}
+
+static void scratchremove(char const *dir)
+{
+    static char const *const files[] = { "index.db", "index.db-wal", "index.db-shm" };
+    for (size_t i = 0; i < NELEM(files); ++i)
+    {
+        char *path = joinpath2(dir, files[i]);
+        if (path)
+            (void)unlink(path);
+        free(path);
+    }
+    (void)rmdir(dir);
+}
+
+/* A fresh index in a scratch cache directory, removed afterwards */
+static int run(void)
+{
+    int ret = -1;
+    Error err = { 0 };
+    char const *tmpdir = getenv("TMPDIR");
+    char dir[PATH_MAX];
+
+    int const n = snprintf(dir, sizeof(dir), "%s/malachi-bench-%ld", tmpdir && *tmpdir ? tmpdir : "/tmp", (long)getpid());
+    if (n < 0 || (size_t)n >= sizeof(dir))
+        return -1;
+
+    Config config = { .cachedir = dir };
+    struct Corpus c = { .state = 1 };
+
+    c.db = dbcreate(&config, &err);
+    if (c.db == NULL)
+    {
+        eprintf("Failed to create database in %s: %s\n", dir, err.msg);
+        goto removedir;
+    }
+
+    Database *reader = dbopenreader(&config, &err);
+    if (reader == NULL)
+    {
+        eprintf("Failed to open reader: %s\n", err.msg);
+        goto destroydb;
+    }
+
+    if (dbbegin(c.db) != 0 || (c.rootid = dbrootadd(c.db, "/bench/repo")) < 0 || dbcommit(c.db) != 0)
+        goto destroyreader;
+
+    uint64_t querystate = 2;
+    for (size_t i = 0; i < NELEM(tiers); ++i)
+    {
+        int const from = c.nleaves;
+        double const start = clocksec();
+        if (grow(&c, tiers[i]) != 0)
+        {
+            eprintf("Failed to insert leaves\n");
+            goto destroyreader;
+        }
+        double const elapsed = clocksec() - start;
+
+        double times[NQUERIES];
+        if (querytimes(reader, &querystate, times) != 0)
+            goto destroyreader;
+
+        char metric[32];
+        (void)snprintf(metric, sizeof(metric), "inserts.%s", tiername(tiers[i]));
+        benchreport(metric, (c.nleaves - from) / elapsed, "leaves/s");
+        (void)snprintf(metric, sizeof(metric), "query.p50.%s", tiername(tiers[i]));
+        benchreport(metric, times[NQUERIES / 2] * 1e6, "us");
+        (void)snprintf(metric, sizeof(metric), "query.p99.%s", tiername(tiers[i]));
+        benchreport(metric, times[NQUERIES * 99 / 100] * 1e6, "us");
+    }
+
+    ret = 0;
+
+destroyreader:
+    dbdestroy(reader);
+destroydb:
+    dbdestroy(c.db);
+removedir:
+    scratchremove(dir);
+    return ret;
+}
+
+static Bench const bench = {
+    .name = "db",
+    .run = run,
+};
+
+__attribute__((constructor)) static void init(void)
+{
+    benchadd(&bench);
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "malachi.h"
+
+enum
+{
+    DOCSIZE = 8 << 20,
+    TOTALSIZE = 128 << 20,
+    LINEWORDS = 12,
+};
+
+/*
+ * DOCSIZE bytes of words and LF line endings.  A mixed document also has
+ * an accented word every few lines and CRLF endings, which leave the fast
+ * path for the scalar loop.
+ */
+static char *docbuild(int mixed, size_t *len)
+{
+    char *doc = malloc(DOCSIZE + MAXBENCHWORD + 8);
+    if (doc == NULL)
+        return NULL;
+
+    uint64_t state = 3;
+    size_t n = 0;
+    for (int word = 0; n < DOCSIZE; ++word)
+    {
+        n += benchword(&state, doc + n);
+        if (mixed && word % 50 == 0)
+        {
+            memcpy(doc + n, "\xC3\xA9", 2);
+            n += 2;
+        }
+
+        if (word % LINEWORDS != LINEWORDS - 1)
+            doc[n++] = ' ';
+        else if (mixed && word % (20 * LINEWORDS) == LINEWORDS - 1)
+        {
+            memcpy(doc + n, "\r\n", 2);
+            n += 2;
+        }
+        else
+            doc[n++] = '\n';
+    }
+
+    *len = n;
+    return doc;
+}
+
+static int measure(Filter const *f, char const *kind, char const *doc, size_t len)
+{
+    size_t done = 0;
+    double const start = clocksec();
+
+    while (done < TOTALSIZE)
+    {
+        char *output = NULL;
+        if (f->extract(doc, len, &output) != 0)
+        {
+            eprintf("%s filter rejected the %s document\n", f->name, kind);
+            return -1;
+        }
+        free(output);
+        done += len;
+    }
+
+    char metric[64];
+    (void)snprintf(metric, sizeof(metric), "%s.%s", f->name, kind);
+    benchreport(metric, (double)done / (clocksec() - start) / (1 << 20), "MB/s");
+    return 0;
+}
+
+/* Every filter that runs in the daemon, on text it should accept */
+static int run(void)
+{
+    int ret = -1;
+    size_t plainlen = 0;
+    size_t mixedlen = 0;
+    char *plain = docbuild(0, &plainlen);
+    char *mixed = docbuild(1, &mixedlen);
+    if (plain == NULL || mixed == NULL)
+        goto freedocs;
+
+    for (Filter const **f = filterall(); *f; ++f)
+    {
+        if (((*f)->flags & Finprocess) == 0 || (*f)->extract == NULL)
+            continue;
+        if (measure(*f, "plain", plain, plainlen) != 0 || measure(*f, "mixed", mixed, mixedlen) != 0)
+            goto freedocs;
+    }
+
+    ret = 0;
+
+freedocs:
+    free(plain);
+    free(mixed);
+    return ret;
+}
+
+static Bench const bench = {
+    .name = "filter",
+    .run = run,
+};
+
+__attribute__((constructor)) static void init(void)
+{
+    benchadd(&bench);
+}
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "malachi.h"
+
+enum
+{
+    NFRAMES = 200000,
+    BATCHEVERY = 16,
+    BATCHOPS = 8,
+    QUERYWORDS = 3,
+};
+
+struct Corpus
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+    int fd;
+};
+
+static int frameadd(struct Corpus *c, char const *json, size_t len)
+{
+    if (c->len + sizeof(uint32_t) + len > c->cap)
+    {
+        size_t const cap = 2 * (c->cap + sizeof(uint32_t) + len);
+        char *grown = realloc(c->buf, cap);
+        if (grown == NULL)
+            return -1;
+        c->buf = grown;
+        c->cap = cap;
+    }
+
+    uint32_t const n = (uint32_t)len;
+    memcpy(c->buf + c->len, &n, sizeof(n));
+    memcpy(c->buf + c->len + sizeof(n), json, len);
+    c->len += sizeof(n) + len;
+    return 0;
+}
+
+/* Mostly adds and queries, with a remove or batch now and then, as a busy client sends */
+static int corpusbuild(struct Corpus *c)
+{
+    uint64_t state = 1;
+    char json[1024];
+
+    for (int i = 0; i < NFRAMES; ++i)
+    {
+        int n;
+        if (i % BATCHEVERY == BATCHEVERY - 1)
+        {
+            n = snprintf(json, sizeof(json), "{\"op\":\"batch\",\"ops\":[");
+            for (int j = 0; j < BATCHOPS; ++j)
+                n += snprintf(json + n, sizeof(json) - (size_t)n, "%s{\"op\":\"%s\",\"path\":\"/bench/repo/%d\"}",
+                              j ? "," : "", j % 2 ? "remove" : "add", i + j);
+            n += snprintf(json + n, sizeof(json) - (size_t)n, "]}");
+        }
+        else if (i % 2 == 0)
+        {
+            n = snprintf(json, sizeof(json), "{\"op\":\"add\",\"path\":\"/bench/repo/%d\"}", i);
+        }
+        else
+        {
+            char terms[QUERYWORDS * MAXBENCHWORD];
+            size_t t = 0;
+            for (int j = 0; j < QUERYWORDS; ++j)
+            {
+                t += benchword(&state, terms + t);
+                terms[t++] = ' ';
+            }
+            terms[t - 1] = '\0';
+            n = snprintf(json, sizeof(json), "{\"op\":\"query\",\"queryId\":\"q%d\",\"terms\":\"%s\",\"repoFilter\":\"/bench/repo/%d\"}",
+                         i, terms, i % 64);
+        }
+
+        if (frameadd(c, json, (size_t)n) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void *writer(void *arg)
+{
+    struct Corpus *c = arg;
+
+    for (size_t off = 0; off < c->len;)
+    {
+        ssize_t const n = write(c->fd, c->buf + off, c->len - off);
+        if (n <= 0)
+            break;
+        off += (size_t)n;
+    }
+
+    close(c->fd);
+    return NULL;
+}
+
+/* Frames through a pipe into the parser, as the daemon reads a socket */
+static int run(void)
+{
+    int ret = -1;
+    struct Corpus c = { 0 };
+    if (corpusbuild(&c) != 0)
+        goto freecorpus;
+
+    int fds[2];
+    if (pipe(fds) != 0)
+        goto freecorpus;
+
+    Parser *p = parsercreate((size_t)MAXRECORDSIZE * 2);
+    if (p == NULL)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        goto freecorpus;
+    }
+
+    double const start = clocksec();
+
+    pthread_t thread;
+    c.fd = fds[1];
+    if (threadspawn(&thread, writer, &c) != 0)
+    {
+        close(fds[1]);
+        goto destroyparser;
+    }
+
+    Command cmd;
+    int nparsed = 0;
+    int rc = 0;
+    while (rc >= 0 && parserinput(p, fds[0]) > 0)
+        while ((rc = parsecommand(p, &cmd, NULL)) > 0)
+            nparsed++;
+
+    double const elapsed = clocksec() - start;
+
+    /* Unblocks the writer if parsing stopped early */
+    close(fds[0]);
+    fds[0] = -1;
+    pthread_join(thread, NULL);
+
+    if (nparsed != NFRAMES)
+    {
+        eprintf("expected %d frames, parsed %d\n", NFRAMES, nparsed);
+        goto destroyparser;
+    }
+
+    benchreport("frames", nparsed / elapsed, "frames/s");
+    benchreport("throughput", (double)c.len / elapsed / (1 << 20), "MB/s");
+    ret = 0;
+
+destroyparser:
+    parserdestroy(p);
+    if (fds[0] != -1)
+        close(fds[0]);
+freecorpus:
+    free(c.buf);
+    return ret;
+}
+
+static Bench const bench = {
+    .name = "parser",
+    .run = run,
+};
+
+__attribute__((constructor)) static void init(void)
+{
+    benchadd(&bench);
+}
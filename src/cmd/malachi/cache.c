@@ -0,0 +1,357 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "malachi.h"
+
+enum
+{
+    NBUCKETS = 512,
+};
+
+struct Hit
+{
+    size_t root;
+    size_t path;
+    double score;
+};
+
+/* Hits of one query, strings packed into a single arena and shared by reference */
+struct Results
+{
+    atomic_int refs;
+    int nhits;
+    int hitcap;
+    struct Hit *hits;
+    size_t len;
+    size_t cap;
+    char *data;
+};
+
+struct Entry
+{
+    char *terms;
+    char *filter;
+    uint64_t gen;
+    uint64_t hash;
+    Results *results;
+    struct Entry *next;
+    struct Entry *lrunext;
+    struct Entry *lruprev;
+};
+
+struct Rootgen
+{
+    char *root;
+    uint64_t gen;
+    struct Rootgen *next;
+};
+
+/*
+ * Ranked results keyed by (terms, repoFilter), tagged with the generation of
+ * the filtered root, or the global generation when no filter is given.  The
+ * writer bumps both after every commit, so a tag that no longer matches means
+ * the result may be stale.
+ */
+struct Cache
+{
+    pthread_mutex_t lock;
+    size_t cap;
+    size_t len;
+    uint64_t gen;
+    struct Rootgen *roots;
+    struct Entry lru;
+    struct Entry *buckets[NBUCKETS];
+};
+
+static char *strclone(char const *s)
+{
+    size_t len = strlen(s) + 1;
+    char *d = malloc(len);
+    if (d)
+        memcpy(d, s, len);
+    return d;
+}
+
+static uint64_t keyhash(char const *terms, char const *filter)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (char const *c = terms; *c; ++c)
+        h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+    h = (h ^ 0x1f) * 1099511628211ULL;
+    for (char const *c = filter; *c; ++c)
+        h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+    return h;
+}
+
+Results *resultscreate(void)
+{
+    Results *r = calloc(1, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+
+    atomic_init(&r->refs, 1);
+    return r;
+}
+
+void resultsrelease(Results *r)
+{
+    if (r == NULL || atomic_fetch_sub(&r->refs, 1) != 1)
+        return;
+
+    free(r->hits);
+    free(r->data);
+    free(r);
+}
+
+static int resultsstr(Results *r, char const *s, size_t *off)
+{
+    size_t const n = strlen(s) + 1;
+    if (r->len + n > r->cap)
+    {
+        size_t cap = r->cap ? r->cap : 4096;
+        while (r->len + n > cap)
+            cap *= 2;
+        char *data = realloc(r->data, cap);
+        if (data == NULL)
+            return -1;
+        r->data = data;
+        r->cap = cap;
+    }
+
+    memcpy(r->data + r->len, s, n);
+    *off = r->len;
+    r->len += n;
+    return 0;
+}
+
+int resultsadd(Results *r, char const *root, char const *path, double score)
+{
+    if (r->nhits == r->hitcap)
+    {
+        int const cap = r->hitcap ? 2 * r->hitcap : 32;
+        struct Hit *hits = realloc(r->hits, (size_t)cap * sizeof(hits[0]));
+        if (hits == NULL)
+            return -1;
+        r->hits = hits;
+        r->hitcap = cap;
+    }
+
+    struct Hit *h = &r->hits[r->nhits];
+    if (resultsstr(r, root, &h->root) != 0 || resultsstr(r, path, &h->path) != 0)
+        return -1;
+
+    h->score = score;
+    r->nhits++;
+    return 0;
+}
+
+int resultseach(Results const *r, Hitfn *fn, void *arg)
+{
+    for (int i = 0; i < r->nhits; ++i)
+    {
+        struct Hit const *h = &r->hits[i];
+        if (fn(r->data + h->root, r->data + h->path, h->score, arg) != 0)
+            return -1;
+    }
+    return r->nhits;
+}
+
+static void lruunlink(struct Entry *e)
+{
+    e->lruprev->lrunext = e->lrunext;
+    e->lrunext->lruprev = e->lruprev;
+}
+
+static void lrupush(Cache *c, struct Entry *e)
+{
+    e->lrunext = c->lru.lrunext;
+    e->lruprev = &c->lru;
+    c->lru.lrunext->lruprev = e;
+    c->lru.lrunext = e;
+}
+
+static void entryremove(Cache *c, struct Entry *e)
+{
+    struct Entry **link = &c->buckets[e->hash % NBUCKETS];
+    while (*link != e)
+        link = &(*link)->next;
+    *link = e->next;
+
+    lruunlink(e);
+    c->len--;
+
+    resultsrelease(e->results);
+    free(e->terms);
+    free(e->filter);
+    free(e);
+}
+
+static struct Entry *entryfind(Cache *c, uint64_t hash, char const *terms, char const *filter)
+{
+    for (struct Entry *e = c->buckets[hash % NBUCKETS]; e; e = e->next)
+        if (e->hash == hash && strcmp(e->terms, terms) == 0 && strcmp(e->filter, filter) == 0)
+            return e;
+    return NULL;
+}
+
+Cache *cachecreate(size_t cap)
+{
+    if (cap == 0)
+        return NULL;
+
+    Cache *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&c->lock, NULL) != 0)
+    {
+        free(c);
+        return NULL;
+    }
+
+    c->cap = cap;
+    c->lru.lrunext = &c->lru;
+    c->lru.lruprev = &c->lru;
+    return c;
+}
+
+void cachedestroy(Cache *c)
+{
+    if (c == NULL)
+        return;
+
+    while (c->lru.lrunext != &c->lru)
+        entryremove(c, c->lru.lrunext);
+
+    for (struct Rootgen *rg = c->roots, *next; rg; rg = next)
+    {
+        next = rg->next;
+        free(rg->root);
+        free(rg);
+    }
+
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+static struct Rootgen *rootgenfind(Cache *c, char const *root)
+{
+    for (struct Rootgen *rg = c->roots; rg; rg = rg->next)
+        if (strcmp(rg->root, root) == 0)
+            return rg;
+    return NULL;
+}
+
+void cachebump(Cache *c, char const *root)
+{
+    pthread_mutex_lock(&c->lock);
+
+    c->gen++;
+
+    struct Rootgen *rg = rootgenfind(c, root);
+    if (rg == NULL)
+    {
+        rg = malloc(sizeof(*rg));
+        char *copy = strclone(root);
+        if (rg == NULL || copy == NULL)
+        {
+            /* Without a slot the root cannot be tagged, so nothing cached may survive */
+            free(rg);
+            free(copy);
+            while (c->lru.lrunext != &c->lru)
+                entryremove(c, c->lru.lrunext);
+            goto unlock;
+        }
+        rg->root = copy;
+        rg->next = c->roots;
+        c->roots = rg;
+    }
+
+    rg->gen = c->gen;
+
+unlock:
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Read before the query takes its snapshot, so a commit racing the query invalidates it */
+uint64_t cachegen(Cache *c, char const *root)
+{
+    pthread_mutex_lock(&c->lock);
+
+    uint64_t gen = c->gen;
+    if (root && *root)
+    {
+        struct Rootgen *rg = rootgenfind(c, root);
+        gen = rg ? rg->gen : 0;
+    }
+
+    pthread_mutex_unlock(&c->lock);
+    return gen;
+}
+
+Results *cacheget(Cache *c, char const *terms, char const *filter, uint64_t gen)
+{
+    uint64_t const hash = keyhash(terms, filter);
+    Results *r = NULL;
+
+    pthread_mutex_lock(&c->lock);
+
+    struct Entry *e = entryfind(c, hash, terms, filter);
+    if (e && e->gen != gen)
+    {
+        entryremove(c, e);
+        e = NULL;
+    }
+
+    if (e)
+    {
+        lruunlink(e);
+        lrupush(c, e);
+        r = e->results;
+        atomic_fetch_add(&r->refs, 1);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+    return r;
+}
+
+void cacheput(Cache *c, char const *terms, char const *filter, uint64_t gen, Results *r)
+{
+    uint64_t const hash = keyhash(terms, filter);
+
+    struct Entry *e = malloc(sizeof(*e));
+    if (e == NULL)
+        return;
+
+    e->terms = strclone(terms);
+    e->filter = strclone(filter);
+    if (e->terms == NULL || e->filter == NULL)
+    {
+        free(e->terms);
+        free(e->filter);
+        free(e);
+        return;
+    }
+
+    e->gen = gen;
+    e->hash = hash;
+    e->results = r;
+    atomic_fetch_add(&r->refs, 1);
+
+    pthread_mutex_lock(&c->lock);
+
+    struct Entry *old = entryfind(c, hash, terms, filter);
+    if (old)
+        entryremove(c, old);
+
+    while (c->len >= c->cap)
+        entryremove(c, c->lru.lruprev);
+
+    e->next = c->buckets[hash % NBUCKETS];
+    c->buckets[hash % NBUCKETS] = e;
+    lrupush(c, e);
+    c->len++;
+
+    pthread_mutex_unlock(&c->lock);
+}
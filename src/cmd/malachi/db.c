@@ -1,19 +1,140 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <sqlite3.h>
 
 #include "malachi.h"
 #include "schema.h"
 
+/* Bumped whenever schema.sql changes incompatibly, older indexes are rebuilt */
+enum
+{
+    SCHEMAVERSION = 4,
+};
+
+enum
+{
+    BUSYTIMEOUTMS = 5000,
+};
+
+/*
+ * Commits merge FTS segments only once a level holds FTSAUTOMERGE of them,
+ * leaving most merging to dbftsmerge() between commits.  FTSCRISISMERGE
+ * bounds how far segments pile up while the writer is never idle.
+ */
+enum
+{
+    FTSAUTOMERGE = 8,
+    FTSCRISISMERGE = 16,
+};
+
+static char const *const ftstables[] = { "leaves_fts", "blobs_fts", "blob_pages_fts" };
+
+/*
+ * Search runs one tier per FTS table, each ranked by bm25 and limited to the
+ * hits still wanted.  Later tiers skip leaves an earlier tier already matched.
+ * bm25() cannot be used under a join or an aggregate, hence the materialized CTEs.
+ */
+#define SEARCHFILTER " AND (?2 IS NULL OR roots.root_path = ?2)"
+
+#define PATHHITS "SELECT rowid AS leaf_id, bm25(leaves_fts) AS score FROM leaves_fts WHERE leaves_fts MATCH ?1"
+#define BLOBHITS "SELECT rowid AS blob_id, bm25(blobs_fts) AS score FROM blobs_fts WHERE blobs_fts MATCH ?1"
+#define PAGEHITS "SELECT rowid AS page_id, bm25(blob_pages_fts) AS score FROM blob_pages_fts" \
+                 " WHERE blob_pages_fts MATCH ?1"
+
+#define SEARCHPATHS "WITH hits AS MATERIALIZED (" PATHHITS ")"                                         \
+                    " SELECT roots.root_path, leaves.leaf_path, hits.score FROM hits"                  \
+                    " JOIN leaves ON leaves.id = hits.leaf_id JOIN roots ON roots.id = leaves.root_id" \
+                    " WHERE 1" SEARCHFILTER " ORDER BY hits.score LIMIT ?3"
+
+#define SEARCHBLOBS "WITH hits AS MATERIALIZED (" BLOBHITS "), seen AS MATERIALIZED (" PATHHITS ")"         \
+                    " SELECT roots.root_path, leaves.leaf_path, hits.score FROM hits"                       \
+                    " JOIN leaves ON leaves.blob_id = hits.blob_id JOIN roots ON roots.id = leaves.root_id" \
+                    " WHERE leaves.id NOT IN (SELECT leaf_id FROM seen)" SEARCHFILTER                       \
+                    " ORDER BY hits.score LIMIT ?3"
+
+#define SEARCHPAGES "WITH pages AS MATERIALIZED (" PAGEHITS "),"                                            \
+                    " hits AS MATERIALIZED (SELECT blob_pages.blob_id, min(pages.score) AS score"           \
+                    " FROM pages JOIN blob_pages ON blob_pages.id = pages.page_id"                          \
+                    " GROUP BY blob_pages.blob_id),"                                                        \
+                    " seen AS MATERIALIZED (" PATHHITS "), seenblobs AS MATERIALIZED (" BLOBHITS ")"        \
+                    " SELECT roots.root_path, leaves.leaf_path, hits.score FROM hits"                       \
+                    " JOIN leaves ON leaves.blob_id = hits.blob_id JOIN roots ON roots.id = leaves.root_id" \
+                    " WHERE leaves.id NOT IN (SELECT leaf_id FROM seen)"                                    \
+                    " AND leaves.blob_id NOT IN (SELECT blob_id FROM seenblobs)" SEARCHFILTER               \
+                    " ORDER BY hits.score LIMIT ?3"
+
+/* Hot statements, prepared on first use and kept for the life of the connection */
+#define STATEMENTS                                                                                       \
+    X(Strepoget, "SELECT root_hash FROM roots WHERE root_path = ?")                                      \
+    X(Streposet, "INSERT INTO roots (root_path, root_hash, updated_at) VALUES (?, ?, CURRENT_TIMESTAMP)" \
+                 " ON CONFLICT (root_path) DO UPDATE SET root_hash = excluded.root_hash,"                \
+                 " updated_at = excluded.updated_at")                                                    \
+    X(Strootadd, "INSERT INTO roots (root_path, root_hash) VALUES (?, '')"                               \
+                 " ON CONFLICT (root_path) DO UPDATE SET updated_at = CURRENT_TIMESTAMP RETURNING id")   \
+    X(Strootbury, "INSERT OR IGNORE INTO root_tombstones (root_id)"                                      \
+                  " SELECT id FROM roots WHERE root_path = ?")                                           \
+    X(Strootdel, "DELETE FROM roots WHERE root_path = ?")                                                \
+    X(Streclaimnext, "SELECT root_id FROM root_tombstones LIMIT 1")                                      \
+    X(Streclaimleaves, "DELETE FROM leaves WHERE id IN"                                                  \
+                       " (SELECT id FROM leaves WHERE root_id = ?1 LIMIT ?2)")                           \
+    X(Streclaimdone, "DELETE FROM root_tombstones WHERE root_id = ?")                                    \
+    X(Storphansweep, "DELETE FROM blobs WHERE id IN"                                                     \
+                     " (SELECT blob_id FROM blob_orphans ORDER BY blob_id LIMIT ?1)"                     \
+                     " AND NOT EXISTS (SELECT 1 FROM leaves WHERE leaves.blob_id = blobs.id)")           \
+    X(Storphanclear, "DELETE FROM blob_orphans WHERE blob_id IN"                                         \
+                     " (SELECT blob_id FROM blob_orphans ORDER BY blob_id LIMIT ?1)")                    \
+    X(Stleafclear, "DELETE FROM leaves WHERE root_id = ?")                                               \
+    X(Stblobfind, "SELECT id FROM blobs WHERE blob_hash = ?")                                            \
+    X(Stblobput, "INSERT INTO blobs (blob_hash, blob_size, filter_name, content) VALUES (?, ?, ?, ?)")   \
+    X(Stblobfill, "UPDATE blobs SET filter_name = ?, content = ? WHERE id = ?")                          \
+    X(Stpageput, "INSERT INTO blob_pages (blob_id, page_number, content) VALUES (?, ?, ?)")              \
+    X(Stpageclear, "DELETE FROM blob_pages WHERE blob_id = ?")                                           \
+    X(Stleafput, "INSERT INTO leaves (root_id, blob_id, leaf_path) VALUES (?, ?, ?)")                    \
+    X(Stleafdel, "DELETE FROM leaves WHERE root_id = ? AND leaf_path = ?")                               \
+    X(Stleafmove, "UPDATE leaves SET leaf_path = ?, indexed_at = CURRENT_TIMESTAMP"                      \
+                  " WHERE root_id = ? AND leaf_path = ?")                                                \
+    X(Stsearchpaths, SEARCHPATHS)                                                                        \
+    X(Stsearchblobs, SEARCHBLOBS)                                                                        \
+    X(Stsearchpages, SEARCHPAGES)
+
+typedef enum Stmt
+{
+#define X(id, sql) id,
+    STATEMENTS
+#undef X
+    Nstmts,
+} Stmt;
+
+static char const *const stmtsql[] = {
+#define X(id, sql) [id] = sql,
+    STATEMENTS
+#undef X
+};
+
+/* Each statement's histogram is named for its identifier, less the St */
+static char const *const stmtname[] = {
+#define X(id, sql) [id] = #id,
+    STATEMENTS
+#undef X
+};
+
 struct Database
 {
     sqlite3 *conn;
     char *path;
+    sqlite3_stmt *stmts[Nstmts];
+    Metric *times[Nstmts];
+    Metric *committime;
+    Stmt active;
+    double since;
+    unsigned long nprepared;
+    unsigned long nreused;
 };
 
-Database *dbcreate(Config const *config, Error *err)
+static Database *dbopen(Config const *config, int flags, Error *err)
 {
     Database *db = malloc(sizeof(Database));
     if (!db)
@@ -25,6 +146,17 @@ Database *dbcreate(Config const *config, Error *err)
 
     db->conn = NULL;
     db->path = NULL;
+    db->nprepared = 0;
+    db->nreused = 0;
+    for (int i = 0; i < Nstmts; ++i)
+    {
+        char name[64];
+        (void)snprintf(name, sizeof(name), "db.%s", stmtname[i] + 2);
+        db->stmts[i] = NULL;
+        db->times[i] = metricget(name, Mhistogram);
+    }
+    /* Only a writer's commits take any time */
+    db->committime = flags & SQLITE_OPEN_READONLY ? NULL : metricget("db.commit", Mhistogram);
 
     int rc = mkdirp(config->cachedir, 0755);
     if (rc != 0)
@@ -44,7 +176,7 @@ Database *dbcreate(Config const *config, Error *err)
         return NULL;
     }
 
-    rc = sqlite3_open(dbpath, &db->conn);
+    rc = sqlite3_open_v2(dbpath, &db->conn, flags, NULL);
     if (rc != SQLITE_OK)
     {
         err->rc = rc;
@@ -55,10 +187,87 @@ Database *dbcreate(Config const *config, Error *err)
     }
 
     db->path = dbpath;
+    (void)sqlite3_busy_timeout(db->conn, BUSYTIMEOUTMS);
+    return db;
+}
 
-    rc = dbensure(db, err);
-    if (rc != 0)
+/* Readers keep working from their snapshot while the indexer holds a write transaction */
+static int dbwal(Database *db, Error *err)
+{
+    sqlite3_stmt *stmt;
+
+    int rc = sqlite3_prepare_v2(db->conn, "PRAGMA journal_mode = WAL", -1, &stmt, NULL);
+    if (rc != SQLITE_OK)
+        goto fail;
+
+    rc = sqlite3_step(stmt);
+    int const ok = rc == SQLITE_ROW && sqlite3_stricmp((char const *)sqlite3_column_text(stmt, 0), "wal") == 0;
+    sqlite3_finalize(stmt);
+
+    if (!ok)
+        goto fail;
+
+    rc = sqlite3_exec(db->conn, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+        goto fail;
+
+    return 0;
+
+fail:
+    err->rc = sqlite3_errcode(db->conn);
+    err->msg = "Failed to enable write-ahead logging";
+    return -1;
+}
+
+/* Merge settings live in each FTS table's config, so they are set on every open */
+static int dbftstune(Database *db, Error *err)
+{
+    for (size_t i = 0; i < NELEM(ftstables); ++i)
     {
+        char sql[256];
+        (void)snprintf(sql, sizeof(sql),
+                       "INSERT INTO %s (%s, rank) VALUES ('automerge', %d);"
+                       "INSERT INTO %s (%s, rank) VALUES ('crisismerge', %d);",
+                       ftstables[i], ftstables[i], FTSAUTOMERGE, ftstables[i], ftstables[i], FTSCRISISMERGE);
+
+        int const rc = sqlite3_exec(db->conn, sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK)
+        {
+            err->rc = rc;
+            err->msg = sqlite3_errmsg(db->conn);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+Database *dbcreate(Config const *config, Error *err)
+{
+    Database *db = dbopen(config, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, err);
+    if (db == NULL)
+        return NULL;
+
+    if (dbensure(db, err) != 0 || dbwal(db, err) != 0 || dbftstune(db, err) != 0)
+    {
+        dbdestroy(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+Database *dbopenreader(Config const *config, Error *err)
+{
+    Database *db = dbopen(config, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, err);
+    if (db == NULL)
+        return NULL;
+
+    int rc = sqlite3_exec(db->conn, "PRAGMA query_only = ON", NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+    {
+        err->rc = rc;
+        err->msg = sqlite3_errmsg(db->conn);
         dbdestroy(db);
         return NULL;
     }
@@ -71,6 +280,11 @@ void dbdestroy(Database *db)
     if (!db)
         return;
 
+    logdebug("Statements prepared: %lu, reused: %lu", db->nprepared, db->nreused);
+
+    for (int i = 0; i < Nstmts; ++i)
+        sqlite3_finalize(db->stmts[i]);
+
     if (db->conn)
         sqlite3_close(db->conn);
 
@@ -80,8 +294,46 @@ void dbdestroy(Database *db)
     free(db);
 }
 
+static int64_t dbscalar(Database *db, char const *sql)
+{
+    sqlite3_stmt *stmt;
+
+    int rc = sqlite3_prepare_v2(db->conn, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK)
+        return -1;
+
+    int64_t value = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        value = sqlite3_column_int64(stmt, 0);
+
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+/* The index lives in the cache directory, so an outdated one is simply emptied */
+static int dbreset(Database *db)
+{
+    loginfo("Index schema is outdated, rebuilding %s", db->path);
+
+    (void)sqlite3_db_config(db->conn, SQLITE_DBCONFIG_RESET_DATABASE, 1, NULL);
+    int rc = sqlite3_exec(db->conn, "VACUUM", NULL, NULL, NULL);
+    (void)sqlite3_db_config(db->conn, SQLITE_DBCONFIG_RESET_DATABASE, 0, NULL);
+
+    return rc == SQLITE_OK ? 0 : -1;
+}
+
 int dbensure(Database *db, Error *err)
 {
+    int64_t const version = dbscalar(db, "PRAGMA user_version");
+    int64_t const nobjects = dbscalar(db, "SELECT count(*) FROM sqlite_master");
+
+    if (version != SCHEMAVERSION && nobjects > 0 && dbreset(db) != 0)
+    {
+        err->rc = sqlite3_errcode(db->conn);
+        err->msg = sqlite3_errmsg(db->conn);
+        return -1;
+    }
+
     char const *sql = MALACHI_SCHEMA_SQL;
     int rc = sqlite3_exec(db->conn, sql, NULL, NULL, NULL);
 
@@ -92,26 +344,67 @@ int dbensure(Database *db, Error *err)
         return -1;
     }
 
+    char pragma[64];
+    (void)snprintf(pragma, sizeof(pragma), "PRAGMA user_version = %d", SCHEMAVERSION);
+    rc = sqlite3_exec(db->conn, pragma, NULL, NULL, NULL);
+
+    if (rc != SQLITE_OK)
+    {
+        err->rc = rc;
+        err->msg = sqlite3_errmsg(db->conn);
+        return -1;
+    }
+
     return 0;
 }
 
-char *dbrepoget(Database *db, char const *repopath)
+static sqlite3_stmt *dbstmt(Database *db, Stmt id)
 {
-    char const *sql = "SELECT root_hash FROM roots WHERE root_path = ?";
-    sqlite3_stmt *stmt;
+    db->active = id;
+    db->since = clocksec();
 
-    int rc = sqlite3_prepare_v2(db->conn, sql, -1, &stmt, NULL);
+    if (db->stmts[id] != NULL)
+    {
+        db->nreused++;
+        return db->stmts[id];
+    }
+
+    int rc = sqlite3_prepare_v3(db->conn, stmtsql[id], -1, SQLITE_PREPARE_PERSISTENT, &db->stmts[id], NULL);
     if (rc != SQLITE_OK)
     {
-        logerror("Failed to prepare repo query: %s", sqlite3_errmsg(db->conn));
+        logerror("Failed to prepare %s: %s", stmtsql[id], sqlite3_errmsg(db->conn));
+        db->stmts[id] = NULL;
         return NULL;
     }
 
-    rc = sqlite3_bind_text(stmt, 1, repopath, -1, SQLITE_STATIC);
+    db->nprepared++;
+    return db->stmts[id];
+}
+
+/*
+ * Cached statements are handed back reset, with bindings to caller memory
+ * dropped.  The time since dbstmt, preparing, binding and stepping, goes to
+ * the statement's histogram; a connection runs one statement at a time.
+ * Time spent handing search hits to the caller is left out.
+ */
+static void dbrelease(Database *db, sqlite3_stmt *stmt)
+{
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    metrictime(db->times[db->active], clocksec() - db->since);
+}
+
+char *dbrepoget(Database *db, char const *repopath)
+{
+    sqlite3_stmt *stmt = dbstmt(db, Strepoget);
+    if (stmt == NULL)
+        return NULL;
+
+    int rc = sqlite3_bind_text(stmt, 1, repopath, -1, SQLITE_STATIC);
     if (rc != SQLITE_OK)
     {
         logerror("Failed to bind repo path: %s", sqlite3_errmsg(db->conn));
-        sqlite3_finalize(stmt);
+        dbrelease(db, stmt);
         return NULL;
     }
 
@@ -133,50 +426,633 @@ char *dbrepoget(Database *db, char const *repopath)
         logerror("Failed to execute repo query: %s", sqlite3_errmsg(db->conn));
     }
 
-    sqlite3_finalize(stmt);
+    dbrelease(db, stmt);
     return sha;
 }
 
 int dbreposet(Database *db, char const *repopath, char const *sha)
 {
-    char const *sql = "INSERT OR REPLACE INTO roots (root_path, root_hash, updated_at) VALUES (?, ?, CURRENT_TIMESTAMP)";
-    sqlite3_stmt *stmt;
+    sqlite3_stmt *stmt = dbstmt(db, Streposet);
+    if (stmt == NULL)
+        return -1;
 
-    int rc = sqlite3_prepare_v2(db->conn, sql, -1, &stmt, NULL);
+    int rc = sqlite3_bind_text(stmt, 1, repopath, -1, SQLITE_STATIC);
+    if (rc != SQLITE_OK)
+    {
+        logerror("Failed to bind repo path: %s", sqlite3_errmsg(db->conn));
+        dbrelease(db, stmt);
+        return -1;
+    }
+
+    rc = sqlite3_bind_text(stmt, 2, sha, -1, SQLITE_STATIC);
     if (rc != SQLITE_OK)
     {
-        logerror("Failed to prepare repo update: %s", sqlite3_errmsg(db->conn));
+        logerror("Failed to bind SHA: %s", sqlite3_errmsg(db->conn));
+        dbrelease(db, stmt);
+        return -1;
+    }
+
+    rc = sqlite3_step(stmt);
+    dbrelease(db, stmt);
+
+    if (rc != SQLITE_DONE)
+    {
+        logerror("Failed to update repository: %s", sqlite3_errmsg(db->conn));
         return -1;
     }
 
-    rc = sqlite3_bind_text(stmt, 1, repopath, -1, SQLITE_STATIC);
+    return 0;
+}
+
+static int dbexec(Database *db, char const *sql)
+{
+    int rc = sqlite3_exec(db->conn, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+    {
+        logerror("Failed to execute %s: %s", sql, sqlite3_errmsg(db->conn));
+        return -1;
+    }
+    return 0;
+}
+
+int dbbegin(Database *db)
+{
+    return dbexec(db, "BEGIN IMMEDIATE");
+}
+
+/* Deferred, so the snapshot is taken by the first read */
+int dbbeginread(Database *db)
+{
+    return dbexec(db, "BEGIN DEFERRED");
+}
+
+int dbcommit(Database *db)
+{
+    double const start = clocksec();
+    int const rc = dbexec(db, "COMMIT");
+    metrictime(db->committime, clocksec() - start);
+    return rc;
+}
+
+int dbrollback(Database *db)
+{
+    if (sqlite3_get_autocommit(db->conn))
+        return 0;
+    return dbexec(db, "ROLLBACK");
+}
+
+/*
+ * Writes up to about npages of merged FTS segments per table, in one
+ * transaction.  Returns 1 if any table had segments to merge, 0 once no
+ * level of any table holds enough of them.
+ */
+int dbftsmerge(Database *db, int npages)
+{
+    int merged = 0;
+
+    if (dbbegin(db) != 0)
+        return -1;
+
+    for (size_t i = 0; i < NELEM(ftstables); ++i)
+    {
+        char sql[128];
+        (void)snprintf(sql, sizeof(sql), "INSERT INTO %s (%s, rank) VALUES ('merge', %d)", ftstables[i], ftstables[i], npages);
+
+        /* FTS5 documents a change count of two or more as work done */
+        int const before = sqlite3_total_changes(db->conn);
+        if (dbexec(db, sql) != 0)
+        {
+            (void)dbrollback(db);
+            return -1;
+        }
+        merged |= sqlite3_total_changes(db->conn) - before >= 2;
+    }
+
+    if (dbcommit(db) != 0)
+    {
+        (void)dbrollback(db);
+        return -1;
+    }
+
+    return merged;
+}
+
+/* Merges every table into a single segment, costly on a large index */
+int dbftsoptimize(Database *db)
+{
+    if (dbbegin(db) != 0)
+        return -1;
+
+    for (size_t i = 0; i < NELEM(ftstables); ++i)
+    {
+        char sql[128];
+        (void)snprintf(sql, sizeof(sql), "INSERT INTO %s (%s) VALUES ('optimize')", ftstables[i], ftstables[i]);
+        if (dbexec(db, sql) != 0)
+        {
+            (void)dbrollback(db);
+            return -1;
+        }
+    }
+
+    if (dbcommit(db) != 0)
+    {
+        (void)dbrollback(db);
+        return -1;
+    }
+
+    return 0;
+}
+
+int64_t dbrootadd(Database *db, char const *repopath)
+{
+    sqlite3_stmt *stmt = dbstmt(db, Strootadd);
+    if (stmt == NULL)
+        return -1;
+
+    int rc = sqlite3_bind_text(stmt, 1, repopath, -1, SQLITE_STATIC);
     if (rc != SQLITE_OK)
     {
         logerror("Failed to bind repo path: %s", sqlite3_errmsg(db->conn));
-        sqlite3_finalize(stmt);
+        dbrelease(db, stmt);
         return -1;
     }
 
-    rc = sqlite3_bind_text(stmt, 2, sha, -1, SQLITE_STATIC);
+    int64_t id = -1;
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW)
+        id = sqlite3_column_int64(stmt, 0);
+    else
+        logerror("Failed to insert root: %s", sqlite3_errmsg(db->conn));
+
+    dbrelease(db, stmt);
+    return id;
+}
+
+/*
+ * Buries the root rather than deleting its leaves, each of which costs an
+ * FTS update.  Searches join leaves to roots, so they stop matching at
+ * once; dbrootreclaim() deletes them later, a chunk at a time.
+ */
+int dbrootdel(Database *db, char const *repopath)
+{
+    static Stmt const ids[] = { Strootbury, Strootdel };
+
+    for (size_t i = 0; i < NELEM(ids); ++i)
+    {
+        sqlite3_stmt *stmt = dbstmt(db, ids[i]);
+        if (stmt == NULL)
+            return -1;
+
+        int rc = sqlite3_bind_text(stmt, 1, repopath, -1, SQLITE_STATIC);
+        if (rc != SQLITE_OK)
+        {
+            logerror("Failed to bind repo path: %s", sqlite3_errmsg(db->conn));
+            dbrelease(db, stmt);
+            return -1;
+        }
+
+        rc = sqlite3_step(stmt);
+        dbrelease(db, stmt);
+
+        if (rc != SQLITE_DONE)
+        {
+            logerror("Failed to delete root %s: %s", repopath, sqlite3_errmsg(db->conn));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int dbstepint(Database *db, Stmt id, int64_t a, int64_t b)
+{
+    sqlite3_stmt *stmt = dbstmt(db, id);
+    if (stmt == NULL)
+        return -1;
+
+    int rc = sqlite3_bind_int64(stmt, 1, a);
+    if (rc == SQLITE_OK && sqlite3_bind_parameter_count(stmt) > 1)
+        rc = sqlite3_bind_int64(stmt, 2, b);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_step(stmt);
+    dbrelease(db, stmt);
+
+    if (rc != SQLITE_DONE)
+    {
+        logerror("Failed to reclaim: %s", sqlite3_errmsg(db->conn));
+        return -1;
+    }
+
+    return sqlite3_changes(db->conn);
+}
+
+/*
+ * Deletes up to limit leaves of a buried root, then sweeps as many orphaned
+ * blobs, in one transaction.  Returns 1 while there may be more to do, 0 once
+ * nothing is buried.
+ */
+int dbrootreclaim(Database *db, int limit)
+{
+    if (dbbegin(db) != 0)
+        return -1;
+
+    sqlite3_stmt *stmt = dbstmt(db, Streclaimnext);
+    if (stmt == NULL)
+        goto rollback;
+
+    int rc = sqlite3_step(stmt);
+    int64_t const rootid = rc == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    dbrelease(db, stmt);
+
+    if (rc == SQLITE_DONE)
+        return dbcommit(db) == 0 ? 0 : -1;
+    if (rc != SQLITE_ROW)
+        goto rollback;
+
+    int const nleaves = dbstepint(db, Streclaimleaves, rootid, limit);
+    if (nleaves < 0)
+        goto rollback;
+    if (nleaves < limit && dbstepint(db, Streclaimdone, rootid, 0) < 0)
+        goto rollback;
+    if (dbstepint(db, Storphansweep, limit, 0) < 0 || dbstepint(db, Storphanclear, limit, 0) < 0)
+        goto rollback;
+
+    if (dbcommit(db) != 0)
+        goto rollback;
+    return 1;
+
+rollback:
+    (void)dbrollback(db);
+    return -1;
+}
+
+int dbleafclear(Database *db, int64_t rootid)
+{
+    sqlite3_stmt *stmt = dbstmt(db, Stleafclear);
+    if (stmt == NULL)
+        return -1;
+
+    (void)sqlite3_bind_int64(stmt, 1, rootid);
+
+    int rc = sqlite3_step(stmt);
+    dbrelease(db, stmt);
+
+    if (rc != SQLITE_DONE)
+    {
+        logerror("Failed to delete leaves: %s", sqlite3_errmsg(db->conn));
+        return -1;
+    }
+
+    return 0;
+}
+
+int64_t dbblobfind(Database *db, char const *hash)
+{
+    sqlite3_stmt *stmt = dbstmt(db, Stblobfind);
+    if (stmt == NULL)
+        return -1;
+
+    int rc = sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
     if (rc != SQLITE_OK)
     {
-        logerror("Failed to bind SHA: %s", sqlite3_errmsg(db->conn));
-        sqlite3_finalize(stmt);
+        logerror("Failed to bind blob hash: %s", sqlite3_errmsg(db->conn));
+        dbrelease(db, stmt);
         return -1;
     }
 
+    int64_t id = 0;
     rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    if (rc == SQLITE_ROW)
+        id = sqlite3_column_int64(stmt, 0);
+    else if (rc != SQLITE_DONE)
+        id = -1;
+
+    if (id < 0)
+        logerror("Failed to look up blob %s: %s", hash, sqlite3_errmsg(db->conn));
+
+    dbrelease(db, stmt);
+    return id;
+}
+
+int64_t dbblobput(Database *db, Leaf const *leaf)
+{
+    sqlite3_stmt *stmt = dbstmt(db, Stblobput);
+    if (stmt == NULL)
+        return -1;
+
+    int rc = sqlite3_bind_text(stmt, 1, leaf->hash, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_int64(stmt, 2, leaf->size);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_text(stmt, 3, leaf->filter, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_text(stmt, 4, leaf->content, -1, SQLITE_STATIC);
+    if (rc != SQLITE_OK)
+    {
+        logerror("Failed to bind blob: %s", sqlite3_errmsg(db->conn));
+        dbrelease(db, stmt);
+        return -1;
+    }
+
+    rc = sqlite3_step(stmt);
+    dbrelease(db, stmt);
 
     if (rc != SQLITE_DONE)
     {
-        logerror("Failed to update repository: %s", sqlite3_errmsg(db->conn));
+        logerror("Failed to insert blob %s: %s", leaf->hash, sqlite3_errmsg(db->conn));
+        return -1;
+    }
+
+    return sqlite3_last_insert_rowid(db->conn);
+}
+
+int dbblobfill(Database *db, int64_t blobid, char const *filter, char const *content)
+{
+    sqlite3_stmt *stmt = dbstmt(db, Stblobfill);
+    if (stmt == NULL)
+        return -1;
+
+    int rc = sqlite3_bind_text(stmt, 1, filter, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_text(stmt, 2, content, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_int64(stmt, 3, blobid);
+    if (rc != SQLITE_OK)
+    {
+        logerror("Failed to bind blob content: %s", sqlite3_errmsg(db->conn));
+        dbrelease(db, stmt);
+        return -1;
+    }
+
+    rc = sqlite3_step(stmt);
+    dbrelease(db, stmt);
+
+    if (rc != SQLITE_DONE)
+    {
+        logerror("Failed to store blob content: %s", sqlite3_errmsg(db->conn));
         return -1;
     }
 
     return 0;
 }
 
+int dbblobsweep(Database *db)
+{
+    char const *sql = "DELETE FROM blobs WHERE id IN (SELECT blob_id FROM blob_orphans)"
+                      " AND NOT EXISTS (SELECT 1 FROM leaves WHERE leaves.blob_id = blobs.id);"
+                      "DELETE FROM blob_orphans;";
+    return dbexec(db, sql);
+}
+
+int dbpageput(Database *db, int64_t blobid, int page, char const *content)
+{
+    sqlite3_stmt *stmt = dbstmt(db, Stpageput);
+    if (stmt == NULL)
+        return -1;
+
+    int rc = sqlite3_bind_int64(stmt, 1, blobid);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_int(stmt, 2, page);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_text(stmt, 3, content, -1, SQLITE_STATIC);
+    if (rc != SQLITE_OK)
+    {
+        logerror("Failed to bind page: %s", sqlite3_errmsg(db->conn));
+        dbrelease(db, stmt);
+        return -1;
+    }
+
+    rc = sqlite3_step(stmt);
+    dbrelease(db, stmt);
+
+    if (rc != SQLITE_DONE)
+    {
+        logerror("Failed to insert page %d of blob %lld: %s", page, (long long)blobid, sqlite3_errmsg(db->conn));
+        return -1;
+    }
+
+    return 0;
+}
+
+int dbpageclear(Database *db, int64_t blobid)
+{
+    sqlite3_stmt *stmt = dbstmt(db, Stpageclear);
+    if (stmt == NULL)
+        return -1;
+
+    (void)sqlite3_bind_int64(stmt, 1, blobid);
+
+    int rc = sqlite3_step(stmt);
+    dbrelease(db, stmt);
+
+    if (rc != SQLITE_DONE)
+    {
+        logerror("Failed to delete pages of blob %lld: %s", (long long)blobid, sqlite3_errmsg(db->conn));
+        return -1;
+    }
+
+    return 0;
+}
+
+int dbleafput(Database *db, int64_t rootid, int64_t blobid, char const *path)
+{
+    sqlite3_stmt *stmt = dbstmt(db, Stleafput);
+    if (stmt == NULL)
+        return -1;
+
+    int rc = sqlite3_bind_int64(stmt, 1, rootid);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_int64(stmt, 2, blobid);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
+    if (rc != SQLITE_OK)
+    {
+        logerror("Failed to bind leaf: %s", sqlite3_errmsg(db->conn));
+        dbrelease(db, stmt);
+        return -1;
+    }
+
+    rc = sqlite3_step(stmt);
+    dbrelease(db, stmt);
+
+    if (rc != SQLITE_DONE)
+    {
+        logerror("Failed to insert leaf %s: %s", path, sqlite3_errmsg(db->conn));
+        return -1;
+    }
+
+    return 0;
+}
+
+int dbleafdel(Database *db, int64_t rootid, char const *path)
+{
+    sqlite3_stmt *stmt = dbstmt(db, Stleafdel);
+    if (stmt == NULL)
+        return -1;
+
+    (void)sqlite3_bind_int64(stmt, 1, rootid);
+    int rc = sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+    if (rc != SQLITE_OK)
+    {
+        logerror("Failed to bind leaf path: %s", sqlite3_errmsg(db->conn));
+        dbrelease(db, stmt);
+        return -1;
+    }
+
+    rc = sqlite3_step(stmt);
+    dbrelease(db, stmt);
+
+    if (rc != SQLITE_DONE)
+    {
+        logerror("Failed to delete leaf %s: %s", path, sqlite3_errmsg(db->conn));
+        return -1;
+    }
+
+    return 0;
+}
+
+int dbleafmove(Database *db, int64_t rootid, char const *from, char const *to)
+{
+    sqlite3_stmt *stmt = dbstmt(db, Stleafmove);
+    if (stmt == NULL)
+        return -1;
+
+    int rc = sqlite3_bind_text(stmt, 1, to, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_int64(stmt, 2, rootid);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_text(stmt, 3, from, -1, SQLITE_STATIC);
+    if (rc != SQLITE_OK)
+    {
+        logerror("Failed to bind leaf move: %s", sqlite3_errmsg(db->conn));
+        dbrelease(db, stmt);
+        return -1;
+    }
+
+    rc = sqlite3_step(stmt);
+    int const nchanged = sqlite3_changes(db->conn);
+    dbrelease(db, stmt);
+
+    if (rc != SQLITE_DONE)
+    {
+        logerror("Failed to move leaf %s: %s", from, sqlite3_errmsg(db->conn));
+        return -1;
+    }
+
+    return nchanged > 0 ? 0 : 1;
+}
+
+static int dbsearchtier(Database *db, Stmt id, char const *terms, char const *repofilter, int limit, Hitfn *fn, void *arg)
+{
+    sqlite3_stmt *stmt = dbstmt(db, id);
+    if (stmt == NULL)
+        return -1;
+
+    int rc = sqlite3_bind_text(stmt, 1, terms, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK && repofilter && *repofilter)
+        rc = sqlite3_bind_text(stmt, 2, repofilter, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_bind_int(stmt, 3, limit);
+    if (rc != SQLITE_OK)
+    {
+        logerror("Failed to bind query: %s", sqlite3_errmsg(db->conn));
+        dbrelease(db, stmt);
+        return -1;
+    }
+
+    int nhits = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        char const *root = (char const *)sqlite3_column_text(stmt, 0);
+        char const *path = (char const *)sqlite3_column_text(stmt, 1);
+        double const score = sqlite3_column_double(stmt, 2);
+
+        /* fn writes to the client, so the statement's clock is moved past it */
+        double const start = clocksec();
+        int const stop = fn(root, path, score, arg);
+        db->since += clocksec() - start;
+        if (stop != 0)
+        {
+            rc = SQLITE_ABORT;
+            break;
+        }
+        ++nhits;
+    }
+
+    if (rc != SQLITE_DONE && rc != SQLITE_ABORT)
+        logerror("Failed to run query %s: %s", terms, sqlite3_errmsg(db->conn));
+
+    dbrelease(db, stmt);
+    return rc == SQLITE_DONE ? nhits : -1;
+}
+
+/*
+ * Each whitespace-separated word becomes an FTS5 string, embedded quotes
+ * doubled, so punctuation such as in malachi.c or c++ is matched rather
+ * than parsed as query syntax.  Adjacent strings must all match.
+ */
+static char *ftsquote(char const *terms)
+{
+    size_t const len = strlen(terms);
+    char *out = malloc((3 * len) + 1);
+    if (out == NULL)
+        return NULL;
+
+    size_t n = 0;
+    char const *s = terms;
+    for (;;)
+    {
+        while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r')
+            ++s;
+        if (*s == '\0')
+            break;
+
+        if (n > 0)
+            out[n++] = ' ';
+        out[n++] = '"';
+        for (; *s && *s != ' ' && *s != '\t' && *s != '\n' && *s != '\r'; ++s)
+        {
+            if (*s == '"')
+                out[n++] = '"';
+            out[n++] = *s;
+        }
+        out[n++] = '"';
+    }
+
+    out[n] = '\0';
+    return out;
+}
+
+/*
+ * Hits are handed to fn as each tier produces them, best first within a
+ * tier.  bm25 scores from different tables do not compare, so the tiers are
+ * not merged: every path hit comes before any content hit.
+ */
+int dbsearch(Database *db, char const *terms, char const *repofilter, int limit, Hitfn *fn, void *arg)
+{
+    static Stmt const tiers[] = { Stsearchpaths, Stsearchblobs, Stsearchpages };
+
+    char *match = ftsquote(terms);
+    if (match == NULL)
+        return -1;
+
+    /* Nothing to match, an empty FTS5 expression is a syntax error */
+    int nhits = 0;
+    for (size_t i = 0; i < NELEM(tiers) && nhits < limit && *match; ++i)
+    {
+        int const n = dbsearchtier(db, tiers[i], match, repofilter, limit - nhits, fn, arg);
+        if (n < 0)
+        {
+            nhits = -1;
+            break;
+        }
+        nhits += n;
+    }
+
+    free(match);
+    return nhits;
+}
+
 int statuswrite(char const *runtimedir, char const *repopath, char const *sha)
 {
     if (statusensure(runtimedir, repopath) != 0)
@@ -212,6 +1088,34 @@ int statuswrite(char const *runtimedir, char const *repopath, char const *sha)
     return 0;
 }
 
+int statusclear(char const *runtimedir, char const *repopath)
+{
+    char *statuspath = joinpath2(runtimedir, "roots");
+    if (!statuspath)
+    {
+        logerror("Failed to allocate status base path");
+        return -1;
+    }
+
+    char *fullpath = joinpath2(statuspath, repopath);
+    free(statuspath);
+    if (!fullpath)
+    {
+        logerror("Failed to allocate full status path");
+        return -1;
+    }
+
+    int rc = 0;
+    if (unlink(fullpath) != 0 && errno != ENOENT)
+    {
+        logerror("Failed to remove status file %s: %s", fullpath, strerror(errno));
+        rc = -1;
+    }
+
+    free(fullpath);
+    return rc;
+}
+
 int statusensure(char const *runtimedir, char const *repopath)
 {
     char *statusbase = joinpath2(runtimedir, "roots");
@@ -0,0 +1,451 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "malachi.h"
+
+enum
+{
+    MAXCHUNK = 64 * 1024,
+    MAXFILTERNAME = 64,
+    MAXEXTRACTJOBS = 1000,
+    MAXEXTRACTSEC = 120,
+    MAXEXTRACTMB = 2048,
+    MAXOUTPUTMB = 256,
+};
+
+/* Replies to one request are any number of Mtext and Mpage, then Mok or Mfail */
+enum
+{
+    Mtext,
+    Mpage,
+    Mok,
+    Mfail,
+};
+
+extern char **environ;
+
+struct Request
+{
+    uint64_t namelen;
+    uint64_t size;
+};
+
+struct Msg
+{
+    uint32_t kind;
+    uint32_t len;
+};
+
+/*
+ * A filter running in a child process, so a crash or runaway parse costs
+ * one blob rather than the daemon.  The child is replaced after it fails,
+ * dies or has served MAXEXTRACTJOBS requests.
+ */
+struct Extractor
+{
+    pid_t pid;
+    int in;
+    int out;
+    int njobs;
+    char buf[MAXCHUNK];
+};
+
+static int cloexec(int fd)
+{
+    int flags = fcntl(fd, F_GETFD);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+static int writen(int fd, void const *buf, size_t len)
+{
+    char const *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t nwritten = write(fd, p, len);
+        if (nwritten == -1 && errno == EINTR)
+            continue;
+        if (nwritten <= 0)
+            return -1;
+        p += nwritten;
+        len -= (size_t)nwritten;
+    }
+    return 0;
+}
+
+/* Fails on end of file, and on reaching the deadline when one is given */
+static int readn(int fd, void *buf, size_t len, double deadline)
+{
+    char *p = buf;
+
+    while (len > 0)
+    {
+        if (deadline > 0)
+        {
+            double const left = deadline - clocksec();
+            if (left <= 0)
+                return -1;
+
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            int rc = poll(&pfd, 1, (int)(left * 1000) + 1);
+            if (rc == -1 && errno == EINTR)
+                continue;
+            if (rc <= 0)
+                return -1;
+        }
+
+        ssize_t nread = read(fd, p, len);
+        if (nread == -1 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            return -1;
+        p += nread;
+        len -= (size_t)nread;
+    }
+    return 0;
+}
+
+static int extractorspawn(Extractor *e)
+{
+    char const *argv[] = { selfpath, "-x", debug ? "-d" : NULL, NULL };
+
+    int inpipe[2];
+    int outpipe[2];
+
+    if (pipe(inpipe) == -1)
+        return -1;
+
+    if (pipe(outpipe) == -1)
+        goto closeinpipe;
+
+    (void)cloexec(inpipe[1]);
+    (void)cloexec(outpipe[0]);
+
+    posix_spawn_file_actions_t actions;
+    int rc = posix_spawn_file_actions_init(&actions);
+    if (rc != 0)
+        goto closeoutpipe;
+
+    (void)posix_spawn_file_actions_adddup2(&actions, inpipe[0], STDIN_FILENO);
+    (void)posix_spawn_file_actions_adddup2(&actions, outpipe[1], STDOUT_FILENO);
+    (void)posix_spawn_file_actions_addclose(&actions, inpipe[0]);
+    (void)posix_spawn_file_actions_addclose(&actions, outpipe[1]);
+
+    rc = posix_spawnp(&e->pid, selfpath, &actions, NULL, (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0)
+    {
+        logerror("Failed to spawn extractor: %s", strerror(rc));
+        goto closeoutpipe;
+    }
+
+    close(inpipe[0]);
+    close(outpipe[1]);
+    e->in = inpipe[1];
+    e->out = outpipe[0];
+    e->njobs = 0;
+    return 0;
+
+closeoutpipe:
+    close(outpipe[0]);
+    close(outpipe[1]);
+closeinpipe:
+    close(inpipe[0]);
+    close(inpipe[1]);
+    return -1;
+}
+
+/* An idle child exits once its input closes, a stuck one is killed */
+static void extractorstop(Extractor *e, int force)
+{
+    if (e->pid == -1)
+        return;
+
+    close(e->in);
+    close(e->out);
+    if (force)
+        (void)kill(e->pid, SIGKILL);
+
+    int status = 0;
+    pid_t rc;
+    do
+        rc = waitpid(e->pid, &status, 0);
+    while (rc == -1 && errno == EINTR);
+
+    if (rc != -1 && WIFSIGNALED(status) && WTERMSIG(status) != SIGKILL)
+        logerror("Extractor %d killed by signal %d", (int)e->pid, WTERMSIG(status));
+    else if (rc != -1 && WIFEXITED(status) && WEXITSTATUS(status) != 0)
+        logerror("Extractor %d exited with status %d", (int)e->pid, WEXITSTATUS(status));
+
+    e->pid = -1;
+}
+
+/* The replacement starts right away, so the next request does not wait for it */
+static void extractorrestart(Extractor *e, int force)
+{
+    extractorstop(e, force);
+    (void)extractorspawn(e);
+}
+
+Extractor *extractorcreate(void)
+{
+    Extractor *e = malloc(sizeof(*e));
+    if (e == NULL)
+        return NULL;
+
+    e->pid = -1;
+    if (extractorspawn(e) != 0)
+    {
+        free(e);
+        return NULL;
+    }
+
+    return e;
+}
+
+void extractordestroy(Extractor *e)
+{
+    if (e == NULL)
+        return;
+
+    extractorstop(e, 0);
+    free(e);
+}
+
+static int sendrequest(Extractor *e, Filter const *filter, char const *input, size_t len)
+{
+    struct Request req = {
+        .namelen = strlen(filter->name),
+        .size = len,
+    };
+
+    if (writen(e->in, &req, sizeof(req)) != 0)
+        return -1;
+    if (writen(e->in, filter->name, req.namelen) != 0)
+        return -1;
+    return writen(e->in, input, len);
+}
+
+static int appendcontent(char **content, size_t *len, char const *text, size_t n)
+{
+    char *grown = realloc(*content, *len + n + 1);
+    if (grown == NULL)
+        return -1;
+
+    memcpy(grown + *len, text, n);
+    *len += n;
+    grown[*len] = '\0';
+    *content = grown;
+    return 0;
+}
+
+/*
+ * Streaming filters replay their text and page breaks into sink, the
+ * others return their whole text in content.  Any failure leaves the
+ * extractor ready for the next request, with a new child if need be.
+ */
+int extractorrun(Extractor *e, Filter const *filter, char const *input, size_t len, Sink *sink, char **content)
+{
+    double const deadline = clocksec() + MAXEXTRACTSEC;
+    size_t total = 0;
+    size_t contentlen = 0;
+    int force = 1;
+    int rc = -1;
+
+    if (content)
+        *content = NULL;
+
+    if (e->pid == -1 && extractorspawn(e) != 0)
+        return -1;
+
+    if (sendrequest(e, filter, input, len) != 0)
+        goto stop;
+
+    for (;;)
+    {
+        struct Msg msg;
+        if (readn(e->out, &msg, sizeof(msg), deadline) != 0)
+        {
+            logerror("Extractor %d failed to answer for %s", (int)e->pid, filter->name);
+            goto stop;
+        }
+
+        if (msg.kind == Mok || msg.kind == Mfail)
+        {
+            force = 0;
+            rc = msg.kind == Mok ? 0 : -1;
+            break;
+        }
+
+        if (msg.kind == Mpage)
+        {
+            if (sink && sink->page(sink) != 0)
+                goto stop;
+            continue;
+        }
+
+        total += msg.len;
+        if (msg.kind != Mtext || msg.len > MAXCHUNK || total > (size_t)MAXOUTPUTMB << 20)
+        {
+            logerror("Extractor %d sent too much or malformed output", (int)e->pid);
+            goto stop;
+        }
+
+        if (readn(e->out, e->buf, msg.len, deadline) != 0)
+            goto stop;
+
+        int const failed = sink ? sink->text(sink, e->buf, msg.len) : appendcontent(content, &contentlen, e->buf, msg.len);
+        if (failed)
+            goto stop;
+    }
+
+    /* A child that failed may have been left in any state by its input */
+    if (rc != 0 || ++e->njobs >= MAXEXTRACTJOBS)
+        extractorrestart(e, 0);
+
+    if (rc == 0 && content && *content == NULL && appendcontent(content, &contentlen, "", 0) != 0)
+        rc = -1;
+
+    if (rc != 0 && content)
+    {
+        free(*content);
+        *content = NULL;
+    }
+    return rc;
+
+stop:
+    extractorrestart(e, force);
+    if (content)
+    {
+        free(*content);
+        *content = NULL;
+    }
+    return -1;
+}
+
+struct Childsink
+{
+    Sink sink;
+    int fd;
+};
+
+static int sendframe(int fd, uint32_t kind, char const *data, size_t len)
+{
+    struct Msg const msg = { .kind = kind, .len = (uint32_t)len };
+
+    if (writen(fd, &msg, sizeof(msg)) != 0)
+        return -1;
+    return len > 0 ? writen(fd, data, len) : 0;
+}
+
+static int sendtext(int fd, char const *text, size_t len)
+{
+    while (len > 0)
+    {
+        size_t const n = len < MAXCHUNK ? len : MAXCHUNK;
+        if (sendframe(fd, Mtext, text, n) != 0)
+            return -1;
+        text += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int childtext(Sink *sink, char const *text, size_t len)
+{
+    return sendtext(((struct Childsink *)sink)->fd, text, len);
+}
+
+static int childpage(Sink *sink)
+{
+    return sendframe(((struct Childsink *)sink)->fd, Mpage, NULL, 0);
+}
+
+static Filter const *filterbyname(char const *name)
+{
+    Filter const **filters = filterall();
+    for (int i = 0; filters[i]; ++i)
+        if (strcmp(filters[i]->name, name) == 0)
+            return filters[i];
+    return NULL;
+}
+
+static int serveone(int out, Filter const *filter, char const *input, size_t len)
+{
+    if (filter == NULL)
+        return -1;
+
+    if (filter->stream)
+    {
+        struct Childsink cs = {
+            .sink = { .text = childtext, .page = childpage },
+            .fd = out,
+        };
+        return filter->stream(input, len, &cs.sink);
+    }
+
+    char *content = NULL;
+    int rc = filter->extract(input, len, &content);
+    if (rc == 0 && content)
+        rc = sendtext(out, content, strlen(content));
+    free(content);
+    return rc;
+}
+
+/* The child side, which runs until the daemon closes its input */
+int extractorserve(void)
+{
+    int const in = STDIN_FILENO;
+
+    /* Replies own the pipe on stdout, anything logged goes to stderr instead */
+    int const out = dup(STDOUT_FILENO);
+    if (out == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+        return -1;
+
+    struct rlimit const limit = {
+        .rlim_cur = (rlim_t)MAXEXTRACTMB << 20,
+        .rlim_max = (rlim_t)MAXEXTRACTMB << 20,
+    };
+    if (setrlimit(RLIMIT_AS, &limit) != 0)
+        logerror("Failed to limit extractor memory: %s", strerror(errno));
+
+    /* Interrupts at the terminal are for the daemon, which stops us in turn */
+    (void)signal(SIGINT, SIG_IGN);
+
+    for (;;)
+    {
+        struct Request req;
+        if (readn(in, &req, sizeof(req), 0) != 0)
+            return 0;
+
+        char name[MAXFILTERNAME];
+        if (req.namelen >= sizeof(name) || readn(in, name, req.namelen, 0) != 0)
+            return -1;
+        name[req.namelen] = '\0';
+
+        char *input = malloc(req.size + 1);
+        if (input == NULL)
+            return -1;
+        if (readn(in, input, req.size, 0) != 0)
+        {
+            free(input);
+            return -1;
+        }
+        input[req.size] = '\0';
+
+        int rc = serveone(out, filterbyname(name), input, req.size);
+        free(input);
+
+        if (sendframe(out, rc == 0 ? Mok : Mfail, NULL, 0) != 0)
+            return -1;
+    }
+}
@@ -1,34 +1,201 @@
+#include <stdlib.h>
+
 #include "malachi.h"
 
-#define MAXFILTERS 16
+enum
+{
+    MINSLOTS = 64,
+    NFIRSTBYTES = 256,
+};
 
-static Filter const *filters[MAXFILTERS];
-static int nfilters = 0;
+struct Slot
+{
+    char const *ext;
+    Filter const *filter;
+};
 
-void filteradd(Filter const *ops)
+struct Magic
 {
-    if (nfilters < MAXFILTERS - 1)
-    {
-        filters[nfilters++] = ops;
-        filters[nfilters] = NULL;
-    }
+    char const *bytes;
+    size_t len;
+    Filter const *filter;
+    struct Magic *next;
+};
+
+/*
+ * Filters register from constructors, before any thread starts, so the
+ * tables are only written while the process is still single-threaded.
+ * Extensions map through an open-addressed table kept at most half full,
+ * magic numbers are chained by their first byte.  sniffmax is the largest
+ * input the default or any filter with magic numbers takes.
+ */
+static Filter const **filters;
+static int nfilters;
+static int filtercap;
+static struct Slot *slots;
+static size_t nslots;
+static size_t nexts;
+static struct Magic *magics[NFIRSTBYTES];
+static int nmagics;
+static Filter const *fallback;
+static size_t sniffmax;
+
+static Filter const *none[] = { NULL };
+
+static uint64_t exthash(char const *ext)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (char const *c = ext; *c; ++c)
+        h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+    return h;
 }
 
-Filter const *filterget(char const *ext)
+static struct Slot *slotfind(struct Slot *table, size_t n, char const *ext)
+{
+    size_t i = exthash(ext) & (n - 1);
+    while (table[i].ext && strcmp(table[i].ext, ext) != 0)
+        i = (i + 1) & (n - 1);
+    return &table[i];
+}
+
+static int slotsgrow(void)
+{
+    size_t const n = nslots ? nslots * 2 : MINSLOTS;
+    struct Slot *table = calloc(n, sizeof(*table));
+    if (table == NULL)
+        return -1;
+
+    for (size_t i = 0; i < nslots; ++i)
+        if (slots[i].ext)
+            *slotfind(table, n, slots[i].ext) = slots[i];
+
+    free(slots);
+    slots = table;
+    nslots = n;
+    return 0;
+}
+
+/* The first filter to claim an extension keeps it */
+static int extput(char const *ext, Filter const *filter)
+{
+    if ((nexts + 1) * 2 > nslots && slotsgrow() != 0)
+        return -1;
+
+    struct Slot *slot = slotfind(slots, nslots, ext);
+    if (slot->ext)
+        return 0;
+
+    slot->ext = ext;
+    slot->filter = filter;
+    ++nexts;
+    return 0;
+}
+
+static int magicput(char const *bytes, Filter const *filter)
+{
+    struct Magic *m = malloc(sizeof(*m));
+    if (m == NULL)
+        return -1;
+
+    m->bytes = bytes;
+    m->len = strlen(bytes);
+    m->filter = filter;
+    m->next = NULL;
+
+    /* Appended, so earlier filters are tried first */
+    struct Magic **link = &magics[(unsigned char)bytes[0]];
+    while (*link)
+        link = &(*link)->next;
+    *link = m;
+
+    ++nmagics;
+    return 0;
+}
+
+void filteradd(Filter const *ops)
 {
-    for (int i = 0; i < nfilters; ++i)
+    if (nfilters + 1 >= filtercap)
     {
-        Filter const *filter = filters[i];
-        for (int j = 0; filter->exts[j]; ++j)
+        int const cap = filtercap ? filtercap * 2 : 8;
+        Filter const **grown = realloc(filters, (size_t)cap * sizeof(*grown));
+        if (grown == NULL)
         {
-            if (strcmp(ext, filter->exts[j]) == 0)
-                return filter;
+            logerror("Failed to register filter %s", ops->name);
+            return;
         }
+        filters = grown;
+        filtercap = cap;
     }
+
+    filters[nfilters++] = ops;
+    filters[nfilters] = NULL;
+
+    if ((ops->flags & Fdefault) && fallback == NULL)
+        fallback = ops;
+
+    size_t const maxsize = ops->maxsize ? ops->maxsize : SIZE_MAX;
+    if ((fallback == ops || ops->magics) && maxsize > sniffmax)
+        sniffmax = maxsize;
+
+    for (int i = 0; ops->exts && ops->exts[i]; ++i)
+        if (extput(ops->exts[i], ops) != 0)
+            logerror("Failed to register extension %s of filter %s", ops->exts[i], ops->name);
+
+    for (int i = 0; ops->magics && ops->magics[i]; ++i)
+        if (ops->magics[i][0] == '\0' || magicput(ops->magics[i], ops) != 0)
+            logerror("Failed to register magic number of filter %s", ops->name);
+}
+
+Filter const *filterget(char const *ext)
+{
+    if (nexts == 0)
+        return NULL;
+    return slotfind(slots, nslots, ext)->filter;
+}
+
+/* Only the magic numbers sharing the first byte are compared */
+Filter const *filtersniff(char const *data, size_t len)
+{
+    if (len == 0)
+        return NULL;
+
+    for (struct Magic const *m = magics[(unsigned char)data[0]]; m; m = m->next)
+        if (m->len <= len && memcmp(data, m->bytes, m->len) == 0)
+            return m->filter;
+
     return NULL;
 }
 
+int filtercansniff(void)
+{
+    return nmagics > 0;
+}
+
+Filter const *filterdefault(void)
+{
+    return fallback;
+}
+
+/* Anything larger, without an extension's filter, can only be refused whatever its content */
+size_t filtersniffmax(void)
+{
+    return sniffmax;
+}
+
+/*
+ * Filters declaring magic numbers are trusted only on content, the others
+ * on the name alone.  Content no magic number recognises goes to the default.
+ */
+Filter const *filtercheck(Filter const *filter, char const *data, size_t len)
+{
+    if (filter && filter->magics == NULL)
+        return filter;
+
+    Filter const *sniffed = filtersniff(data, len);
+    return sniffed ? sniffed : fallback;
+}
+
 Filter const **filterall(void)
 {
-    return filters;
+    return filters ? filters : none;
 }
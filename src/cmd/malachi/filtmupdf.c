@@ -1,19 +1,326 @@
+#include <pthread.h>
+#include <stdlib.h>
+
 #include <mupdf/fitz.h> /* beware of <mupdf/fitz/system.h>  */
 #undef nelem
 
 #include "malachi.h"
 
+enum
+{
+    PAGESPERTHREAD = 16,
+    MAXHELPERS = 3,
+    PAGEWINDOW = 32,
+};
+
 static char const *exts[] = {
     ".pdf",
     ".PDF",
     NULL,
 };
 
-static int extract(char const *input, char **output)
+static char const *magics[] = {
+    "%PDF-",
+    NULL,
+};
+
+struct Pdfpage
 {
-    (void)input;
-    *output = NULL;
-    return -1; // Not implemented yet
+    int ready;
+    char *text;
+    size_t len;
+};
+
+/*
+ * Pages of one document, extracted by the calling worker and its helpers.
+ * Pages are claimed in order and at most PAGEWINDOW ahead of the last one
+ * handed to the sink, so memory stays bounded however long the document.
+ */
+struct Pdfjob
+{
+    char const *input;
+    size_t len;
+    int npages;
+    int next;
+    int emitted;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct Pdfpage slots[PAGEWINDOW];
+};
+
+struct Pdfhelper
+{
+    struct Pdfjob *job;
+    fz_context *ctx;
+    pthread_t thread;
+};
+
+static pthread_mutex_t fzmutexes[FZ_LOCK_MAX];
+static fz_context *basectx;
+static pthread_once_t baseonce = PTHREAD_ONCE_INIT;
+
+static void fzlock(void *user, int lock)
+{
+    pthread_mutex_lock(&((pthread_mutex_t *)user)[lock]);
+}
+
+static void fzunlock(void *user, int lock)
+{
+    pthread_mutex_unlock(&((pthread_mutex_t *)user)[lock]);
+}
+
+/* Every thread clones this context, sharing its store and locks */
+static void baseinit(void)
+{
+    static fz_locks_context locks = {
+        .user = fzmutexes,
+        .lock = fzlock,
+        .unlock = fzunlock,
+    };
+
+    for (int i = 0; i < FZ_LOCK_MAX; ++i)
+        pthread_mutex_init(&fzmutexes[i], NULL);
+
+    basectx = fz_new_context(NULL, &locks, FZ_STORE_DEFAULT);
+    if (basectx == NULL)
+    {
+        logerror("Failed to create mupdf context");
+        return;
+    }
+
+    fz_try(basectx)
+        fz_register_document_handlers(basectx);
+    fz_catch(basectx)
+    {
+        logerror("Failed to register mupdf handlers: %s", fz_caught_message(basectx));
+        fz_drop_context(basectx);
+        basectx = NULL;
+    }
+}
+
+/* Documents are not thread-safe, each thread opens its own over the shared input */
+static fz_document *opendoc(fz_context *ctx, char const *input, size_t len)
+{
+    fz_stream *stm = NULL;
+    fz_document *doc = NULL;
+
+    fz_var(stm);
+    fz_var(doc);
+
+    fz_try(ctx)
+    {
+        stm = fz_open_memory(ctx, (unsigned char const *)input, len);
+        doc = fz_open_document_with_stream(ctx, "application/pdf", stm);
+    }
+    fz_always(ctx)
+        fz_drop_stream(ctx, stm);
+    fz_catch(ctx)
+    {
+        logdebug("mupdf failed to open document: %s", fz_caught_message(ctx));
+        doc = NULL;
+    }
+
+    return doc;
+}
+
+/* A damaged page reads as empty rather than failing the whole document */
+static void pagetext(fz_context *ctx, fz_document *doc, int n, struct Pdfpage *page)
+{
+    fz_stext_page *stext = NULL;
+    fz_buffer *buf = NULL;
+
+    fz_var(stext);
+    fz_var(buf);
+
+    page->text = NULL;
+    page->len = 0;
+
+    fz_try(ctx)
+    {
+        stext = fz_new_stext_page_from_page_number(ctx, doc, n, NULL);
+        buf = fz_new_buffer_from_stext_page(ctx, stext);
+
+        unsigned char *data = NULL;
+        size_t const size = fz_buffer_storage(ctx, buf, &data);
+        page->text = malloc(size + 1);
+        if (page->text)
+        {
+            memcpy(page->text, data, size);
+            page->text[size] = '\0';
+            page->len = size;
+        }
+    }
+    fz_always(ctx)
+    {
+        fz_drop_buffer(ctx, buf);
+        fz_drop_stext_page(ctx, stext);
+    }
+    fz_catch(ctx)
+        logdebug("mupdf failed on page %d: %s", n + 1, fz_caught_message(ctx));
+}
+
+/* Hands finished pages to the sink in order, called with the lock held */
+static void emitpages(struct Pdfjob *job, Sink *sink)
+{
+    while (job->failed == 0 && job->emitted < job->npages)
+    {
+        struct Pdfpage *slot = &job->slots[job->emitted % PAGEWINDOW];
+        if (slot->ready == 0)
+            return;
+
+        char *text = slot->text;
+        size_t const len = slot->len;
+        slot->ready = 0;
+        slot->text = NULL;
+
+        pthread_mutex_unlock(&job->lock);
+        int rc = (len > 0 ? sink->text(sink, text, len) : 0) || sink->page(sink);
+        free(text);
+        pthread_mutex_lock(&job->lock);
+
+        if (rc != 0)
+            job->failed = 1;
+        job->emitted++;
+        pthread_cond_broadcast(&job->cond);
+    }
+}
+
+/* Claims and extracts pages until none are left, the caller also emits them */
+static void extractpages(fz_context *ctx, fz_document *doc, struct Pdfjob *job, Sink *sink)
+{
+    pthread_mutex_lock(&job->lock);
+
+    for (;;)
+    {
+        if (sink)
+            emitpages(job, sink);
+
+        if (job->failed || (sink ? job->emitted == job->npages : job->next == job->npages))
+            break;
+
+        if (job->next == job->npages || job->next >= job->emitted + PAGEWINDOW)
+        {
+            pthread_cond_wait(&job->cond, &job->lock);
+            continue;
+        }
+
+        int const n = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        struct Pdfpage page;
+        pagetext(ctx, doc, n, &page);
+
+        pthread_mutex_lock(&job->lock);
+        job->slots[n % PAGEWINDOW] = page;
+        job->slots[n % PAGEWINDOW].ready = 1;
+        pthread_cond_broadcast(&job->cond);
+    }
+
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *helpermain(void *arg)
+{
+    struct Pdfhelper *h = arg;
+    struct Pdfjob *job = h->job;
+
+    /* The caller extracts pages too, so a helper that cannot open the document just leaves */
+    fz_document *doc = opendoc(h->ctx, job->input, job->len);
+    if (doc)
+    {
+        extractpages(h->ctx, doc, job, NULL);
+        fz_drop_document(h->ctx, doc);
+    }
+
+    fz_drop_context(h->ctx);
+    return NULL;
+}
+
+static int countpages(fz_context *ctx, fz_document *doc)
+{
+    int npages = -1;
+
+    fz_try(ctx)
+        npages = fz_count_pages(ctx, doc);
+    fz_catch(ctx)
+        logdebug("mupdf failed to count pages: %s", fz_caught_message(ctx));
+
+    return npages;
+}
+
+/*
+ * One page per sink page, so page numbers match the document.  Documents
+ * long enough are split across helper threads with cloned contexts.
+ */
+static int stream(char const *input, size_t len, Sink *sink)
+{
+    int ret = -1;
+
+    pthread_once(&baseonce, baseinit);
+    if (basectx == NULL)
+        return -1;
+
+    fz_context *ctx = fz_clone_context(basectx);
+    if (ctx == NULL)
+        return -1;
+
+    fz_document *doc = opendoc(ctx, input, len);
+    if (doc == NULL)
+        goto dropctx;
+
+    struct Pdfjob *job = calloc(1, sizeof(*job));
+    if (job == NULL)
+        goto dropdoc;
+
+    job->input = input;
+    job->len = len;
+    job->npages = countpages(ctx, doc);
+    if (job->npages < 0)
+        goto freejob;
+
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+
+    struct Pdfhelper helpers[MAXHELPERS];
+    int nhelpers = 0;
+    int const wanted = job->npages / PAGESPERTHREAD < MAXHELPERS ? job->npages / PAGESPERTHREAD : MAXHELPERS;
+
+    for (int i = 0; i < wanted; ++i)
+    {
+        struct Pdfhelper *h = &helpers[nhelpers];
+        h->job = job;
+        h->ctx = fz_clone_context(basectx);
+        if (h->ctx == NULL)
+            break;
+        if (threadspawn(&h->thread, helpermain, h) != 0)
+        {
+            fz_drop_context(h->ctx);
+            break;
+        }
+        nhelpers++;
+    }
+
+    extractpages(ctx, doc, job, sink);
+
+    for (int i = 0; i < nhelpers; ++i)
+        pthread_join(helpers[i].thread, NULL);
+
+    ret = job->failed ? -1 : 0;
+
+    /* Pages extracted ahead of a failure were never emitted */
+    for (int i = 0; i < PAGEWINDOW; ++i)
+        free(job->slots[i].text);
+
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+freejob:
+    free(job);
+dropdoc:
+    fz_drop_document(ctx, doc);
+dropctx:
+    fz_drop_context(ctx);
+    return ret;
 }
 
 static char const *version(void)
@@ -24,7 +331,8 @@ static char const *version(void)
 static Filter const mupdf = {
     .name = "mupdf",
     .exts = exts,
-    .extract = extract,
+    .magics = magics,
+    .stream = stream,
     .version = version,
 };
 
@@ -0,0 +1,270 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "malachi.h"
+
+enum
+{
+    SNIFFSIZE = 8000,
+    MAXTEXTSIZE = 16 << 20,
+    MAXCONTROLPCT = 10,
+    MAXINVALIDPCT = 10,
+};
+
+/* U+FFFD REPLACEMENT CHARACTER */
+static char const replacement[] = "\xEF\xBF\xBD";
+
+typedef size_t Plainfn(char *out, unsigned char const *s, size_t len);
+
+/*
+ * Each kernel copies the leading run of plain bytes, printable ASCII, tab
+ * and newline, and returns its length.  Anything else falls to the scalar
+ * loop in textclean.  A block is stored before it is checked, so out must
+ * have room for all len bytes.
+ */
+static size_t plainscalar(char *out, unsigned char const *s, size_t len)
+{
+    size_t i = 0;
+
+    /*
+     * Eight bytes at a time.  Once no high bit is set, forcing it on keeps the
+     * subtractions from borrowing across bytes, so each lane is tested exactly.
+     */
+    uint64_t const ones = 0x0101010101010101ULL;
+    uint64_t const high = 0x8080808080808080ULL;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, s + i, sizeof(w));
+        memcpy(out + i, &w, sizeof(w));
+        if ((w & high) != 0)
+            break;
+
+        uint64_t const low = ~((w | high) - (ones * 0x20)) & high;
+        uint64_t const tab = ~(((w ^ (ones * '\t')) | high) - ones) & high;
+        uint64_t const nl = ~(((w ^ (ones * '\n')) | high) - ones) & high;
+        if ((low & ~tab & ~nl) != 0)
+            break;
+    }
+
+    for (; i < len && ((s[i] >= 0x20 && s[i] < 0x80) || s[i] == '\t' || s[i] == '\n'); ++i)
+        out[i] = (char)s[i];
+    return i;
+}
+
+#if defined(__SSE2__)
+static size_t plainsse2(char *out, unsigned char const *s, size_t len)
+{
+    __m128i const space = _mm_set1_epi8(0x20);
+    __m128i const tab = _mm_set1_epi8('\t');
+    __m128i const nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i const v = _mm_loadu_si128((__m128i const *)(s + i));
+        _mm_storeu_si128((__m128i *)(out + i), v);
+        /* Signed compare, so bytes with the high bit set count as below space too */
+        __m128i const low = _mm_cmplt_epi8(v, space);
+        __m128i const ok = _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, nl));
+        if (_mm_movemask_epi8(_mm_andnot_si128(ok, low)) != 0)
+            break;
+    }
+
+    return i + plainscalar(out + i, s + i, len - i);
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVEAVX2 1
+__attribute__((target("avx2"))) static size_t plainavx2(char *out, unsigned char const *s, size_t len)
+{
+    __m256i const space = _mm256_set1_epi8(0x20);
+    __m256i const tab = _mm256_set1_epi8('\t');
+    __m256i const nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i const v = _mm256_loadu_si256((__m256i const *)(s + i));
+        _mm256_storeu_si256((__m256i *)(out + i), v);
+        __m256i const low = _mm256_cmpgt_epi8(space, v);
+        __m256i const ok = _mm256_or_si256(_mm256_cmpeq_epi8(v, tab), _mm256_cmpeq_epi8(v, nl));
+        if (_mm256_movemask_epi8(_mm256_andnot_si256(ok, low)) != 0)
+            break;
+    }
+
+    return i + plainscalar(out + i, s + i, len - i);
+}
+#endif
+
+static Plainfn *plainrun = plainscalar;
+static pthread_once_t plainonce = PTHREAD_ONCE_INIT;
+
+static void plaininit(void)
+{
+#if defined(__SSE2__)
+    plainrun = plainsse2;
+#endif
+#if defined(HAVEAVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        plainrun = plainavx2;
+#endif
+}
+
+/* Length of the well-formed UTF-8 sequence at s, or 0: no overlongs, surrogates or values past U+10FFFF */
+static size_t utf8len(unsigned char const *s, size_t len)
+{
+    unsigned char const c = s[0];
+    size_t n;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+
+    if (c >= 0xC2 && c <= 0xDF)
+        n = 2;
+    else if (c >= 0xE0 && c <= 0xEF)
+    {
+        n = 3;
+        lo = c == 0xE0 ? 0xA0 : 0x80;
+        hi = c == 0xED ? 0x9F : 0xBF;
+    }
+    else if (c >= 0xF0 && c <= 0xF4)
+    {
+        n = 4;
+        lo = c == 0xF0 ? 0x90 : 0x80;
+        hi = c == 0xF4 ? 0x8F : 0xBF;
+    }
+    else
+        return 0;
+
+    if (n > len || s[1] < lo || s[1] > hi)
+        return 0;
+    for (size_t i = 2; i < n; ++i)
+        if (s[i] < 0x80 || s[i] > 0xBF)
+            return 0;
+    return n;
+}
+
+/*
+ * One pass over the input: line endings become LF, malformed UTF-8 becomes
+ * U+FFFD, and content with a NUL or too many control or malformed bytes is
+ * rejected as binary.  The output only outgrows the input by replacements,
+ * so it always has room for the rest of the input, as plainrun needs.
+ */
+static int textclean(unsigned char const *in, size_t len, char **output)
+{
+    size_t cap = len + 1;
+    size_t o = 0;
+    size_t ncontrol = 0;
+    size_t ninvalid = 0;
+
+    char *out = malloc(cap);
+    if (out == NULL)
+        return -1;
+
+    pthread_once(&plainonce, plaininit);
+
+    for (size_t i = 0; i < len;)
+    {
+        size_t const n = plainrun(out + o, in + i, len - i);
+        i += n;
+        o += n;
+        if (i == len)
+            break;
+
+        unsigned char const c = in[i];
+        if (c == '\0')
+            goto binary;
+
+        if (c == '\r')
+        {
+            out[o++] = '\n';
+            i += (i + 1 < len && in[i + 1] == '\n') ? 2 : 1;
+            continue;
+        }
+
+        if (c < 0x80)
+        {
+            ncontrol += c != '\f' && c != '\v' && c != 0x1B;
+            out[o++] = (char)c;
+            ++i;
+            continue;
+        }
+
+        size_t const seq = utf8len(in + i, len - i);
+        if (seq > 0)
+        {
+            memcpy(out + o, in + i, seq);
+            o += seq;
+            i += seq;
+            continue;
+        }
+
+        ++ninvalid;
+        ++i;
+        if (o + sizeof(replacement) - 1 + (len - i) + 1 > cap)
+        {
+            size_t const grown = cap + (cap / 2) + sizeof(replacement);
+            char *bigger = realloc(out, grown);
+            if (bigger == NULL)
+                goto binary;
+            out = bigger;
+            cap = grown;
+        }
+        memcpy(out + o, replacement, sizeof(replacement) - 1);
+        o += sizeof(replacement) - 1;
+    }
+
+    if (ncontrol * 100 > len * MAXCONTROLPCT || ninvalid * 100 > len * MAXINVALIDPCT)
+        goto binary;
+
+    out[o] = '\0';
+    *output = out;
+    return 0;
+
+binary:
+    free(out);
+    return -1;
+}
+
+static int extract(char const *input, size_t len, char **output)
+{
+    if (len > MAXTEXTSIZE)
+        return -1;
+
+    /* Most binaries give themselves away early, before any copying */
+    if (memchr(input, '\0', len < SNIFFSIZE ? len : SNIFFSIZE))
+        return -1;
+
+    return textclean((unsigned char const *)input, len, output);
+}
+
+static char const *version(void)
+{
+#if defined(HAVEAVX2)
+    pthread_once(&plainonce, plaininit);
+    return plainrun == plainavx2 ? "1-avx2" : plainrun == plainscalar ? "1" : "1-sse2";
+#elif defined(__SSE2__)
+    return "1-sse2";
+#else
+    return "1";
+#endif
+}
+
+static Filter const text = {
+    .name = "text",
+    .flags = Fdefault | Finprocess,
+    .maxsize = MAXTEXTSIZE,
+    .extract = extract,
+    .version = version,
+};
+
+__attribute__((constructor)) static void init(void)
+{
+    filteradd(&text);
+}
@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "malachi.h"
+
+enum
+{
+    GITBUFSIZE = 64 * 1024,
+    MAXGITARGS = 16,
+};
+
+extern char **environ;
+
+struct Git
+{
+    pid_t pid;
+    int in;
+    int out;
+    size_t start;
+    size_t end;
+    char buf[GITBUFSIZE];
+};
+
+static int cloexec(int fd)
+{
+    int flags = fcntl(fd, F_GETFD);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+Git *gitopen(char const *repo, char const *const args[])
+{
+    char const *argv[MAXGITARGS + 4] = { "git", "-C", repo };
+    int argc = 3;
+
+    for (int i = 0; args[i]; ++i)
+    {
+        if (i >= MAXGITARGS)
+        {
+            logerror("Too many git arguments");
+            return NULL;
+        }
+        argv[argc++] = args[i];
+    }
+    argv[argc] = NULL;
+
+    Git *g = malloc(sizeof(*g));
+    if (g == NULL)
+        return NULL;
+
+    g->start = 0;
+    g->end = 0;
+
+    int inpipe[2];
+    int outpipe[2];
+
+    if (pipe(inpipe) == -1)
+        goto freegit;
+
+    if (pipe(outpipe) == -1)
+        goto closeinpipe;
+
+    (void)cloexec(inpipe[1]);
+    (void)cloexec(outpipe[0]);
+
+    posix_spawn_file_actions_t actions;
+    int rc = posix_spawn_file_actions_init(&actions);
+    if (rc != 0)
+    {
+        errno = rc;
+        goto closeoutpipe;
+    }
+
+    (void)posix_spawn_file_actions_adddup2(&actions, inpipe[0], STDIN_FILENO);
+    (void)posix_spawn_file_actions_adddup2(&actions, outpipe[1], STDOUT_FILENO);
+    (void)posix_spawn_file_actions_addclose(&actions, inpipe[0]);
+    (void)posix_spawn_file_actions_addclose(&actions, outpipe[1]);
+
+    rc = posix_spawnp(&g->pid, "git", &actions, NULL, (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0)
+    {
+        errno = rc;
+        logerror("Failed to spawn git: %s", strerror(rc));
+        goto closeoutpipe;
+    }
+
+    close(inpipe[0]);
+    close(outpipe[1]);
+    g->in = inpipe[1];
+    g->out = outpipe[0];
+    return g;
+
+closeoutpipe:
+    close(outpipe[0]);
+    close(outpipe[1]);
+closeinpipe:
+    close(inpipe[0]);
+    close(inpipe[1]);
+freegit:
+    free(g);
+    return NULL;
+}
+
+int gitclose(Git *g)
+{
+    if (g == NULL)
+        return -1;
+
+    if (g->in != -1)
+        close(g->in);
+    close(g->out);
+
+    int status = 0;
+    pid_t rc;
+    do
+        rc = waitpid(g->pid, &status, 0);
+    while (rc == -1 && errno == EINTR);
+
+    free(g);
+
+    if (rc == -1)
+        return -1;
+    if (WIFEXITED(status) == 0)
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+static ssize_t gitfill(Git *g)
+{
+    if (g->start > 0)
+    {
+        memmove(g->buf, g->buf + g->start, g->end - g->start);
+        g->end -= g->start;
+        g->start = 0;
+    }
+
+    if (g->end == sizeof(g->buf))
+        return -Enospace;
+
+    ssize_t nread;
+    do
+        nread = read(g->out, g->buf + g->end, sizeof(g->buf) - g->end);
+    while (nread == -1 && errno == EINTR);
+
+    if (nread > 0)
+        g->end += (size_t)nread;
+    return nread;
+}
+
+ssize_t gitread(Git *g, char delim, char **rec)
+{
+    size_t scanned = 0;
+
+    for (;;)
+    {
+        char *found = memchr(g->buf + g->start + scanned, delim, g->end - g->start - scanned);
+        if (found)
+        {
+            *found = '\0';
+            *rec = g->buf + g->start;
+            size_t len = (size_t)(found - *rec);
+            g->start += len + 1;
+            return (ssize_t)len;
+        }
+
+        scanned = g->end - g->start;
+
+        ssize_t nread = gitfill(g);
+        if (nread == 0)
+        {
+            if (g->end > g->start)
+            {
+                logerror("Truncated record from git");
+                return -1;
+            }
+            return 0;
+        }
+        if (nread < 0)
+            return nread == -Enospace ? -Enospace : -1;
+    }
+}
+
+int gitreadn(Git *g, char *dst, size_t n)
+{
+    size_t buffered = g->end - g->start;
+    size_t take = buffered < n ? buffered : n;
+
+    memcpy(dst, g->buf + g->start, take);
+    g->start += take;
+
+    for (size_t got = take; got < n;)
+    {
+        ssize_t nread = read(g->out, dst + got, n - got);
+        if (nread == -1 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            return -1;
+        got += (size_t)nread;
+    }
+
+    return 0;
+}
+
+int gitwrite(Git *g, char const *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t nwritten = write(g->in, buf, len);
+        if (nwritten == -1 && errno == EINTR)
+            continue;
+        if (nwritten <= 0)
+            return -1;
+        buf += nwritten;
+        len -= (size_t)nwritten;
+    }
+    return 0;
+}
+
+int gitrevparse(char const *repo, char const *rev, char *out, size_t outsize)
+{
+    char const *const args[] = { "rev-parse", "--verify", "--quiet", rev, NULL };
+
+    Git *g = gitopen(repo, args);
+    if (g == NULL)
+        return -1;
+
+    char *rec = NULL;
+    ssize_t len = gitread(g, '\n', &rec);
+    int ok = len > 0 && (size_t)len < outsize;
+    if (ok)
+        memcpy(out, rec, (size_t)len + 1);
+
+    int rc = gitclose(g);
+    return (ok && rc == 0) ? 0 : -1;
+}
+
+/* <oid> SP <type> SP <size> LF, or <oid> SP missing LF */
+static int githeader(Git *g, char const *oid, int *isblob, size_t *size)
+{
+    char req[MAXHASHLEN + 1];
+    int const n = snprintf(req, sizeof(req), "%s\n", oid);
+    if (n < 0 || (size_t)n >= sizeof(req))
+        return -1;
+
+    if (gitwrite(g, req, (size_t)n) != 0)
+    {
+        logerror("Failed to request object %s", oid);
+        return -1;
+    }
+
+    char *header = NULL;
+    if (gitread(g, '\n', &header) <= 0)
+    {
+        logerror("Failed to read object header for %s", oid);
+        return -1;
+    }
+
+    char *type = strchr(header, ' ');
+    if (type == NULL)
+        return -1;
+    ++type;
+
+    char *sizestr = strchr(type, ' ');
+    if (sizestr == NULL)
+    {
+        logerror("Object %s: %s", oid, type);
+        return -1;
+    }
+    *sizestr++ = '\0';
+
+    char *end = NULL;
+    unsigned long long const len = strtoull(sizestr, &end, 10);
+    if (end == sizestr || *end != '\0' || len >= SIZE_MAX)
+        return -1;
+
+    *isblob = strcmp(type, "blob") == 0;
+    *size = (size_t)len;
+    return 0;
+}
+
+int gitblobsize(Git *g, char const *oid, size_t *size)
+{
+    int isblob = 0;
+    if (githeader(g, oid, &isblob, size) != 0)
+        return -1;
+    return isblob ? 0 : -1;
+}
+
+char *gitblob(Git *g, char const *oid, size_t *size)
+{
+    int isblob = 0;
+    size_t len = 0;
+    if (githeader(g, oid, &isblob, &len) != 0)
+        return NULL;
+
+    char *content = malloc(len + 1);
+    if (content == NULL)
+        return NULL;
+
+    /* Payload is followed by a LF, consume it along with the object */
+    char trailer = '\0';
+    if (gitreadn(g, content, len) != 0 || gitreadn(g, &trailer, 1) != 0 || trailer != '\n')
+    {
+        logerror("Failed to read object %s", oid);
+        free(content);
+        return NULL;
+    }
+
+    content[len] = '\0';
+    *size = len;
+
+    if (isblob == 0)
+    {
+        free(content);
+        return NULL;
+    }
+
+    return content;
+}
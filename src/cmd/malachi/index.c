@@ -0,0 +1,1356 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "malachi.h"
+
+enum
+{
+    BATCHSIZE = 10000,
+    MAXPAGETEXT = 1 << 20,
+    MAXSPLITBACK = 4096,
+    MAXPENDINGJOBS = 1024,
+    RECLAIMLEAVES = 2000,
+    MERGEPAGES = 500,
+    OPTIMIZESEC = 24 * 60 * 60,
+};
+
+/*
+ * The writer thread owns the database, extraction runs on the worker pool.
+ * Each worker borrows an extractor process, so a filter that crashes or
+ * hangs on a bad document cannot take the daemon with it.  Finprocess
+ * filters, the built-in text filter, skip the extractor and run on the
+ * worker itself: they only scan bytes, and nearly every blob is text, so
+ * the round trip through a child would cost more than the extraction.
+ * Roots waiting to be indexed are kept once each in pending, which only the
+ * writer touches; current is shared with submitters under lock, and
+ * supersede holds the op of the newest add or remove naming it.  reclaim is
+ * set while removed roots may still have leaves to delete, and dirty while
+ * FTS segments written since the last idle merge may need merging.
+ */
+struct Indexer
+{
+    Database *db;
+    Cache *cache;
+    char const *runtimedir;
+    Pool *workers;
+    Queue *extractors;
+    Queue *jobs;
+    pthread_t writer;
+    atomic_int cancel;
+    atomic_int supersede;
+    pthread_mutex_t lock;
+    char *current;
+    char **pending;
+    size_t npending;
+    size_t cappending;
+    int reclaim;
+    int dirty;
+    double optimized;
+    atomic_int idle;
+};
+
+struct Jobroot
+{
+    Opcode op;
+    char *path;
+};
+
+enum
+{
+    Jobroots,
+    Jobidle,
+};
+
+/* Root changes from one command, paths are packed after the array, or an idle tick with none */
+struct Job
+{
+    int kind;
+    Reply *reply;
+    Opcode op;
+    double queued;
+    size_t nroots;
+    struct Jobroot roots[];
+};
+
+/*
+ * Sent back to the writer once per blob, after any pages a streaming
+ * filter produced.  Pages travel in the same struct with page set.
+ */
+struct Extraction
+{
+    int64_t blobid;
+    Filter const *filter;
+    char *blob;
+    size_t size;
+    char *content;
+    int page;
+    int rc;
+    Queue *done;
+};
+
+/*
+ * Collects one page of streamed text at a time, so memory stays bounded by
+ * MAXPAGETEXT.  A longer page is flushed in pieces that all keep its number.
+ */
+struct Pagesink
+{
+    Sink sink;
+    struct Extraction const *x;
+    int page;
+    size_t len;
+    char *buf;
+};
+
+struct Run
+{
+    Indexer *ix;
+    Database *db;
+    int64_t rootid;
+    char const *repopath;
+    Odb *odb;
+    Git *cat;
+    Git *check;
+    Queue *done;
+    size_t inflight;
+    size_t maxinflight;
+    size_t nleaves;
+    size_t nblobs;
+};
+
+static char const *extension(char const *path)
+{
+    char const *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    char const *dot = strrchr(base, '.');
+    return (dot && dot != base) ? dot : NULL;
+}
+
+static int isregular(char const *mode)
+{
+    return strcmp(mode, "100644") == 0 || strcmp(mode, "100755") == 0;
+}
+
+static Git *coprocess(struct Run *run, Git **g, char const *mode)
+{
+    if (*g == NULL)
+    {
+        char const *const args[] = { "cat-file", mode, NULL };
+        *g = gitopen(run->repopath, args);
+    }
+    return *g;
+}
+
+static int drain(struct Run *run, int wait);
+
+/*
+ * A blob git cannot produce is indexed without content rather than failing
+ * the root.  The coprocess may have stopped partway through its reply, so
+ * it is closed and the next request starts a fresh one.
+ */
+static void unreadable(Git **g)
+{
+    if (*g)
+        (void)gitclose(*g);
+    *g = NULL;
+    metriccount("index.unreadable", 1);
+}
+
+/* Anything committed may change query results, so cached ones for this root are dropped */
+static int runcommit(struct Run *run)
+{
+    if (dbcommit(run->db) != 0)
+        return -1;
+    cachebump(run->ix->cache, run->repopath);
+    return 0;
+}
+
+static void runclose(struct Run *run)
+{
+    (void)drain(run, 1);
+    if (run->cat)
+        (void)gitclose(run->cat);
+    if (run->check)
+        (void)gitclose(run->check);
+    odbclose(run->odb);
+    run->cat = NULL;
+    run->check = NULL;
+    run->odb = NULL;
+}
+
+/* <mode> SP <type> SP <object> SP+ <size> TAB <path> */
+static int parselstree(char *rec, Leaf *leaf)
+{
+    char *type = strchr(rec, ' ');
+    if (type == NULL)
+        return -1;
+    *type++ = '\0';
+
+    char *hash = strchr(type, ' ');
+    if (hash == NULL)
+        return -1;
+    *hash++ = '\0';
+
+    char *size = strchr(hash, ' ');
+    if (size == NULL)
+        return -1;
+    *size++ = '\0';
+
+    char *path = strchr(size, '\t');
+    if (path == NULL)
+        return -1;
+    *path++ = '\0';
+
+    /* Submodules and symlinks carry no text to index */
+    if (strcmp(type, "blob") != 0 || isregular(rec) == 0)
+        return 1;
+
+    while (*size == ' ')
+        ++size;
+
+    leaf->hash = hash;
+    leaf->path = path;
+    leaf->size = strtoll(size, NULL, 10);
+    leaf->filter = NULL;
+    leaf->content = NULL;
+    return 0;
+}
+
+/* Hands the collected text to the writer, blocking while it is behind */
+static int sinkflush(struct Pagesink *ps)
+{
+    if (ps->len == 0)
+        return 0;
+
+    struct Extraction *page = malloc(sizeof(*page));
+    if (page == NULL)
+        return -1;
+
+    ps->buf[ps->len] = '\0';
+    *page = (struct Extraction){
+        .blobid = ps->x->blobid,
+        .filter = ps->x->filter,
+        .content = ps->buf,
+        .page = ps->page,
+    };
+
+    if (queuepush(ps->x->done, page) != 0)
+    {
+        free(page);
+        return -1;
+    }
+
+    ps->buf = NULL;
+    ps->len = 0;
+    return 0;
+}
+
+/*
+ * Where to end a page of len bytes that goes on: after whitespace near the
+ * end if there is any, else before a UTF-8 sequence the page cuts short.
+ * Only buf[0, len) is read, the next byte is still with the filter.
+ */
+size_t pagesplit(char const *buf, size_t len)
+{
+    for (size_t i = len; i > 0 && len - i < MAXSPLITBACK; --i)
+        if (buf[i - 1] == ' ' || buf[i - 1] == '\n')
+            return i;
+
+    size_t lead = len;
+    while (lead > 0 && len - lead < 4 && ((unsigned char)buf[lead - 1] & 0xC0) == 0x80)
+        --lead;
+    if (lead == 0)
+        return len;
+
+    unsigned char const c = (unsigned char)buf[lead - 1];
+    size_t const seqlen = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    if (lead - 1 + seqlen <= len || lead == 1)
+        return len;
+    return lead - 1;
+}
+
+/* Flushes a full buffer up to a split point and carries the rest over */
+static int sinksplit(struct Pagesink *ps)
+{
+    size_t const cut = pagesplit(ps->buf, ps->len);
+    size_t const rest = ps->len - cut;
+
+    char *next = malloc(MAXPAGETEXT + 1);
+    if (next == NULL)
+        return -1;
+    memcpy(next, ps->buf + cut, rest);
+
+    ps->len = cut;
+    if (sinkflush(ps) != 0)
+    {
+        free(next);
+        return -1;
+    }
+
+    ps->buf = next;
+    ps->len = rest;
+    return 0;
+}
+
+/* A page longer than MAXPAGETEXT continues in another row with the same number */
+static int sinktext(Sink *sink, char const *text, size_t len)
+{
+    struct Pagesink *ps = (struct Pagesink *)sink;
+
+    while (len > 0)
+    {
+        if (ps->buf == NULL)
+        {
+            ps->buf = malloc(MAXPAGETEXT + 1);
+            if (ps->buf == NULL)
+                return -1;
+        }
+
+        size_t const n = len < MAXPAGETEXT - ps->len ? len : MAXPAGETEXT - ps->len;
+        memcpy(ps->buf + ps->len, text, n);
+        ps->len += n;
+        text += n;
+        len -= n;
+
+        if (ps->len == MAXPAGETEXT && sinksplit(ps) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int sinkpage(Sink *sink)
+{
+    struct Pagesink *ps = (struct Pagesink *)sink;
+
+    if (sinkflush(ps) != 0)
+        return -1;
+    ps->page++;
+    return 0;
+}
+
+static int extractstream(Extractor *e, struct Extraction *x)
+{
+    struct Pagesink ps = {
+        .sink = { .text = sinktext, .page = sinkpage },
+        .x = x,
+        .page = 1,
+    };
+
+    int rc = extractorrun(e, x->filter, x->blob, x->size, &ps.sink, NULL);
+    if (rc == 0)
+        rc = sinkflush(&ps);
+
+    free(ps.buf);
+    return rc;
+}
+
+static void extract(void *item, void *arg)
+{
+    Indexer *ix = arg;
+    struct Extraction *x = item;
+    double const start = clocksec();
+
+    x->content = NULL;
+
+    if (x->filter->flags & Finprocess)
+    {
+        x->rc = x->filter->extract(x->blob, x->size, &x->content);
+    }
+    else
+    {
+        /* There are as many extractors as workers, so one is always free */
+        Extractor *e = queuepop(ix->extractors);
+        if (e == NULL)
+            x->rc = -1;
+        else if (x->filter->stream)
+            x->rc = extractstream(e, x);
+        else
+            x->rc = extractorrun(e, x->filter, x->blob, x->size, NULL, &x->content);
+        if (e)
+            (void)queuepush(ix->extractors, e);
+    }
+
+    /* Timed per filter, which stands in for the content type */
+    char name[64];
+    (void)snprintf(name, sizeof(name), "filter.%s", x->filter->name);
+    metricsince(name, start);
+    if (x->rc != 0)
+    {
+        (void)snprintf(name, sizeof(name), "filter.%s.failed", x->filter->name);
+        metriccount(name, 1);
+    }
+
+    free(x->blob);
+    x->blob = NULL;
+
+    /* Never blocks, the queue has room for every extraction in flight */
+    (void)queuepush(x->done, x);
+}
+
+static int applyextraction(struct Run *run, struct Extraction *x)
+{
+    int rc = 0;
+
+    if (x->page > 0)
+    {
+        rc = dbpageput(run->db, x->blobid, x->page, x->content);
+        free(x->content);
+        free(x);
+        return rc;
+    }
+
+    --run->inflight;
+    if (x->rc == 0)
+    {
+        rc = dbblobfill(run->db, x->blobid, x->filter->name, x->content);
+    }
+    else
+    {
+        logdebug("Filter %s failed on blob %lld", x->filter->name, (long long)x->blobid);
+        if (x->filter->stream)
+            rc = dbpageclear(run->db, x->blobid);
+    }
+
+    free(x->content);
+    free(x);
+    return rc;
+}
+
+/* Applies finished extractions, waiting for all of them when wait is set */
+static int drain(struct Run *run, int wait)
+{
+    int ret = 0;
+
+    while (run->inflight > 0)
+    {
+        struct Extraction *x = wait ? queuepop(run->done) : queuetrypop(run->done);
+        if (x == NULL)
+            break;
+        if (applyextraction(run, x) != 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static int submitleaf(struct Run *run, int64_t blobid, Filter const *filter, char const *hash)
+{
+    size_t size = 0;
+    char *blob = run->odb ? odbblob(run->odb, hash, &size) : NULL;
+    if (blob == NULL)
+    {
+        Git *cat = coprocess(run, &run->cat, "--batch");
+        if (cat == NULL)
+            return -1;
+        blob = gitblob(cat, hash, &size);
+        if (blob == NULL)
+        {
+            logerror("Failed to read blob %s, indexing it without content", hash);
+            unreadable(&run->cat);
+            return 0;
+        }
+    }
+
+    filter = filtercheck(filter, blob, size);
+    if (filter == NULL)
+    {
+        free(blob);
+        return 0;
+    }
+
+    struct Extraction *x = malloc(sizeof(*x));
+    if (x == NULL)
+    {
+        free(blob);
+        return -1;
+    }
+
+    x->blobid = blobid;
+    x->filter = filter;
+    x->blob = blob;
+    x->size = size;
+    x->content = NULL;
+    x->page = 0;
+    x->rc = -1;
+    x->done = run->done;
+
+    if (drain(run, 0) != 0)
+    {
+        free(blob);
+        free(x);
+        return -1;
+    }
+
+    /*
+     * A streaming worker blocks while the done queue is full of its pages, so
+     * never block on a full pool: wait for an extraction to finish instead.
+     */
+    while (run->inflight >= run->maxinflight)
+    {
+        struct Extraction *y = atomic_load(&run->ix->cancel) ? NULL : queuepop(run->done);
+        if (y == NULL || applyextraction(run, y) != 0)
+        {
+            free(blob);
+            free(x);
+            return -1;
+        }
+    }
+
+    if (poolsubmit(run->ix->workers, x) != 0)
+    {
+        free(blob);
+        free(x);
+        return -1;
+    }
+
+    ++run->inflight;
+    return 0;
+}
+
+/*
+ * Content is extracted once per blob, identical leaves elsewhere only
+ * reference it.  Blobs needing a filter are inserted without content and
+ * filled in when their extraction comes back from the worker pool.
+ */
+static int putleaf(struct Run *run, Leaf *leaf)
+{
+    int64_t blobid = dbblobfind(run->db, leaf->hash);
+    if (blobid < 0)
+        return -1;
+
+    if (blobid == 0)
+    {
+        size_t size = 0;
+        int skip = 0;
+        if (leaf->size < 0 && run->odb && odbblobsize(run->odb, leaf->hash, &size) == 0)
+            leaf->size = (int64_t)size;
+
+        if (leaf->size < 0)
+        {
+            Git *check = coprocess(run, &run->check, "--batch-check");
+            if (check == NULL)
+                return -1;
+            if (gitblobsize(check, leaf->hash, &size) == 0)
+                leaf->size = (int64_t)size;
+            else
+            {
+                logerror("Failed to stat blob %s for %s, indexing it without content", leaf->hash, leaf->path);
+                unreadable(&run->check);
+                leaf->size = 0;
+                skip = 1;
+            }
+        }
+
+        blobid = dbblobput(run->db, leaf);
+        if (blobid < 0)
+            return -1;
+
+        ++run->nblobs;
+
+        /* Leaves no extension claims are fetched only when content can still pick a filter that takes their size */
+        char const *ext = extension(leaf->path);
+        Filter const *filter = ext ? filterget(ext) : NULL;
+        int sniff = filterdefault() || (ext == NULL && filtercansniff());
+        if (sniff && filter == NULL && (uint64_t)leaf->size > filtersniffmax())
+        {
+            metriccount("index.oversized", 1);
+            sniff = 0;
+        }
+        if (skip == 0 && (filter || sniff) && submitleaf(run, blobid, filter, leaf->hash) != 0)
+            return -1;
+    }
+
+    if (dbleafput(run->db, run->rootid, blobid, leaf->path) != 0)
+        return -1;
+
+    ++run->nleaves;
+    return 0;
+}
+
+static int addleaf(struct Run *run, char const *hash, char const *path)
+{
+    Leaf leaf = {
+        .hash = hash,
+        .path = path,
+        .size = -1,
+    };
+    return putleaf(run, &leaf);
+}
+
+static int walktree(struct Run *run, char const *head)
+{
+    int ret = -1;
+    char const *const args[] = { "ls-tree", "-r", "-z", "--long", "--full-tree", head, NULL };
+
+    Git *ls = gitopen(run->repopath, args);
+    if (ls == NULL)
+        return -1;
+
+    for (;;)
+    {
+        char *rec = NULL;
+        ssize_t len = gitread(ls, '\0', &rec);
+        if (len == 0)
+            break;
+        if (len < 0)
+        {
+            logerror("Failed to read tree of %s", run->repopath);
+            goto closels;
+        }
+
+        Leaf leaf;
+        int rc = parselstree(rec, &leaf);
+        if (rc < 0)
+        {
+            logerror("Malformed ls-tree record: %s", rec);
+            goto closels;
+        }
+        if (rc > 0)
+            continue;
+
+        /* Shutdown waits for the walk, so it stops at the next leaf rather than the next batch */
+        if (atomic_load(&run->ix->cancel))
+            goto closels;
+
+        if (putleaf(run, &leaf) != 0)
+            goto closels;
+
+        if (run->nleaves % BATCHSIZE != 0)
+            continue;
+
+        /* Every committed batch carries the content of its blobs */
+        if (drain(run, 1) != 0 || runcommit(run) != 0 || dbbegin(run->db) != 0)
+            goto closels;
+        logdebug("Committed %zu leaves of %s", run->nleaves, run->repopath);
+
+        /*
+         * A remove stops the walk once the batch is committed.  A newer add
+         * does not: the next full walk would clear the committed batches and
+         * start over, so this one finishes and the add then updates the root
+         * from this commit.
+         */
+        if (atomic_load(&run->ix->supersede) == Opremove)
+            goto closels;
+    }
+
+    ret = 0;
+
+closels:
+    if (gitclose(ls) != 0)
+        ret = -1;
+    return ret;
+}
+
+struct Change
+{
+    char srcmode[8];
+    char dstmode[8];
+    char srchash[MAXHASHLEN];
+    char dsthash[MAXHASHLEN];
+    char status;
+    int score;
+    char srcpath[PATH_MAX];
+    char dstpath[PATH_MAX];
+};
+
+static int copyfield(char *dst, size_t dstsize, char const *src)
+{
+    int const n = snprintf(dst, dstsize, "%s", src);
+    return (n < 0 || (size_t)n >= dstsize) ? -1 : 0;
+}
+
+/* :<srcmode> SP <dstmode> SP <srchash> SP <dsthash> SP <status>[<score>] NUL <path> NUL [<path> NUL] */
+static int readchange(Git *diff, struct Change *change)
+{
+    char *rec = NULL;
+    ssize_t len = gitread(diff, '\0', &rec);
+    if (len <= 0)
+        return (int)len;
+
+    char *fields[5];
+    char *cursor = rec + 1;
+    if (rec[0] != ':')
+        return -1;
+
+    for (int i = 0; i < 5; ++i)
+    {
+        fields[i] = cursor;
+        cursor = strchr(cursor, ' ');
+        if (cursor == NULL && i < 4)
+            return -1;
+        if (cursor)
+            *cursor++ = '\0';
+    }
+
+    if (copyfield(change->srcmode, sizeof(change->srcmode), fields[0]) != 0 ||
+        copyfield(change->dstmode, sizeof(change->dstmode), fields[1]) != 0 ||
+        copyfield(change->srchash, sizeof(change->srchash), fields[2]) != 0 ||
+        copyfield(change->dsthash, sizeof(change->dsthash), fields[3]) != 0)
+        return -1;
+
+    change->status = fields[4][0];
+    change->score = atoi(fields[4] + 1);
+
+    if (gitread(diff, '\0', &rec) <= 0 || copyfield(change->srcpath, sizeof(change->srcpath), rec) != 0)
+        return -1;
+
+    if (change->status != 'R' && change->status != 'C')
+        return copyfield(change->dstpath, sizeof(change->dstpath), change->srcpath) == 0 ? 1 : -1;
+
+    if (gitread(diff, '\0', &rec) <= 0 || copyfield(change->dstpath, sizeof(change->dstpath), rec) != 0)
+        return -1;
+
+    return 1;
+}
+
+static int applychange(struct Run *run, struct Change const *change)
+{
+    int const srcreg = isregular(change->srcmode);
+    int const dstreg = isregular(change->dstmode);
+
+    switch (change->status)
+    {
+    case 'D':
+        ++run->nleaves;
+        return dbleafdel(run->db, run->rootid, change->srcpath);
+    case 'R':
+        /* A pure rename keeps its extracted content, only the path moves */
+        if (change->score == 100 && srcreg && dstreg && strcmp(change->srchash, change->dsthash) == 0)
+        {
+            if (dbleafdel(run->db, run->rootid, change->dstpath) != 0)
+                return -1;
+            int rc = dbleafmove(run->db, run->rootid, change->srcpath, change->dstpath);
+            if (rc <= 0)
+            {
+                run->nleaves += (rc == 0);
+                return rc;
+            }
+        }
+        else if (dbleafdel(run->db, run->rootid, change->srcpath) != 0)
+        {
+            return -1;
+        }
+        /* fall through */
+    case 'A':
+    case 'C':
+    case 'M':
+    case 'T':
+        if (dbleafdel(run->db, run->rootid, change->dstpath) != 0)
+            return -1;
+        if (dstreg == 0)
+        {
+            ++run->nleaves;
+            return 0;
+        }
+        return addleaf(run, change->dsthash, change->dstpath);
+    default:
+        logdebug("Ignoring change %c to %s", change->status, change->srcpath);
+        return 0;
+    }
+}
+
+static int diffroot(struct Run *run, char const *prev, char const *head)
+{
+    int ret = -1;
+    char const *const args[] = { "diff-tree", "-r", "-z", "-M", "--no-commit-id", prev, head, NULL };
+
+    struct Change *change = malloc(sizeof(*change));
+    if (change == NULL)
+        return -1;
+
+    Git *diff = gitopen(run->repopath, args);
+    if (diff == NULL)
+        goto freechange;
+
+    for (;;)
+    {
+        if (atomic_load(&run->ix->cancel) || atomic_load(&run->ix->supersede) != Opunknown)
+            goto closediff;
+
+        int rc = readchange(diff, change);
+        if (rc == 0)
+            break;
+        if (rc < 0)
+        {
+            logerror("Malformed diff-tree output for %s", run->repopath);
+            goto closediff;
+        }
+
+        if (applychange(run, change) != 0)
+            goto closediff;
+    }
+
+    ret = 0;
+
+closediff:
+    if (gitclose(diff) != 0)
+        ret = -1;
+freechange:
+    free(change);
+    return ret;
+}
+
+static int indexfull(struct Run *run, char const *head)
+{
+    if (dbbegin(run->db) != 0)
+        return -1;
+
+    /* An empty root_hash marks the root as partially indexed until the final commit */
+    run->rootid = dbrootadd(run->db, run->repopath);
+    if (run->rootid < 0)
+        goto rollback;
+
+    if (dbreposet(run->db, run->repopath, "") != 0)
+        goto rollback;
+
+    if (dbleafclear(run->db, run->rootid) != 0)
+        goto rollback;
+
+    if (walktree(run, head) != 0)
+        goto rollback;
+
+    if (drain(run, 1) != 0)
+        goto rollback;
+
+    if (dbblobsweep(run->db) != 0)
+        goto rollback;
+
+    if (dbreposet(run->db, run->repopath, head) != 0)
+        goto rollback;
+
+    if (runcommit(run) != 0)
+        goto rollback;
+
+    return 0;
+
+rollback:
+    (void)drain(run, 1);
+    (void)dbrollback(run->db);
+    return -1;
+}
+
+/* Changes since the last indexed root are applied in a single transaction */
+static int indexdiff(struct Run *run, char const *prev, char const *head)
+{
+    if (dbbegin(run->db) != 0)
+        return -1;
+
+    run->rootid = dbrootadd(run->db, run->repopath);
+    if (run->rootid < 0)
+        goto rollback;
+
+    if (diffroot(run, prev, head) != 0)
+        goto rollback;
+
+    if (drain(run, 1) != 0)
+        goto rollback;
+
+    if (dbblobsweep(run->db) != 0)
+        goto rollback;
+
+    if (dbreposet(run->db, run->repopath, head) != 0)
+        goto rollback;
+
+    if (runcommit(run) != 0)
+        goto rollback;
+
+    return 0;
+
+rollback:
+    (void)drain(run, 1);
+    (void)dbrollback(run->db);
+    return -1;
+}
+
+static int indexroot(Indexer *ix, char const *repopath)
+{
+    Database *db = ix->db;
+    char head[MAXHASHLEN];
+
+    int rc = gitrevparse(repopath, "HEAD", head, sizeof(head));
+    if (rc != 0)
+    {
+        logerror("Failed to resolve HEAD of %s", repopath);
+        return -1;
+    }
+
+    char *prev = dbrepoget(db, repopath);
+    if (prev && strcmp(prev, head) == 0)
+    {
+        loginfo("Repository %s is up to date at %s", repopath, head);
+        free(prev);
+        return 0;
+    }
+
+    /* The previous root may be gone after a rebase and gc, walk the tree instead */
+    int incremental = 0;
+    if (prev && *prev)
+    {
+        char commit[MAXHASHLEN + 16];
+        char resolved[MAXHASHLEN];
+        int const n = snprintf(commit, sizeof(commit), "%s^{commit}", prev);
+        incremental = n > 0 && (size_t)n < sizeof(commit) && gitrevparse(repopath, commit, resolved, sizeof(resolved)) == 0;
+    }
+
+    /* At most one extraction per pool slot (two queued per worker) or worker is in flight */
+    struct Run run = {
+        .ix = ix,
+        .db = db,
+        .rootid = -1,
+        .repopath = repopath,
+        .odb = odbopen(repopath),
+        .done = queuecreate(3 * (size_t)poolsize(ix->workers)),
+        .maxinflight = 3 * (size_t)poolsize(ix->workers),
+    };
+
+    if (run.done == NULL)
+    {
+        odbclose(run.odb);
+        free(prev);
+        return -1;
+    }
+
+    double const start = clocksec();
+
+    rc = incremental ? indexdiff(&run, prev, head) : indexfull(&run, head);
+    runclose(&run);
+    queuedestroy(run.done);
+
+    if (rc != 0)
+    {
+        if (atomic_load(&ix->cancel))
+            loginfo("Indexing of %s interrupted", repopath);
+        else if (atomic_load(&ix->supersede) != Opunknown)
+        {
+            loginfo("Indexing of %s superseded by a newer %s", repopath, opname((Opcode)atomic_load(&ix->supersede)));
+            metriccount("index.superseded", 1);
+        }
+        else
+            logerror("Failed to index %s", repopath);
+        free(prev);
+        return -1;
+    }
+
+    double const elapsed = clocksec() - start;
+    metricsince("index.root", start);
+    metriccount("index.leaves", run.nleaves);
+    metriccount("index.blobs", run.nblobs);
+    if (incremental)
+        loginfo("Indexed %s from %s to %s: %zu leaves changed, %zu new blobs in %.3fs (%.0f rows/s)",
+                repopath, prev, head, run.nleaves, run.nblobs, elapsed, elapsed > 0 ? (double)run.nleaves / elapsed : 0.0);
+    else
+        loginfo("Indexed %s at %s: %zu leaves, %zu new blobs in %.3fs (%.0f rows/s)",
+                repopath, head, run.nleaves, run.nblobs, elapsed, elapsed > 0 ? (double)run.nleaves / elapsed : 0.0);
+
+    free(prev);
+    (void)statuswrite(ix->runtimedir, repopath, head);
+    return 0;
+}
+
+/* Registers and removes the job's roots in one transaction, indexing comes after */
+static int applyjob(Indexer *ix, struct Job const *job)
+{
+    Database *db = ix->db;
+    int nremoved = 0;
+
+    if (dbbegin(db) != 0)
+        return -1;
+
+    for (size_t i = 0; i < job->nroots; ++i)
+    {
+        struct Jobroot const *r = &job->roots[i];
+        if (r->op == Opadd && dbrootadd(db, r->path) < 0)
+            goto rollback;
+        if (r->op == Opremove && dbrootdel(db, r->path) != 0)
+            goto rollback;
+        nremoved += r->op == Opremove;
+    }
+
+    if (dbcommit(db) != 0)
+        goto rollback;
+
+    ix->reclaim |= nremoved > 0;
+
+    for (size_t i = 0; i < job->nroots; ++i)
+    {
+        struct Jobroot const *r = &job->roots[i];
+        if (r->op != Opremove)
+            continue;
+        cachebump(ix->cache, r->path);
+        (void)statusclear(ix->runtimedir, r->path);
+        loginfo("Removed repository %s", r->path);
+    }
+
+    return 0;
+
+rollback:
+    (void)dbrollback(db);
+    return -1;
+}
+
+static ssize_t pendingfind(Indexer *ix, char const *path)
+{
+    for (size_t i = 0; i < ix->npending; ++i)
+        if (strcmp(ix->pending[i], path) == 0)
+            return (ssize_t)i;
+    return -1;
+}
+
+/* A root already waiting keeps its place, so a burst of adds costs one pass */
+static int pendingadd(Indexer *ix, char const *path)
+{
+    if (pendingfind(ix, path) >= 0)
+        return 0;
+
+    if (ix->npending == ix->cappending)
+    {
+        size_t const cap = ix->cappending ? 2 * ix->cappending : 16;
+        char **grown = realloc(ix->pending, cap * sizeof(*grown));
+        if (grown == NULL)
+            return -1;
+        ix->pending = grown;
+        ix->cappending = cap;
+    }
+
+    char *copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+    ix->pending[ix->npending++] = copy;
+    return 0;
+}
+
+static void pendingdrop(Indexer *ix, char const *path)
+{
+    ssize_t const i = pendingfind(ix, path);
+    if (i < 0)
+        return;
+
+    free(ix->pending[i]);
+    memmove(&ix->pending[i], &ix->pending[i + 1], (ix->npending - (size_t)i - 1) * sizeof(*ix->pending));
+    ix->npending--;
+}
+
+static void runjob(Indexer *ix, struct Job *job)
+{
+    metricsince("jobs.wait", job->queued);
+    double const start = clocksec();
+
+    int const rc = applyjob(ix, job);
+    metricsince("jobs.apply", start);
+
+    if (job->reply)
+    {
+        char const *error = rc != 0 ? "transaction failed" : NULL;
+        if (job->op == Opbatch)
+            (void)replybatch(job->reply, job->nroots, error);
+        else
+            (void)replyack(job->reply, opname(job->op), error);
+    }
+
+    if (rc != 0)
+    {
+        logerror("Failed to apply %s of %zu roots", opname(job->op), job->nroots);
+        return;
+    }
+
+    /* A root added and then removed is not indexed */
+    for (size_t i = 0; i < job->nroots; ++i)
+    {
+        struct Jobroot const *r = &job->roots[i];
+        if (r->op == Opremove)
+            pendingdrop(ix, r->path);
+        else if (pendingadd(ix, r->path) != 0)
+            logerror("Failed to queue %s for indexing", r->path);
+    }
+
+    metricgauge("index.pending", ix->npending);
+}
+
+/* Oldest pending root first, current marks it so a newer add can supersede the run */
+static void indexpending(Indexer *ix)
+{
+    char *path = ix->pending[0];
+    memmove(&ix->pending[0], &ix->pending[1], (ix->npending - 1) * sizeof(*ix->pending));
+    ix->npending--;
+    metricgauge("index.pending", ix->npending);
+
+    pthread_mutex_lock(&ix->lock);
+    ix->current = path;
+    atomic_store(&ix->supersede, Opunknown);
+    pthread_mutex_unlock(&ix->lock);
+
+    (void)indexroot(ix, path);
+    ix->dirty = 1;
+
+    pthread_mutex_lock(&ix->lock);
+    ix->current = NULL;
+    pthread_mutex_unlock(&ix->lock);
+
+    free(path);
+}
+
+/* One bounded transaction, so a waiting job is never held up long by a large removal */
+static void reclaimstep(Indexer *ix)
+{
+    double const start = clocksec();
+    int const rc = dbrootreclaim(ix->db, RECLAIMLEAVES);
+    metricsince("index.reclaim", start);
+
+    /* Retried after the next remove or restart */
+    if (rc < 0)
+        logerror("Failed to reclaim leaves of removed roots");
+    else if (rc == 0)
+        logdebug("Removed roots reclaimed");
+    ix->reclaim = rc > 0;
+    ix->dirty = 1;
+}
+
+/*
+ * One bounded merge step per idle tick until no level has segments to
+ * merge, then at most daily an optimize down to one segment per table.
+ * Other work always comes first, there will be another tick.
+ */
+static void maintain(Indexer *ix)
+{
+    if (ix->npending > 0 || ix->reclaim || ix->dirty == 0)
+        return;
+
+    double const start = clocksec();
+    int const rc = dbftsmerge(ix->db, MERGEPAGES);
+    metricsince("index.merge", start);
+    if (rc > 0)
+        return;
+
+    /* A failed merge waits for the next change rather than retrying every tick */
+    ix->dirty = 0;
+    if (rc < 0)
+    {
+        logerror("Failed to merge FTS segments");
+        return;
+    }
+
+    if (start - ix->optimized < OPTIMIZESEC)
+        return;
+
+    loginfo("Optimizing full-text index");
+    if (dbftsoptimize(ix->db) != 0)
+        logerror("Failed to optimize full-text index");
+    metricsince("index.optimize", start);
+    ix->optimized = clocksec();
+}
+
+/*
+ * Jobs only register or remove roots, which is cheap, so all queued jobs are
+ * applied before any indexing starts.  Roots are indexed one at a time while
+ * no job is waiting, and removed roots reclaimed once none is pending.
+ */
+static void *writermain(void *arg)
+{
+    Indexer *ix = arg;
+
+    for (;;)
+    {
+        int const busy = ix->npending > 0 || ix->reclaim;
+        struct Job *job = busy ? queuetrypop(ix->jobs) : queuepop(ix->jobs);
+        metricgauge("jobs.queued", queuelen(ix->jobs));
+        if (job && job->kind == Jobidle)
+        {
+            atomic_store(&ix->idle, 0);
+            if (atomic_load(&ix->cancel) == 0)
+                maintain(ix);
+            free(job);
+            continue;
+        }
+
+        if (job)
+        {
+            if (atomic_load(&ix->cancel) == 0)
+                runjob(ix, job);
+            replyrelease(job->reply);
+            free(job);
+            continue;
+        }
+
+        if (busy == 0 || atomic_load(&ix->cancel))
+            break;
+
+        if (ix->npending > 0)
+            indexpending(ix);
+        else
+            reclaimstep(ix);
+    }
+
+    return NULL;
+}
+
+/* Only called once no worker holds an extractor */
+static void extractorsdestroy(Queue *extractors)
+{
+    Extractor *e;
+    while ((e = queuetrypop(extractors)) != NULL)
+        extractordestroy(e);
+    queuedestroy(extractors);
+}
+
+Indexer *indexercreate(Database *db, Cache *cache, char const *runtimedir, int nworkers)
+{
+    Indexer *ix = malloc(sizeof(*ix));
+    if (ix == NULL)
+        return NULL;
+
+    ix->db = db;
+    ix->cache = cache;
+    ix->runtimedir = runtimedir;
+    atomic_init(&ix->cancel, 0);
+    atomic_init(&ix->supersede, Opunknown);
+    ix->current = NULL;
+    ix->pending = NULL;
+    ix->npending = 0;
+    ix->cappending = 0;
+    /* Removals interrupted by the last shutdown carry on */
+    ix->reclaim = 1;
+    ix->dirty = 1;
+    ix->optimized = clocksec();
+    atomic_init(&ix->idle, 0);
+
+    if (pthread_mutex_init(&ix->lock, NULL) != 0)
+        goto freeindexer;
+
+    ix->extractors = queuecreate((size_t)nworkers);
+    if (ix->extractors == NULL)
+        goto destroylock;
+
+    for (int i = 0; i < nworkers; ++i)
+    {
+        Extractor *e = extractorcreate();
+        if (e == NULL)
+        {
+            logerror("Failed to start extractor %d", i);
+            goto destroyextractors;
+        }
+        (void)queuepush(ix->extractors, e);
+    }
+
+    ix->workers = poolcreate(nworkers, 2 * (size_t)nworkers, extract, ix);
+    if (ix->workers == NULL)
+        goto destroyextractors;
+
+    ix->jobs = queuecreate(MAXPENDINGJOBS);
+    if (ix->jobs == NULL)
+        goto destroyworkers;
+
+    if (threadspawn(&ix->writer, writermain, ix) != 0)
+        goto destroyjobs;
+
+    return ix;
+
+destroyjobs:
+    queuedestroy(ix->jobs);
+destroyworkers:
+    pooldestroy(ix->workers);
+destroyextractors:
+    extractorsdestroy(ix->extractors);
+destroylock:
+    pthread_mutex_destroy(&ix->lock);
+freeindexer:
+    free(ix);
+    return NULL;
+}
+
+void indexerdestroy(Indexer *ix)
+{
+    if (ix == NULL)
+        return;
+
+    atomic_store(&ix->cancel, 1);
+    queueclose(ix->jobs);
+    pthread_join(ix->writer, NULL);
+
+    pooldestroy(ix->workers);
+    extractorsdestroy(ix->extractors);
+    queuedestroy(ix->jobs);
+
+    for (size_t i = 0; i < ix->npending; ++i)
+        free(ix->pending[i]);
+    free(ix->pending);
+    pthread_mutex_destroy(&ix->lock);
+    free(ix);
+}
+
+/* Queues an idle tick, which tells the writer the daemon has nothing else to do */
+void indexeridle(Indexer *ix)
+{
+    if (atomic_exchange(&ix->idle, 1))
+        return;
+
+    struct Job *job = calloc(1, sizeof(*job));
+    if (job)
+    {
+        job->kind = Jobidle;
+        job->queued = clocksec();
+    }
+    if (job == NULL || queuetrypush(ix->jobs, job) != 0)
+    {
+        free(job);
+        atomic_store(&ix->idle, 0);
+    }
+}
+
+/* The reply, when given, is acknowledged once the roots are registered or removed; -Ebusy means the job queue is full */
+int indexersubmit(Indexer *ix, Opcode op, Command const *cmds, size_t ncmds, Reply *reply)
+{
+    size_t size = sizeof(struct Job) + (ncmds * sizeof(struct Jobroot));
+    for (size_t i = 0; i < ncmds; ++i)
+        size += cmds[i].pathop.path.len + 1;
+
+    struct Job *job = malloc(size);
+    if (job == NULL)
+        return -1;
+
+    job->kind = Jobroots;
+    job->reply = reply;
+    job->op = op;
+    job->queued = clocksec();
+    job->nroots = ncmds;
+
+    char *data = (char *)&job->roots[ncmds];
+    for (size_t i = 0; i < ncmds; ++i)
+    {
+        Str const *path = &cmds[i].pathop.path;
+        job->roots[i].op = cmds[i].op;
+        job->roots[i].path = data;
+        memcpy(data, path->s, path->len + 1);
+        data += path->len + 1;
+    }
+
+    if (reply)
+        replyretain(reply);
+
+    /*
+     * A newer add makes a run of the same root stale, a remove makes it
+     * pointless.  An incremental run stops at the next change, a full walk
+     * only for a remove, at its next batch commit.  The newest command wins,
+     * as it does in pending.  Holding the lock across the push keeps the
+     * writer from starting a run between queueing the job and marking the
+     * old one.
+     */
+    pthread_mutex_lock(&ix->lock);
+    int const rc = queuetrypush(ix->jobs, job);
+    for (size_t i = 0; rc == 0 && i < ncmds && ix->current; ++i)
+        if (strcmp(cmds[i].pathop.path.s, ix->current) == 0)
+            atomic_store(&ix->supersede, (int)cmds[i].op);
+    pthread_mutex_unlock(&ix->lock);
+
+    metricgauge("jobs.queued", queuelen(ix->jobs));
+
+    if (rc != 0)
+    {
+        replyrelease(reply);
+        free(job);
+        return rc > 0 ? -Ebusy : -1;
+    }
+
+    return 0;
+}
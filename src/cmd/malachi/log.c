@@ -0,0 +1,335 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "malachi.h"
+
+enum
+{
+    LOGSLOTS = 128,
+    LOGLINE = 1024,
+    LOGIDLEMS = 100,
+};
+
+enum
+{
+    Linfo,
+    Lerror,
+    Ldebug,
+};
+
+static char const *const prefixes[] = {
+    [Linfo] = "[INFO] ",
+    [Lerror] = "[ERROR] ",
+    [Ldebug] = "[DEBUG] ",
+};
+
+struct Logslot
+{
+    uint64_t seq;
+    int level;
+    int len;
+    char text[LOGLINE];
+};
+
+/*
+ * One per logging thread, written only by it and read only by the drainer.
+ * A ring outlives its thread: it is marked orphaned at thread exit, and the
+ * next new thread to log takes it over once it has been drained.
+ */
+struct Logring
+{
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_int orphaned;
+    struct Logring *next;
+    struct Logslot slots[LOGSLOTS];
+};
+
+static struct Logring *_Atomic rings;
+static pthread_key_t ringkey;
+static pthread_once_t ringonce = PTHREAD_ONCE_INIT;
+
+static atomic_int running;
+static atomic_uint_fast64_t seq;
+static atomic_uint_fast64_t ndropped;
+
+/* Set before the drainer starts and cleared after it stops, so it is never read in flux */
+static FILE *logfile;
+
+static pthread_t drainer;
+static pthread_mutex_t idlelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idlecond = PTHREAD_COND_INITIALIZER;
+static atomic_int idle;
+
+static void ringorphan(void *arg)
+{
+    struct Logring *r = arg;
+    atomic_store_explicit(&r->orphaned, 1, memory_order_release);
+}
+
+static void ringkeyinit(void)
+{
+    (void)pthread_key_create(&ringkey, ringorphan);
+}
+
+/* Rings are only ever added at the head, so the drainer can walk the list without a lock */
+static struct Logring *ringget(void)
+{
+    struct Logring *r = pthread_getspecific(ringkey);
+    if (r)
+        return r;
+
+    for (r = atomic_load(&rings); r; r = r->next)
+    {
+        int expect = 1;
+        size_t const tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (tail == atomic_load_explicit(&r->head, memory_order_relaxed) && atomic_compare_exchange_strong(&r->orphaned, &expect, 0))
+            break;
+    }
+
+    if (r == NULL)
+    {
+        r = calloc(1, sizeof(*r));
+        if (r == NULL)
+            return NULL;
+        r->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+            ;
+    }
+
+    (void)pthread_setspecific(ringkey, r);
+    return r;
+}
+
+static FILE *logstream(int level)
+{
+    if (logfile)
+        return logfile;
+    return level == Lerror ? stderr : stdout;
+}
+
+static void logsync(int level, char const *fmt, va_list args)
+{
+    FILE *f = logstream(level);
+    flockfile(f);
+    (void)fputs(prefixes[level], f);
+    (void)vfprintf(f, fmt, args);
+    (void)fputc('\n', f);
+    funlockfile(f);
+}
+
+/*
+ * Formats into the calling thread's ring and returns.  Formatting cannot
+ * be left to the drainer, since string arguments die with the caller's
+ * frame.  A full ring drops info and debug messages rather than wait, but
+ * writes an error at once, ahead of whatever the ring still holds.
+ */
+static void logput(int level, char const *fmt, va_list args)
+{
+    if (atomic_load_explicit(&running, memory_order_acquire) == 0)
+    {
+        logsync(level, fmt, args);
+        return;
+    }
+
+    struct Logring *r = ringget();
+    if (r == NULL)
+    {
+        logsync(level, fmt, args);
+        return;
+    }
+
+    size_t const head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == LOGSLOTS)
+    {
+        if (level == Lerror)
+            logsync(level, fmt, args);
+        else
+            atomic_fetch_add_explicit(&ndropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct Logslot *s = &r->slots[head % LOGSLOTS];
+    int const n = vsnprintf(s->text, sizeof(s->text), fmt, args);
+    s->len = n < 0 ? 0 : n < LOGLINE ? n : LOGLINE - 1;
+    s->level = level;
+    s->seq = atomic_fetch_add_explicit(&seq, 1, memory_order_relaxed);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+    /* Only the first message after the drainer goes idle pays for a wakeup */
+    if (atomic_load_explicit(&idle, memory_order_relaxed) && atomic_exchange(&idle, 0))
+        (void)pthread_cond_signal(&idlecond);
+}
+
+/* Writes every published message, oldest first across all rings, and returns how many */
+static size_t drain(void)
+{
+    size_t n = 0;
+
+    for (;;)
+    {
+        struct Logring *oldest = NULL;
+        struct Logslot *s = NULL;
+
+        for (struct Logring *r = atomic_load(&rings); r; r = r->next)
+        {
+            size_t const tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            if (tail == atomic_load_explicit(&r->head, memory_order_acquire))
+                continue;
+            struct Logslot *t = &r->slots[tail % LOGSLOTS];
+            if (s == NULL || t->seq < s->seq)
+            {
+                oldest = r;
+                s = t;
+            }
+        }
+
+        if (oldest == NULL)
+            break;
+
+        FILE *f = logstream(s->level);
+        flockfile(f);
+        (void)fputs(prefixes[s->level], f);
+        (void)fwrite(s->text, 1, (size_t)s->len, f);
+        (void)fputc('\n', f);
+        funlockfile(f);
+        atomic_fetch_add_explicit(&oldest->tail, 1, memory_order_release);
+        n++;
+    }
+
+    uint64_t const dropped = atomic_exchange(&ndropped, 0);
+    if (dropped > 0)
+    {
+        /* Behind everything drained before it, even when that went to stdout */
+        (void)fflush(stdout);
+        (void)fprintf(logstream(Lerror), "%s%llu log messages dropped\n", prefixes[Lerror], (unsigned long long)dropped);
+        metriccount("log.dropped", dropped);
+    }
+
+    if (n > 0 || dropped > 0)
+    {
+        if (logfile)
+            (void)fflush(logfile);
+        (void)fflush(stdout);
+        (void)fflush(stderr);
+    }
+    return n;
+}
+
+/*
+ * Sleeps once a pass finds nothing.  A wakeup can slip in between the
+ * check and the wait, the timeout bounds how late that message appears.
+ */
+static void *drainmain(void *arg)
+{
+    (void)arg;
+
+    while (atomic_load(&running))
+    {
+        if (drain() > 0)
+            continue;
+
+        struct timespec ts;
+        (void)clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long)LOGIDLEMS * 1000000;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+
+        pthread_mutex_lock(&idlelock);
+        atomic_store(&idle, 1);
+        if (atomic_load(&running))
+            (void)pthread_cond_timedwait(&idlecond, &idlelock, &ts);
+        atomic_store(&idle, 0);
+        pthread_mutex_unlock(&idlelock);
+    }
+
+    (void)drain();
+    return NULL;
+}
+
+/*
+ * Until this is called, and after logstop, messages are written as they
+ * are logged.  With a path, messages are appended to that file, and stderr
+ * is pointed at it so git's and the extractor children's errors land there
+ * too.  Fails only if the file cannot be opened; without a drainer thread,
+ * messages are written synchronously.
+ */
+int logstart(char const *path)
+{
+    pthread_once(&ringonce, ringkeyinit);
+
+    if (path)
+    {
+        FILE *f = fopen(path, "a");
+        if (f == NULL)
+        {
+            logerror("Failed to open log file %s: %s", path, strerror(errno));
+            return -1;
+        }
+        (void)fcntl(fileno(f), F_SETFD, FD_CLOEXEC);
+        (void)fflush(stderr);
+        (void)dup2(fileno(f), STDERR_FILENO);
+        logfile = f;
+    }
+
+    atomic_store(&running, 1);
+    if (threadspawn(&drainer, drainmain, NULL) != 0)
+    {
+        atomic_store(&running, 0);
+        logerror("Failed to start log thread, logging synchronously");
+    }
+
+    return 0;
+}
+
+/* Writes out everything logged so far, once no other thread is logging */
+void logstop(void)
+{
+    if (atomic_load(&running))
+    {
+        pthread_mutex_lock(&idlelock);
+        atomic_store(&running, 0);
+        pthread_cond_signal(&idlecond);
+        pthread_mutex_unlock(&idlelock);
+
+        pthread_join(drainer, NULL);
+    }
+
+    if (logfile)
+    {
+        (void)fclose(logfile);
+        logfile = NULL;
+    }
+}
+
+void loginfo(char const *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    logput(Linfo, fmt, args);
+    va_end(args);
+}
+
+void logerror(char const *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    logput(Lerror, fmt, args);
+    va_end(args);
+}
+
+void logdebug(char const *fmt, ...)
+{
+    if (!debug)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    logput(Ldebug, fmt, args);
+    va_end(args);
+}
@@ -3,10 +3,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <sqlite3.h>
@@ -19,24 +20,105 @@ char const *const appname = "malachi";
 
 int debug = 0;
 
+/* Extractor children re-run this executable, found the same way the shell found us */
+char const *selfpath = "malachi";
+
 static char const *const commitstr = sizeof(MALACHI_COMMIT_SHORT_HASH) - 1 > 0
     ? "-" MALACHI_COMMIT_SHORT_HASH
     : "";
 
+enum
+{
+    NREADERS = 4,
+    CACHEDQUERIES = 256,
+    MAXCONNS = 1024,
+    MAXEVENTS = 64,
+    MAXINFLIGHT = 64,
+    MAXBACKLOG = 1 << 20,
+    RETRYMS = 50,
+    MAXDEFERMS = 2000,
+    RETRYHINTMS = 500,
+    REPLYWAITMS = 1000,
+    STATSDUMPSEC = 60,
+};
+
 static sig_atomic_t volatile loopstat = 1;
 static sig_atomic_t volatile sigrecvd = 0;
 
+/*
+ * A source of commands, a socket connection or the command pipe.  A command
+ * that cannot be queued yet is deferred: it is held here and its source is
+ * not read until it goes through, so a busy daemon pushes back on the
+ * client's writes instead of losing frames.  Socket clients get a busy
+ * reply with a retry hint once a command has waited MAXDEFERMS.
+ *
+ * events is what the poller watches the descriptor for.  A socket whose
+ * peer has finished sending is kept, at eof, until its commands have been
+ * answered and its queued replies written.  fifo holds the reply FIFO of a
+ * pipe query that is opened but not yet queued.
+ */
+struct Intake
+{
+    int fd;
+    Parser *parser;
+    Reply *reply;
+    Reply *fifo;
+    int deferred;
+    int eof;
+    int queued;
+    int events;
+    double since;
+    Command cmd;
+};
+
+/*
+ * A socket connection, or the reply FIFO of a query from the pipe, which
+ * has nothing to read and so starts at eof.  The intake comes first, poller
+ * events carry a pointer to it.
+ */
+struct Conn
+{
+    struct Intake in;
+    struct Conn *next;
+    struct Conn **prev;
+};
+
+struct Daemon
+{
+    Config const *config;
+    Indexer *indexer;
+    Searcher *searcher;
+    Poller *poller;
+    char *pipepath;
+    char *replydir;
+    struct Intake pipe;
+    char *sockpath;
+    char *statspath;
+    double dumped;
+    int listenfd;
+    int wake[2];
+    struct Conn *conns;
+    int nconns;
+    int ndeferred;
+    int generation;
+};
+
 struct Opts
 {
     int version;
     int config;
     int test;
+    int bench;
+    int extract;
     char const *testname;
+    char const *benchname;
+    char const *logpath;
+    int nworkers;
 };
 
 static void usage(char *argv[])
 {
-    eprintf("Usage: %s [-v] [-d] [-c] [-t [name]]\n", argv[0]);
+    eprintf("Usage: %s [-v] [-d] [-c] [-j workers] [-l logfile] [-t [name]] [-b [name]]\n", argv[0]);
 }
 
 static void yyjsonversionprint(void)
@@ -76,157 +158,700 @@ static void sighandler(int sig)
     loopstat = 0;
 }
 
-static int handlecommand(struct Command const *cmd)
+/* Socket clients get an acknowledgement per command, FIFO clients have nowhere to receive one */
+static void ack(Reply *reply, Opcode op, char const *error)
+{
+    if (reply)
+        (void)replyack(reply, opname(op), error);
+}
+
+/* Answered from the metrics table directly, without queueing */
+static void stats(Reply *reply)
+{
+    if (reply == NULL)
+    {
+        logerror("Stats requested on the command pipe, see stats.json instead");
+        return;
+    }
+
+    size_t len = 0;
+    char *json = metricsjson(&len);
+    if (json == NULL)
+    {
+        (void)replyack(reply, opname(Opstats), "failed to collect stats");
+        return;
+    }
+
+    (void)replystats(reply, json, len);
+    free(json);
+}
+
+static struct Conn *connadd(struct Daemon *daemon, int fd, Parser *parser, Reply *reply);
+
+/*
+ * A query from the pipe is answered on a FIFO its client made for it,
+ * which the loop then writes like a socket.  The client opens the FIFO
+ * before sending the query; one that is late is given REPLYWAITMS, with the
+ * pipe deferred meanwhile.  Returns -1 when the query cannot be answered.
+ */
+static int fifoattach(struct Daemon *daemon, struct Intake *in)
 {
+    char const *queryid = in->cmd.queryop.queryid.s;
+    if (queryidvalid(queryid) == 0)
+    {
+        logerror("Invalid query id: %s", queryid);
+        return -1;
+    }
+
+    if (daemon->nconns >= MAXCONNS)
+        return -Ebusy;
+
+    char *path = joinpath2(daemon->replydir, queryid);
+    if (path == NULL)
+        return -1;
+
+    int const fd = open(path, O_WRONLY | O_NONBLOCK);
+    if (fd == -1 && errno == ENXIO && (in->deferred == 0 || (clocksec() - in->since) * 1000 < REPLYWAITMS))
+    {
+        free(path);
+        return -Ebusy;
+    }
+    if (fd == -1)
+    {
+        logerror("Failed to open reply channel %s: %s", path, strerror(errno));
+        free(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || S_ISFIFO(st.st_mode) == 0)
+    {
+        logerror("Reply channel %s is not a FIFO", path);
+        close(fd);
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    /* Keep git children from holding the reply open */
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    Reply *reply = replyfifo(fd, daemon->wake[1]);
+    if (reply == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    /* The intake's own reference keeps the reply alive even if the connection goes first */
+    replyretain(reply);
+    struct Conn *conn = connadd(daemon, fd, NULL, reply);
+    if (conn == NULL)
+    {
+        replyrelease(reply);
+        return -1;
+    }
+    conn->in.eof = 1;
+
+    in->fifo = reply;
+    return 0;
+}
+
+/* Returns -Ebusy, having done nothing, when the command has to wait for room */
+static int handlecommand(struct Daemon *daemon, struct Intake *in)
+{
+    struct Command const *cmd = &in->cmd;
+    Reply *reply = in->reply;
+    int rc;
+
+    /* Every query, remove and batch holds its client's reply until answered, and waits while the client is behind reading */
+    if (reply && cmd->op != Opadd && cmd->op != Opshutdown && (replyinflight(reply) >= MAXINFLIGHT || replyqueued(reply) >= MAXBACKLOG))
+        return -Ebusy;
+
     switch (cmd->op)
     {
     case Opadd:
-        loginfo("Add repository: %s", cmd->pathop.path);
+        rc = indexersubmit(daemon->indexer, cmd->op, cmd, 1, NULL);
+        if (rc == -Ebusy)
+            return rc;
+        loginfo("Add repository: %s", cmd->pathop.path.s);
+        if (rc != 0)
+        {
+            logerror("Failed to queue %s for indexing", cmd->pathop.path.s);
+            ack(reply, cmd->op, "failed to queue root");
+            return 0;
+        }
+        ack(reply, cmd->op, NULL);
         return 0;
     case Opremove:
-        loginfo("Remove repository: %s", cmd->pathop.path);
+        /* Acknowledged by the writer once the root is gone */
+        rc = indexersubmit(daemon->indexer, cmd->op, cmd, 1, reply);
+        if (rc == -Ebusy)
+            return rc;
+        loginfo("Remove repository: %s", cmd->pathop.path.s);
+        if (rc != 0)
+        {
+            logerror("Failed to queue removal of %s", cmd->pathop.path.s);
+            ack(reply, cmd->op, "failed to queue root");
+        }
+        return 0;
+    case Opbatch:
+        rc = indexersubmit(daemon->indexer, cmd->op, cmd->batchop.cmds, cmd->batchop.ncmds, reply);
+        if (rc == -Ebusy)
+            return rc;
+        loginfo("Batch of %zu root changes", cmd->batchop.ncmds);
+        if (rc != 0)
+        {
+            logerror("Failed to queue batch");
+            if (reply)
+                (void)replybatch(reply, cmd->batchop.ncmds, "failed to queue batch");
+        }
         return 0;
     case Opquery:
+        if (reply == NULL)
+        {
+            if (in->fifo == NULL && (rc = fifoattach(daemon, in)) != 0)
+                return rc == -Ebusy ? rc : 0;
+            reply = in->fifo;
+        }
+
+        rc = searchersubmit(daemon->searcher, cmd, reply);
+        if (rc == -Ebusy)
+            return rc;
         loginfo(
             "Query: %s (id=%s, filter=%s)",
-            cmd->queryop.terms,
-            cmd->queryop.queryid,
-            cmd->queryop.repofilter);
+            cmd->queryop.terms.s,
+            cmd->queryop.queryid.s,
+            cmd->queryop.repofilter.s);
+        if (rc != 0)
+        {
+            logerror("Failed to queue query %s", cmd->queryop.queryid.s);
+            (void)replydone(reply, cmd->queryop.queryid.s, -1);
+        }
+        replyrelease(in->fifo);
+        in->fifo = NULL;
         return 0;
     case Opshutdown:
         loginfo("Shutdown requested");
+        ack(reply, cmd->op, NULL);
+        loopstat = 0;
         return 1;
+    case Opstats:
+        stats(reply);
+        return 0;
     default:
         logerror("Unknown operation");
         return 0;
     }
 }
 
-static void readcommands(int pipefd, Parser *parser, int *generation)
+/* Reads are watched unless a command is deferred or the peer is done sending, writes while replies are queued */
+static int watch(struct Daemon *daemon, struct Intake *in)
 {
-    ssize_t nread = parserinput(parser, pipefd);
-    if (nread == -Enospace)
+    int const events = (in->deferred || in->eof ? 0 : Pollin) | (in->queued ? Pollout : 0);
+    if (events == in->events)
+        return 0;
+
+    int rc;
+    if (in->events == 0)
+        rc = polleradd(daemon->poller, in->fd, events, in);
+    else if (events == 0)
+        rc = pollerdel(daemon->poller, in->fd);
+    else
+        rc = pollermod(daemon->poller, in->fd, events, in);
+
+    if (rc != 0)
     {
-        logerror("Parser buffer full, processing pending commands");
+        logerror("Failed to watch command source: %s", strerror(errno));
+        return -1;
+    }
+
+    in->events = events;
+    return 0;
+}
+
+/* A deferred source is not read, so nothing reads past the command it holds */
+static void defer(struct Daemon *daemon, struct Intake *in)
+{
+    in->deferred = 1;
+    in->since = clocksec();
+    daemon->ndeferred++;
+    metriccount("commands.deferred", 1);
+    (void)watch(daemon, in);
+}
+
+static void resume(struct Daemon *daemon, struct Intake *in)
+{
+    in->deferred = 0;
+    daemon->ndeferred--;
+    (void)watch(daemon, in);
+}
+
+static void reject(Reply *reply, Command const *cmd)
+{
+    char const *queryid = cmd->op == Opquery ? cmd->queryop.queryid.s : NULL;
+    logerror("Busy, turning away %s%s%s", opname(cmd->op), queryid ? " " : "", queryid ? queryid : "");
+    metriccount("commands.rejected", 1);
+    (void)replybusy(reply, opname(cmd->op), queryid, RETRYHINTMS);
+}
+
+/* Handles buffered commands in order until one has to wait */
+static void admit(struct Daemon *daemon, struct Intake *in)
+{
+    for (;;)
+    {
+        if (in->deferred == 0)
+        {
+            int result = parsecommand(in->parser, &in->cmd, &daemon->generation);
+            if (result == 0)
+                return; /* Incomplete command in buffer - normal, wait for more data */
+
+            if (result < 0)
+            {
+                /* The parser has already skipped past the bad frame */
+                logerror("Malformed record skipped, continuing");
+                metriccount("commands.malformed", 1);
+                if (in->reply)
+                    (void)replyack(in->reply, NULL, "malformed command");
+                continue;
+            }
+        }
+
+        if (handlecommand(daemon, in) != -Ebusy)
+        {
+            metriccount("commands", 1);
+            if (in->deferred)
+                resume(daemon, in);
+            continue;
+        }
+
+        if (in->deferred == 0)
+        {
+            defer(daemon, in);
+            return;
+        }
+
+        /* The pipe has no way to answer, its writers just wait */
+        if (in->reply == NULL || (clocksec() - in->since) * 1000 < MAXDEFERMS)
+            return;
+
+        reject(in->reply, &in->cmd);
+        resume(daemon, in);
     }
-    else if (nread == 0)
+}
+
+/* Returns -1 once the peer has nothing more to send */
+static int readcommands(struct Daemon *daemon, struct Intake *in)
+{
+    ssize_t nread = parserinput(in->parser, in->fd);
+    if (nread == 0)
     {
         /* EOF - no more data available */
-        return;
+        return -1;
     }
-    else if (nread < 0)
+    else if (nread < 0 && nread != -Enospace)
     {
+        if (errno == EAGAIN || errno == EINTR)
+            return 0;
         logerror("Read error: %s", strerror(errno));
+        return -1;
+    }
+
+    /* A full buffer still holds whole frames, handling them makes room */
+    admit(daemon, in);
+    return 0;
+}
+
+/* Deferred sources are retried every RETRYMS, in no particular order */
+static void retrydeferred(struct Daemon *daemon)
+{
+    if (daemon->pipe.deferred)
+        admit(daemon, &daemon->pipe);
+
+    for (struct Conn *conn = daemon->conns; conn && daemon->ndeferred > 0; conn = conn->next)
+        if (conn->in.deferred)
+            admit(daemon, &conn->in);
+}
+
+static void connclose(struct Daemon *daemon, struct Conn *conn)
+{
+    if (conn->in.deferred)
+        daemon->ndeferred--;
+    if (conn->in.events)
+        (void)pollerdel(daemon->poller, conn->in.fd);
+
+    /* Replies that fit in the socket buffer still go out, commands still running find it closed */
+    (void)replyflush(conn->in.reply);
+    replyclose(conn->in.reply);
+    replyrelease(conn->in.reply);
+    parserdestroy(conn->in.parser);
+
+    *conn->prev = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    daemon->nconns--;
+    metricgauge("connections", (uint64_t)daemon->nconns);
+
+    free(conn);
+}
+
+/*
+ * Writes what the connection has queued and watches for room if some is
+ * left.  A connection at eof is closed once nothing is left to answer,
+ * checked before flushing so a last reply queued meanwhile is not lost.
+ */
+static void connflush(struct Daemon *daemon, struct Conn *conn)
+{
+    int const done = conn->in.eof && replyinflight(conn->in.reply) == 0;
+    int const rc = replyflush(conn->in.reply);
+    if (rc < 0 || (rc == 0 && done))
+    {
+        connclose(daemon, conn);
         return;
     }
 
-    struct Command cmd;
-    int result;
+    conn->in.queued = rc;
+    (void)watch(daemon, &conn->in);
+}
+
+/* Replies were queued from another thread, or a connection's last command was answered */
+static void wakeup(struct Daemon *daemon)
+{
+    char buf[64];
+    while (read(daemon->wake[0], buf, sizeof(buf)) > 0)
+        ;
+
+    struct Conn *next;
+    for (struct Conn *conn = daemon->conns; conn; conn = next)
+    {
+        next = conn->next;
+        connflush(daemon, conn);
+    }
+}
+
+/* Takes the parser and the reply, which owns fd, and lets go of both on failure */
+static struct Conn *connadd(struct Daemon *daemon, int fd, Parser *parser, Reply *reply)
+{
+    struct Conn *conn = malloc(sizeof(*conn));
+    if (conn == NULL)
+    {
+        parserdestroy(parser);
+        replyrelease(reply);
+        return NULL;
+    }
 
+    conn->in = (struct Intake){ .fd = fd, .parser = parser, .reply = reply };
+    if (watch(daemon, &conn->in) != 0)
+    {
+        parserdestroy(parser);
+        replyrelease(reply);
+        free(conn);
+        return NULL;
+    }
+
+    conn->next = daemon->conns;
+    conn->prev = &daemon->conns;
+    if (daemon->conns)
+        daemon->conns->prev = &conn->next;
+    daemon->conns = conn;
+    daemon->nconns++;
+    metricgauge("connections", (uint64_t)daemon->nconns);
+    return conn;
+}
+
+static void connaccept(struct Daemon *daemon)
+{
     for (;;)
     {
-        result = parsecommand(parser, &cmd, generation);
-        if (result <= 0)
-            break;
+        int fd = accept(daemon->listenfd, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                logerror("Failed to accept connection: %s", strerror(errno));
+            return;
+        }
+
+        if (daemon->nconns >= MAXCONNS)
+        {
+            logerror("Too many connections, refusing client");
+            close(fd);
+            continue;
+        }
 
-        result = handlecommand(&cmd);
-        if (result < 0)
-            break;
+        /* Only the loop reads and writes the socket, and never waits on it */
+        (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+        int const flags = fcntl(fd, F_GETFL);
+        if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+        {
+            logerror("Failed to make connection nonblocking: %s", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        Parser *parser = parsercreate((size_t)MAXRECORDSIZE * 2);
+        Reply *reply = parser ? replysocket(fd, daemon->wake[1]) : NULL;
+        if (reply == NULL)
+        {
+            parserdestroy(parser);
+            close(fd);
+            continue;
+        }
+
+        if (connadd(daemon, fd, parser, reply) != NULL)
+            logdebug("Client connected (%d open)", daemon->nconns);
     }
+}
 
-    if (result == 0)
+static int listenopen(struct Daemon *daemon)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(daemon->sockpath) >= sizeof(addr.sun_path))
+    {
+        logerror("Socket path too long: %s", daemon->sockpath);
+        return -1;
+    }
+    memcpy(addr.sun_path, daemon->sockpath, strlen(daemon->sockpath) + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        logerror("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    (void)fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    /* The command pipe was created just before, so no other daemon owns a leftover socket */
+    (void)unlink(daemon->sockpath);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0)
     {
-        /* Incomplete command in buffer - normal, wait for more data */
+        logerror("Failed to listen on %s: %s", daemon->sockpath, strerror(errno));
+        close(fd);
+        return -1;
     }
-    else if (result < 0)
+
+    if (polleradd(daemon->poller, fd, Pollin, &daemon->listenfd) != 0)
     {
-        logerror("Malformed record skipped, continuing");
+        logerror("Failed to watch socket: %s", strerror(errno));
+        close(fd);
+        (void)unlink(daemon->sockpath);
+        return -1;
     }
+
+    daemon->listenfd = fd;
+    return 0;
 }
 
-static int runloop(char const *pipepath)
+static void listenclose(struct Daemon *daemon)
 {
-    int ret = -1;
-    int pipefd = -1;
+    (void)pollerdel(daemon->poller, daemon->listenfd);
+    close(daemon->listenfd);
+    (void)unlink(daemon->sockpath);
+}
+
+static int pipeopen(struct Daemon *daemon)
+{
+    daemon->pipe.fd = open(daemon->pipepath, O_RDONLY | O_NONBLOCK);
+    if (daemon->pipe.fd == -1)
+    {
+        logerror("Failed to open command pipe: %s", strerror(errno));
+        return -1;
+    }
+
+    daemon->pipe.events = 0;
+    if (watch(daemon, &daemon->pipe) != 0)
+    {
+        close(daemon->pipe.fd);
+        daemon->pipe.fd = -1;
+        return -1;
+    }
+
+    parserreset(daemon->pipe.parser);
+    return 0;
+}
+
+static void pipeclose(struct Daemon *daemon)
+{
+    if (daemon->pipe.fd == -1)
+        return;
+
+    if (daemon->pipe.events)
+        (void)pollerdel(daemon->poller, daemon->pipe.fd);
+    close(daemon->pipe.fd);
+}
+
+/* Threads queueing replies write to wake[1], both ends are nonblocking */
+static int wakeopen(struct Daemon *daemon)
+{
+    if (pipe(daemon->wake) != 0)
+    {
+        logerror("Failed to create wake pipe: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < 2; ++i)
+    {
+        (void)fcntl(daemon->wake[i], F_SETFD, FD_CLOEXEC);
+        (void)fcntl(daemon->wake[i], F_SETFL, O_NONBLOCK);
+    }
+
+    if (polleradd(daemon->poller, daemon->wake[0], Pollin, daemon->wake) != 0)
+    {
+        logerror("Failed to watch wake pipe: %s", strerror(errno));
+        close(daemon->wake[0]);
+        close(daemon->wake[1]);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void wakeclose(struct Daemon *daemon)
+{
+    (void)pollerdel(daemon->poller, daemon->wake[0]);
+    close(daemon->wake[0]);
+    close(daemon->wake[1]);
+}
+
+static void statsdump(struct Daemon *daemon)
+{
+    daemon->dumped = clocksec();
+    if (metricsdump(daemon->statspath) != 0)
+        logerror("Failed to write %s: %s", daemon->statspath, strerror(errno));
+}
 
-    int generation = 0;
+static int runloop(struct Daemon *daemon)
+{
+    int ret = -1;
 
-    Parser *parser = parsercreate((size_t)MAXRECORDSIZE * 2);
-    if (!parser)
+    daemon->pipe.parser = parsercreate((size_t)MAXRECORDSIZE * 2);
+    if (!daemon->pipe.parser)
     {
         logerror("Failed to create parser");
         return -1;
     }
 
-    struct pollfd pfd = {
-        .events = POLLIN,
-    };
+    daemon->poller = pollercreate();
+    if (!daemon->poller)
+    {
+        logerror("Failed to create poller: %s", strerror(errno));
+        goto destroyparser;
+    }
+
+    if (wakeopen(daemon) != 0)
+        goto destroypoller;
+
+    if (pipeopen(daemon) != 0)
+        goto closewake;
+
+    if (listenopen(daemon) != 0)
+        goto closepipe;
+
+    loginfo("Command socket: %s", daemon->sockpath);
 
-    goto init;
+    Pollevent events[MAXEVENTS];
 
     while (loopstat)
     {
-        pfd.revents = 0;
-        int rc = poll(&pfd, 1, 1000);
-
-        if (rc == -1)
+        int n = pollerwait(daemon->poller, events, MAXEVENTS, daemon->ndeferred > 0 ? RETRYMS : 1000);
+        if (n == -1)
         {
             if (errno == EINTR)
                 continue;
             logerror("poll failed: %s", strerror(errno));
-            goto closepipefd;
+            goto closeall;
         }
 
-        if (rc == 0)
-            continue;
+        /* A whole timeout without events, the writer may use the lull */
+        if (n == 0 && daemon->ndeferred == 0)
+            indexeridle(daemon->indexer);
 
-        if (pfd.revents & POLLERR)
+        int woken = 0;
+        for (int i = 0; i < n; ++i)
         {
-            logerror("Pipe error occurred");
-            goto closepipefd;
-        }
+            Pollevent const *ev = &events[i];
 
-        if (pfd.revents & POLLIN)
-        {
-            readcommands(pipefd, parser, &generation);
-        }
+            /* Handled after the other events, flushing may close connections they refer to */
+            if (ev->data == daemon->wake)
+            {
+                woken = 1;
+                continue;
+            }
 
-        if (pfd.revents & POLLHUP)
-        {
-            logdebug("Client disconnected, reopening pipe");
-            close(pipefd);
-            goto init;
-        }
+            if (ev->data == &daemon->listenfd)
+            {
+                connaccept(daemon);
+                continue;
+            }
 
-        continue;
+            if (ev->data == &daemon->pipe)
+            {
+                if (ev->error)
+                {
+                    logerror("Pipe error occurred");
+                    goto closeall;
+                }
+
+                if (ev->readable)
+                    (void)readcommands(daemon, &daemon->pipe);
+
+                if (ev->hangup && ev->readable == 0)
+                {
+                    logdebug("Client disconnected, reopening pipe");
+                    pipeclose(daemon);
+                    if (pipeopen(daemon) != 0)
+                        goto closeall;
+                }
+                continue;
+            }
 
-    init:
-        pipefd = open(pipepath, O_RDONLY | O_NONBLOCK);
-        if (pipefd == -1)
-        {
-            if (errno == EINTR)
+            struct Conn *conn = ev->data;
+            if (ev->error || (ev->hangup && ev->readable == 0))
             {
-                logdebug("Signal received during pipe open, exiting");
-                ret = 0;
-                goto destroyparser;
+                connclose(daemon, conn);
+                continue;
             }
-            logerror("Failed to open command pipe: %s", strerror(errno));
-            goto destroyparser;
+
+            /* Commands still running answer a client that has finished sending */
+            if (ev->readable && readcommands(daemon, &conn->in) != 0)
+                conn->in.eof = 1;
+            connflush(daemon, conn);
         }
-        parserreset(parser);
-        pfd.fd = pipefd;
+
+        if (daemon->ndeferred > 0)
+            retrydeferred(daemon);
+
+        if (woken)
+            wakeup(daemon);
+
+        if (clocksec() - daemon->dumped >= STATSDUMPSEC)
+            statsdump(daemon);
     }
 
     ret = 0;
 
-closepipefd:
-    close(pipefd);
+closeall:
+    statsdump(daemon);
+    while (daemon->conns)
+        connclose(daemon, daemon->conns);
+    listenclose(daemon);
+closepipe:
+    pipeclose(daemon);
+closewake:
+    wakeclose(daemon);
+destroypoller:
+    pollerdestroy(daemon->poller);
 destroyparser:
-    parserdestroy(parser);
+    replyrelease(daemon->pipe.fifo);
+    parserdestroy(daemon->pipe.parser);
     return ret;
 }
 
-static int run(Config *config)
+static int run(Config *config, int nworkers, char const *logpath)
 {
     int ret = -1;
     Error error = { 0 };
@@ -251,6 +876,17 @@ static int run(Config *config)
         return -1;
     }
 
+    /* A git child exiting early must not take the daemon down with it */
+    sa.sa_handler = SIG_IGN;
+    rc = sigaction(SIGPIPE, &sa, NULL);
+    if (rc == -1)
+    {
+        logerror("Failed to ignore SIGPIPE");
+        return -1;
+    }
+
+    metricsinit();
+
     Database *database = dbcreate(config, &error);
     if (database == NULL)
     {
@@ -258,6 +894,10 @@ static int run(Config *config)
         return -1;
     }
 
+    /* From here on worker threads log, the drainer keeps them from waiting on stdio */
+    if (logstart(logpath) != 0)
+        goto destroydatabase;
+
     rc = mkdirp(config->runtimedir, 0700);
     if (rc == -1)
     {
@@ -272,20 +912,78 @@ static int run(Config *config)
         goto destroydatabase;
     }
 
+    /* Clients make the FIFOs that queries from the pipe are answered on here */
+    char *replydir = joinpath2(config->runtimedir, "replies");
+    if (replydir == NULL || mkdirp(replydir, 0700) != 0)
+    {
+        logerror("Failed to create reply directory: %s", strerror(errno));
+        goto freereplydir;
+    }
+
     rc = mkfifo(pipepath, 0622);
     if (rc == -1)
     {
         logerror("Failed to mkfifo: %s", strerror(errno));
-        goto freepipepath;
+        goto freereplydir;
     }
 
     loginfo("Starting daemon");
     loginfo("Command pipe: %s", pipepath);
     logdebug("Debug logging enabled");
 
-    rc = runloop(pipepath);
-    if (rc != 0)
+    Cache *cache = cachecreate(CACHEDQUERIES);
+    if (cache == NULL)
+    {
+        logerror("Failed to create query cache");
         goto unlinkpipepath;
+    }
+
+    Indexer *indexer = indexercreate(database, cache, config->runtimedir, nworkers);
+    if (indexer == NULL)
+    {
+        logerror("Failed to start indexer");
+        goto destroycache;
+    }
+
+    loginfo("Extraction workers: %d", nworkers);
+
+    Searcher *searcher = searchercreate(config, cache, NREADERS);
+    if (searcher == NULL)
+    {
+        logerror("Failed to start searcher");
+        goto destroyindexer;
+    }
+
+    char *sockpath = joinpath2(config->runtimedir, "socket");
+    if (sockpath == NULL)
+    {
+        logerror("Failed to allocate socket path");
+        goto destroysearcher;
+    }
+
+    char *statspath = joinpath2(config->runtimedir, "stats.json");
+    if (statspath == NULL)
+    {
+        logerror("Failed to allocate stats path");
+        goto freesockpath;
+    }
+
+    struct Daemon daemon = {
+        .config = config,
+        .indexer = indexer,
+        .searcher = searcher,
+        .pipepath = pipepath,
+        .replydir = replydir,
+        .pipe = { .fd = -1 },
+        .sockpath = sockpath,
+        .statspath = statspath,
+        .dumped = clocksec(),
+        .listenfd = -1,
+    };
+
+    rc = runloop(&daemon);
+    if (rc != 0)
+        goto freestatspath;
 
     switch (sigrecvd)
     {
@@ -302,12 +1000,24 @@ static int run(Config *config)
 
     ret = 0;
 
+freestatspath:
+    free(statspath);
+freesockpath:
+    free(sockpath);
+destroysearcher:
+    searcherdestroy(searcher);
+destroyindexer:
+    indexerdestroy(indexer);
+destroycache:
+    cachedestroy(cache);
 unlinkpipepath:
     unlink(pipepath);
-freepipepath:
+freereplydir:
+    free(replydir);
     free(pipepath);
 destroydatabase:
     dbdestroy(database);
+    logstop();
     return ret;
 }
 
@@ -318,12 +1028,15 @@ int main(int argc, char *argv[])
     struct Opts opts = { 0 };
     Config config = { 0 };
 
+    if (argc > 0)
+        selfpath = argv[0];
+
     {
         int c = 0;
 
         for (;;)
         {
-            c = getopt(argc, argv, "vdct::");
+            c = getopt(argc, argv, "vdcj:l:t::b::x");
             if (c == -1)
                 break;
 
@@ -338,10 +1051,28 @@ int main(int argc, char *argv[])
             case 'c':
                 opts.config = 1;
                 break;
+            case 'j':
+                opts.nworkers = atoi(optarg);
+                if (opts.nworkers <= 0)
+                {
+                    usage(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'l':
+                opts.logpath = optarg;
+                break;
             case 't':
                 opts.test = 1;
                 opts.testname = optarg;
                 break;
+            case 'b':
+                opts.bench = 1;
+                opts.benchname = optarg;
+                break;
+            case 'x':
+                opts.extract = 1;
+                break;
             case '?':
                 usage(argv);
                 return EXIT_FAILURE;
@@ -354,6 +1085,9 @@ int main(int argc, char *argv[])
     {
         Error error = { 0 };
 
+        if (opts.extract)
+            return extractorserve() ? EXIT_FAILURE : EXIT_SUCCESS;
+
         if (opts.test)
         {
             int tr;
@@ -365,6 +1099,9 @@ int main(int argc, char *argv[])
             return tr ? EXIT_FAILURE : EXIT_SUCCESS;
         }
 
+        if (opts.bench)
+            return benchmain(opts.benchname) ? EXIT_FAILURE : EXIT_SUCCESS;
+
         if (opts.version)
         {
             rc = versionprint();
@@ -386,7 +1123,13 @@ int main(int argc, char *argv[])
         }
     }
 
-    rc = run(&config);
+    if (opts.nworkers == 0)
+    {
+        long const ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        opts.nworkers = ncpus > 0 ? (int)ncpus : 1;
+    }
+
+    rc = run(&config, opts.nworkers, opts.logpath);
     ret = (rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 
 freeconfig:
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -18,23 +20,49 @@ enum
     MAXRECORDSIZE = MAXOPSIZE + (2 * PATH_MAX) + (2 * MAXHASHLEN) + MAXFIELDS,
     MAXQUERYIDLEN = 64,
     MAXQUERYTERMSLEN = 4096,
+    MAXBATCHOPS = 1024,
+    MAXFRAMESIZE = 5 << 20,
+    MAXBENCHWORD = 16,
 };
 
+/* A batch of MAXBATCHOPS entries, each an op and a PATH_MAX path with the JSON around them, fits in one frame */
+STATIC_ASSERT(MAXFRAMESIZE >= MAXBATCHOPS * (MAXOPSIZE + PATH_MAX + 32));
+
 enum
 {
     Emissingdir = 2,
     Enospace = 3,
+    Ebusy = 4,
 };
 
 typedef struct Error Error;
 typedef struct Config Config;
 typedef struct Filter Filter;
+typedef struct Sink Sink;
 typedef struct Test Test;
+typedef struct Bench Bench;
 typedef struct Database Database;
 typedef struct Parser Parser;
 typedef struct Command Command;
+typedef struct Str Str;
+typedef struct Leaf Leaf;
+typedef struct Git Git;
+typedef struct Odb Odb;
+typedef struct Queue Queue;
+typedef struct Pool Pool;
+typedef struct Extractor Extractor;
+typedef struct Metric Metric;
+typedef struct Indexer Indexer;
+typedef struct Searcher Searcher;
+typedef struct Cache Cache;
+typedef struct Results Results;
+typedef struct Reply Reply;
+typedef struct Poller Poller;
+typedef struct Pollevent Pollevent;
 
 typedef char *Getenvfn(char const *name);
+typedef void Poolfn(void *item, void *arg);
+typedef int Hitfn(char const *root, char const *path, double score, void *arg);
 
 struct Error
 {
@@ -50,29 +78,110 @@ struct Config
     char *runtimedir;
 };
 
+/*
+ * Receives text from a streaming filter as it is produced.  page() ends the
+ * current page, text after the last page() forms a final page.  Either
+ * returns nonzero when the filter should stop.
+ */
+struct Sink
+{
+    int (*text)(Sink *sink, char const *text, size_t len);
+    int (*page)(Sink *sink);
+};
+
+/*
+ * Extensions pick a filter by name, magic numbers by leading bytes, both
+ * lists are NULL-terminated.  A Fdefault filter takes whatever no other
+ * filter claims, a Finprocess one is trusted to run inside the daemon.
+ */
+enum
+{
+    Fdefault = 1 << 0,
+    Finprocess = 1 << 1,
+};
+
+/*
+ * A filter provides extract(), which returns all text at once, or stream(),
+ * which pushes it page by page.  Inputs over maxsize are refused, 0 takes
+ * any size.
+ */
 struct Filter
 {
     char const *name;
     char const **exts;
-    int (*extract)(char const *input, char **output);
+    char const **magics;
+    int flags;
+    size_t maxsize;
+    int (*extract)(char const *input, size_t len, char **output);
+    int (*stream)(char const *input, size_t len, Sink *sink);
     char const *(*version)(void);
 };
 
+/* Kinds of Metric: a running total, a last value, or a latency distribution */
+enum
+{
+    Mcounter = 1,
+    Mgauge,
+    Mhistogram,
+};
+
+struct Leaf
+{
+    char const *hash;
+    char const *path;
+    int64_t size;
+    char const *filter;
+    char const *content;
+};
+
+/* What polleradd and pollermod watch a descriptor for */
+enum
+{
+    Pollin = 1 << 0,
+    Pollout = 1 << 1,
+};
+
+struct Pollevent
+{
+    void *data;
+    int readable;
+    int writable;
+    int hangup;
+    int error;
+};
+
 struct Test
 {
     char const *name;
     int (*run)(void);
 };
 
+/* Like a Test, but reports measurements through benchreport */
+struct Bench
+{
+    char const *name;
+    int (*run)(void);
+};
+
 typedef enum Opcode
 {
     Opunknown = 0,
     Opadd,
     Opremove,
     Opquery,
+    Opbatch,
     Opshutdown,
+    Opstats,
 } Opcode;
 
+/* A string borrowed from a frame in the Parser's buffer, always NUL-terminated */
+struct Str
+{
+    char const *s;
+    size_t len;
+};
+
+/* Strings point into the Parser and are only valid until its next parsecommand() or parserinput() */
 struct Command
 {
     Opcode op;
@@ -80,50 +189,59 @@ struct Command
     {
         struct
         {
-            char path[PATH_MAX];
+            Str path;
         } pathop;
 
         struct
         {
-            char queryid[MAXQUERYIDLEN];
-            char terms[MAXQUERYTERMSLEN];
-            char repofilter[PATH_MAX];
+            Str queryid;
+            Str terms;
+            Str repofilter;
         } queryop;
 
+        /* Add and remove commands only, held by the Parser like the strings */
+        struct
+        {
+            Command const *cmds;
+            size_t ncmds;
+        } batchop;
+
         /* shutdown needs no fields */
     };
 };
 
 #define PATHOPFIELDS \
-    X(pathop.path, "path", 1)
+    X(pathop.path, "path", 1, PATH_MAX)
 
-#define QUERYFIELDS                  \
-    X(queryop.queryid, "queryId", 1) \
-    X(queryop.terms, "terms", 1)     \
-    X(queryop.repofilter, "repoFilter", 0)
+#define QUERYFIELDS                                 \
+    X(queryop.queryid, "queryId", 1, MAXQUERYIDLEN) \
+    X(queryop.terms, "terms", 1, MAXQUERYTERMSLEN)  \
+    X(queryop.repofilter, "repoFilter", 0, PATH_MAX)
 
+/* Values must be shorter than size, the limits consumers copy them into */
 struct Fieldspec
 {
     size_t const offset;
     size_t const size;
     char const *const name;
     int const required;
+    size_t const keylen;
     char const *const jsonkey;
 };
 
-#define X(field, jsonkey, required) STATIC_ASSERT(sizeof(((Command *)0)->field) <= INT_MAX); /* NOLINT(bugprone-sizeof-expression) */
+#define X(field, jsonkey, required, size) STATIC_ASSERT(sizeof(((Command *)0)->field) == sizeof(Str)); /* NOLINT(bugprone-sizeof-expression) */
 PATHOPFIELDS
 QUERYFIELDS
 #undef X
 
 static struct Fieldspec const pathopfields[] = {
-#define X(field, jsonkey, required) { offsetof(Command, field), sizeof(((Command *)0)->field), #field, required, jsonkey },
+#define X(field, jsonkey, required, size) { offsetof(Command, field), size, #field, required, sizeof(jsonkey) - 1, jsonkey },
     PATHOPFIELDS
 #undef X
 };
 
 static struct Fieldspec const queryopfields[] = {
-#define X(field, jsonkey, required) { offsetof(Command, field), sizeof(((Command *)0)->field), #field, required, jsonkey },
+#define X(field, jsonkey, required, size) { offsetof(Command, field), size, #field, required, sizeof(jsonkey) - 1, jsonkey },
     QUERYFIELDS
 #undef X
 };
@@ -140,14 +258,30 @@ static struct
     OP(Opadd, "add", 1, pathopfields),
     OP(Opremove, "remove", 1, pathopfields),
     OP(Opquery, "query", 3, queryopfields),
+    OP(Opbatch, "batch", 0, NULL),
     OP(Opshutdown, "shutdown", 0, NULL),
+    OP(Opstats, "stats", 0, NULL),
 #undef OP
 };
 
 int eprintf(char *fmt, ...);
+int logstart(char const *path);
+void logstop(void);
 void loginfo(char const *fmt, ...);
 void logerror(char const *fmt, ...);
 void logdebug(char const *fmt, ...);
+double clocksec(void);
+
+void metricsinit(void);
+Metric *metricget(char const *name, int kind);
+void metricadd(Metric *m, uint64_t n);
+void metricset(Metric *m, uint64_t v);
+void metrictime(Metric *m, double seconds);
+void metriccount(char const *name, uint64_t n);
+void metricgauge(char const *name, uint64_t v);
+void metricsince(char const *name, double start);
+char *metricsjson(size_t *len);
+int metricsdump(char const *path);
 
 char *joinpath2(char const *a, char const *b);
 char *joinpath3(char const *a, char const *b, char const *c);
@@ -165,28 +299,147 @@ void configfree(Config *config);
 
 void filteradd(Filter const *ops);
 Filter const *filterget(char const *ext);
+Filter const *filtersniff(char const *data, size_t len);
+Filter const *filtercheck(Filter const *filter, char const *data, size_t len);
+int filtercansniff(void);
+Filter const *filterdefault(void);
+size_t filtersniffmax(void);
 Filter const **filterall(void);
 
 void testadd(Test const *ops);
 int testall(void);
 int testone(char const *name);
+char *testdirmake(char const *name);
+void testdirremove(char const *dir);
+int testfile(char const *dir, char const *name, char const *data, size_t len);
+int testgit(char const *repo, char const *const args[]);
+
+void benchadd(Bench const *ops);
+int benchmain(char const *name);
+void benchreport(char const *metric, double value, char const *unit);
+uint64_t benchrand(uint64_t *state);
+size_t benchword(uint64_t *state, char *out);
 
 Database *dbcreate(Config const *config, Error *err);
+Database *dbopenreader(Config const *config, Error *err);
 void dbdestroy(Database *db);
 int dbensure(Database *db, Error *err);
 char *dbrepoget(Database *db, char const *repopath);
 int dbreposet(Database *db, char const *repopath, char const *sha);
+int dbbegin(Database *db);
+int dbbeginread(Database *db);
+int dbcommit(Database *db);
+int dbrollback(Database *db);
+int dbftsmerge(Database *db, int npages);
+int dbftsoptimize(Database *db);
+int64_t dbrootadd(Database *db, char const *repopath);
+int dbrootdel(Database *db, char const *repopath);
+int dbrootreclaim(Database *db, int limit);
+int dbleafclear(Database *db, int64_t rootid);
+int64_t dbblobfind(Database *db, char const *hash);
+int64_t dbblobput(Database *db, Leaf const *leaf);
+int dbblobfill(Database *db, int64_t blobid, char const *filter, char const *content);
+int dbblobsweep(Database *db);
+int dbpageput(Database *db, int64_t blobid, int page, char const *content);
+int dbpageclear(Database *db, int64_t blobid);
+int dbleafput(Database *db, int64_t rootid, int64_t blobid, char const *path);
+int dbleafdel(Database *db, int64_t rootid, char const *path);
+int dbleafmove(Database *db, int64_t rootid, char const *from, char const *to);
+int dbsearch(Database *db, char const *terms, char const *repofilter, int limit, Hitfn *fn, void *arg);
 
 int statuswrite(char const *runtimedir, char const *repopath, char const *sha);
 int statusensure(char const *runtimedir, char const *repopath);
+int statusclear(char const *runtimedir, char const *repopath);
+
+Git *gitopen(char const *repo, char const *const args[]);
+int gitclose(Git *g);
+ssize_t gitread(Git *g, char delim, char **rec);
+int gitreadn(Git *g, char *dst, size_t n);
+int gitwrite(Git *g, char const *buf, size_t len);
+int gitrevparse(char const *repo, char const *rev, char *out, size_t outsize);
+int gitblobsize(Git *g, char const *oid, size_t *size);
+char *gitblob(Git *g, char const *oid, size_t *size);
+
+Odb *odbopen(char const *repopath);
+void odbclose(Odb *odb);
+char *odbblob(Odb *odb, char const *oid, size_t *size);
+int odbblobsize(Odb *odb, char const *oid, size_t *size);
+
+Queue *queuecreate(size_t cap);
+void queuedestroy(Queue *q);
+int queuepush(Queue *q, void *item);
+int queuetrypush(Queue *q, void *item);
+void *queuepop(Queue *q);
+void *queuetrypop(Queue *q);
+void queueclose(Queue *q);
+size_t queuelen(Queue *q);
+
+int threadspawn(pthread_t *thread, void *(*fn)(void *), void *arg);
+Pool *poolcreate(int nthreads, size_t depth, Poolfn *fn, void *arg);
+void pooldestroy(Pool *pool);
+int poolsubmit(Pool *pool, void *item);
+int pooltrysubmit(Pool *pool, void *item);
+int poolsize(Pool const *pool);
+
+Extractor *extractorcreate(void);
+void extractordestroy(Extractor *e);
+int extractorrun(Extractor *e, Filter const *filter, char const *input, size_t len, Sink *sink, char **content);
+int extractorserve(void);
+
+Indexer *indexercreate(Database *db, Cache *cache, char const *runtimedir, int nworkers);
+void indexerdestroy(Indexer *ix);
+void indexeridle(Indexer *ix);
+size_t pagesplit(char const *buf, size_t len);
+int indexersubmit(Indexer *ix, Opcode op, Command const *cmds, size_t ncmds, Reply *reply);
+
+Searcher *searchercreate(Config const *config, Cache *cache, int nreaders);
+void searcherdestroy(Searcher *s);
+int searchersubmit(Searcher *s, Command const *cmd, Reply *reply);
+int queryidvalid(char const *queryid);
+
+Cache *cachecreate(size_t cap);
+void cachedestroy(Cache *c);
+void cachebump(Cache *c, char const *root);
+uint64_t cachegen(Cache *c, char const *root);
+Results *cacheget(Cache *c, char const *terms, char const *filter, uint64_t gen);
+void cacheput(Cache *c, char const *terms, char const *filter, uint64_t gen, Results *r);
+Results *resultscreate(void);
+void resultsrelease(Results *r);
+int resultsadd(Results *r, char const *root, char const *path, double score);
+int resultseach(Results const *r, Hitfn *fn, void *arg);
+
+Reply *replyfifo(int fd, int wakefd);
+Reply *replysocket(int fd, int wakefd);
+void replyretain(Reply *r);
+void replyrelease(Reply *r);
+void replyclose(Reply *r);
+int replyinflight(Reply *r);
+int replyflush(Reply *r);
+size_t replyqueued(Reply *r);
+int replyhit(Reply *r, char const *queryid, char const *root, char const *path, double score);
+int replydone(Reply *r, char const *queryid, int nhits);
+int replyack(Reply *r, char const *op, char const *error);
+int replybatch(Reply *r, size_t nops, char const *error);
+int replybusy(Reply *r, char const *op, char const *queryid, int retryms);
+int replystats(Reply *r, char const *json, size_t len);
+
+Poller *pollercreate(void);
+void pollerdestroy(Poller *p);
+int polleradd(Poller *p, int fd, int events, void *data);
+int pollermod(Poller *p, int fd, int events, void *data);
+int pollerdel(Poller *p, int fd);
+int pollerwait(Poller *p, Pollevent *events, int max, int timeoutms);
 
 Parser *parsercreate(size_t bufsize);
 void parserdestroy(Parser *p);
 void parserreset(Parser *p);
 ssize_t parserinput(Parser *p, int fd);
 int parsecommand(Parser *p, Command *cmd, int *generation);
+int parserslots(void);
+char const *opname(Opcode op);
 
 /* globals */
 
 extern char const *const appname;
 extern int debug;
+extern char const *selfpath;
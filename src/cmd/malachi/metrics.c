@@ -0,0 +1,289 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <yyjson.h>
+
+#include "malachi.h"
+
+enum
+{
+    MAXMETRICS = 256,
+    MAXMETRICNAME = 48,
+    SUBBITS = 4,
+    NSUB = 1 << SUBBITS,
+    MAXEXP = 44,
+    NBUCKETS = (MAXEXP - SUBBITS + 2) * NSUB,
+};
+
+/*
+ * One named counter, gauge or histogram.  Slots are claimed under a lock
+ * and published through ready, after which every update is a relaxed
+ * atomic.  Histograms count nanoseconds in log-linear buckets: NSUB per
+ * power of two, so any recorded value is known to within 1/NSUB.
+ */
+struct Metric
+{
+    atomic_int ready;
+    int kind;
+    char name[MAXMETRICNAME];
+    atomic_uint_fast64_t value;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t *buckets;
+};
+
+static Metric metrics[MAXMETRICS];
+static pthread_mutex_t metricslock = PTHREAD_MUTEX_INITIALIZER;
+static size_t nmetrics;
+static double started;
+
+static size_t namehash(char const *name)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *name; ++name)
+        h = (h ^ (unsigned char)*name) * 0x100000001b3ULL;
+    return (size_t)h;
+}
+
+static size_t bucketof(uint64_t v)
+{
+    if (v < NSUB)
+        return (size_t)v;
+
+    int const e = 63 - __builtin_clzll(v);
+    if (e > MAXEXP)
+        return NBUCKETS - 1;
+    return ((size_t)(e - SUBBITS + 1) << SUBBITS) + (size_t)((v >> (e - SUBBITS)) & (NSUB - 1));
+}
+
+/* The largest value that lands in bucket i */
+static uint64_t bucketmax(size_t i)
+{
+    if (i < NSUB)
+        return i;
+
+    int const e = (int)(i >> SUBBITS) + SUBBITS - 1;
+    uint64_t const low = (uint64_t)(NSUB + (i & (NSUB - 1))) << (e - SUBBITS);
+    return low + ((uint64_t)1 << (e - SUBBITS)) - 1;
+}
+
+static Metric *probe(char const *name, size_t *slot)
+{
+    for (size_t i = 0, h = namehash(name); i < MAXMETRICS; ++i)
+    {
+        Metric *m = &metrics[(h + i) & (MAXMETRICS - 1)];
+        if (atomic_load_explicit(&m->ready, memory_order_acquire) == 0)
+        {
+            *slot = (h + i) & (MAXMETRICS - 1);
+            return NULL;
+        }
+        if (strcmp(m->name, name) == 0)
+            return m;
+    }
+    *slot = MAXMETRICS;
+    return NULL;
+}
+
+/*
+ * Finds or creates the metric called name, NULL when the table is full, the
+ * name is too long or it is already taken by another kind.  Every update
+ * below accepts NULL, so callers need not check.
+ */
+Metric *metricget(char const *name, int kind)
+{
+    size_t slot;
+    Metric *m = probe(name, &slot);
+    if (m)
+        return m->kind == kind ? m : NULL;
+
+    if (strlen(name) >= MAXMETRICNAME)
+        return NULL;
+
+    pthread_mutex_lock(&metricslock);
+
+    m = probe(name, &slot);
+    if (m == NULL && slot < MAXMETRICS && nmetrics < MAXMETRICS / 2)
+    {
+        m = &metrics[slot];
+        m->kind = kind;
+        memcpy(m->name, name, strlen(name) + 1);
+        if (kind == Mhistogram)
+            m->buckets = calloc(NBUCKETS, sizeof(*m->buckets));
+        if (kind != Mhistogram || m->buckets)
+        {
+            nmetrics++;
+            atomic_store_explicit(&m->ready, 1, memory_order_release);
+        }
+        else
+            m = NULL;
+    }
+
+    pthread_mutex_unlock(&metricslock);
+    return m && m->kind == kind ? m : NULL;
+}
+
+void metricadd(Metric *m, uint64_t n)
+{
+    if (m)
+        atomic_fetch_add_explicit(&m->value, n, memory_order_relaxed);
+}
+
+void metricset(Metric *m, uint64_t v)
+{
+    if (m)
+        atomic_store_explicit(&m->value, v, memory_order_relaxed);
+}
+
+void metrictime(Metric *m, double seconds)
+{
+    if (m == NULL)
+        return;
+
+    uint64_t const ns = seconds > 0 ? (uint64_t)(seconds * 1e9) : 0;
+    atomic_fetch_add_explicit(&m->buckets[bucketof(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->value, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->sum, ns, memory_order_relaxed);
+
+    uint_fast64_t max = atomic_load_explicit(&m->max, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&m->max, &max, ns, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+/* Shorthands for the common case of a metric updated where it is named */
+void metriccount(char const *name, uint64_t n)
+{
+    metricadd(metricget(name, Mcounter), n);
+}
+
+void metricgauge(char const *name, uint64_t v)
+{
+    metricset(metricget(name, Mgauge), v);
+}
+
+void metricsince(char const *name, double start)
+{
+    metrictime(metricget(name, Mhistogram), clocksec() - start);
+}
+
+void metricsinit(void)
+{
+    started = clocksec();
+}
+
+/*
+ * Bucket upper bound at quantile q, read while writers carry on, so only
+ * approximately consistent.  The rank is the nearest rank, ceil(q*count)
+ * but at least 1, so the median of four samples is the second.
+ */
+static double quantile(Metric *m, uint64_t count, double q)
+{
+    double const exact = q * (double)count;
+    uint64_t rank = (uint64_t)exact;
+    if ((double)rank < exact || rank == 0)
+        rank++;
+    uint64_t seen = 0;
+    uint64_t const max = atomic_load_explicit(&m->max, memory_order_relaxed);
+
+    for (size_t i = 0; i < NBUCKETS; ++i)
+    {
+        seen += atomic_load_explicit(&m->buckets[i], memory_order_relaxed);
+        if (seen >= rank)
+        {
+            uint64_t const v = bucketmax(i);
+            return (double)(v < max ? v : max) / 1e3;
+        }
+    }
+    return (double)max / 1e3;
+}
+
+static void histjson(yyjson_mut_doc *doc, yyjson_mut_val *obj, Metric *m)
+{
+    uint64_t const count = atomic_load_explicit(&m->value, memory_order_relaxed);
+    uint64_t const sum = atomic_load_explicit(&m->sum, memory_order_relaxed);
+
+    yyjson_mut_val *h = yyjson_mut_obj_add_obj(doc, obj, m->name);
+    yyjson_mut_obj_add_uint(doc, h, "count", count);
+    if (count == 0)
+        return;
+
+    /* Microseconds */
+    yyjson_mut_obj_add_real(doc, h, "mean", (double)sum / (double)count / 1e3);
+    yyjson_mut_obj_add_real(doc, h, "p50", quantile(m, count, 0.50));
+    yyjson_mut_obj_add_real(doc, h, "p90", quantile(m, count, 0.90));
+    yyjson_mut_obj_add_real(doc, h, "p99", quantile(m, count, 0.99));
+    yyjson_mut_obj_add_real(doc, h, "p999", quantile(m, count, 0.999));
+    yyjson_mut_obj_add_real(doc, h, "max", (double)atomic_load_explicit(&m->max, memory_order_relaxed) / 1e3);
+}
+
+/* Every metric as one JSON object, histogram times in microseconds; caller frees */
+char *metricsjson(size_t *len)
+{
+    yyjson_mut_doc *doc = yyjson_mut_doc_new(NULL);
+    if (doc == NULL)
+        return NULL;
+
+    yyjson_mut_val *root = yyjson_mut_obj(doc);
+    yyjson_mut_doc_set_root(doc, root);
+    yyjson_mut_obj_add_real(doc, root, "uptime", clocksec() - started);
+
+    yyjson_mut_val *counters = yyjson_mut_obj_add_obj(doc, root, "counters");
+    yyjson_mut_val *gauges = yyjson_mut_obj_add_obj(doc, root, "gauges");
+    yyjson_mut_val *histograms = yyjson_mut_obj_add_obj(doc, root, "histograms");
+
+    for (size_t i = 0; i < MAXMETRICS; ++i)
+    {
+        Metric *m = &metrics[i];
+        if (atomic_load_explicit(&m->ready, memory_order_acquire) == 0)
+            continue;
+
+        uint64_t const v = atomic_load_explicit(&m->value, memory_order_relaxed);
+        if (m->kind == Mcounter)
+            yyjson_mut_obj_add_uint(doc, counters, m->name, v);
+        else if (m->kind == Mgauge)
+            yyjson_mut_obj_add_uint(doc, gauges, m->name, v);
+        else
+            histjson(doc, histograms, m);
+    }
+
+    char *json = yyjson_mut_write(doc, 0, len);
+    yyjson_mut_doc_free(doc);
+    return json;
+}
+
+/* Written aside and renamed, so readers never see a partial file */
+int metricsdump(char const *path)
+{
+    size_t len = 0;
+    char *json = metricsjson(&len);
+    if (json == NULL)
+        return -1;
+
+    char tmp[PATH_MAX];
+    int n = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (n < 0 || (size_t)n >= sizeof(tmp))
+    {
+        free(json);
+        return -1;
+    }
+
+    int ret = -1;
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+        goto freejson;
+
+    int const ok = fwrite(json, 1, len, f) == len && fputc('\n', f) != EOF;
+    if (fclose(f) != 0 || !ok || rename(tmp, path) != 0)
+    {
+        (void)unlink(tmp);
+        goto freejson;
+    }
+
+    ret = 0;
+
+freejson:
+    free(json);
+    return ret;
+}
@@ -0,0 +1,866 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "malachi.h"
+
+enum
+{
+    OIDLEN = 20,
+    IDXHEADER = 8,
+    IDXFANOUT = 256 * 4,
+    PACKHEADER = 12,
+    NCACHED = 64,
+    MAXCACHED = 16 << 20,
+    MAXCACHEDOBJECT = 1 << 20,
+    MAXDELTADEPTH = 4096,
+    LOOSEHEADER = 64,
+};
+
+/* Object types as packs encode them */
+enum
+{
+    Tcommit = 1,
+    Ttree = 2,
+    Tblob = 3,
+    Ttag = 4,
+    Tofsdelta = 6,
+    Trefdelta = 7,
+};
+
+struct Pack
+{
+    unsigned char const *idx;
+    size_t idxlen;
+    unsigned char const *data;
+    size_t datalen;
+    uint32_t nobjects;
+    unsigned char const *oids;
+    unsigned char const *offsets;
+    unsigned char const *bigoffsets;
+    size_t nbig;
+};
+
+/* Delta bases already rebuilt, since neighbouring blobs tend to share them */
+struct Cached
+{
+    struct Pack const *pack;
+    uint64_t off;
+    int type;
+    size_t size;
+    unsigned char *data;
+};
+
+struct Link
+{
+    struct Pack const *pack;
+    uint64_t off;
+};
+
+/*
+ * Reads objects straight from a repository's packs and loose files.  Only
+ * the indexing writer uses one, so nothing here is locked.  Any object it
+ * cannot read, in an alternate or a newer pack for instance, is left to
+ * git cat-file.
+ */
+struct Odb
+{
+    char *objdir;
+    struct Pack *packs;
+    size_t npacks;
+    size_t cachedbytes;
+    struct Link chain[MAXDELTADEPTH];
+    struct Cached cache[NCACHED];
+};
+
+static uint32_t be32(unsigned char const *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t be64(unsigned char const *p)
+{
+    return ((uint64_t)be32(p) << 32) | be32(p + 4);
+}
+
+static int hexoid(char const *hex, unsigned char *oid)
+{
+    for (int i = 0; i < OIDLEN; ++i)
+    {
+        unsigned v = 0;
+        for (int j = 0; j < 2; ++j)
+        {
+            char const c = hex[(2 * i) + j];
+            v <<= 4;
+            if (c >= '0' && c <= '9')
+                v |= (unsigned)(c - '0');
+            else if (c >= 'a' && c <= 'f')
+                v |= (unsigned)(c - 'a' + 10);
+            else
+                return -1;
+        }
+        oid[i] = (unsigned char)v;
+    }
+    return hex[2 * OIDLEN] == '\0' ? 0 : -1;
+}
+
+static void const *mapfile(char const *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    void *map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+        else
+            *len = (size_t)st.st_size;
+    }
+
+    close(fd);
+    return map;
+}
+
+/* Version 2 indexes only, which git has written by default since 1.5.2 */
+static int packopen(struct Pack *pack, char const *idxpath)
+{
+    *pack = (struct Pack){ 0 };
+
+    pack->idx = mapfile(idxpath, &pack->idxlen);
+    if (pack->idx == NULL)
+        return -1;
+
+    if (pack->idxlen < IDXHEADER + IDXFANOUT + (2 * OIDLEN) || memcmp(pack->idx, "\377tOc", 4) != 0 || be32(pack->idx + 4) != 2)
+        goto unmapidx;
+
+    pack->nobjects = be32(pack->idx + IDXHEADER + IDXFANOUT - 4);
+    size_t const n = pack->nobjects;
+    size_t const fixed = IDXHEADER + IDXFANOUT + (n * (OIDLEN + 4 + 4));
+    if (n > (pack->idxlen / OIDLEN) || fixed + (2 * OIDLEN) > pack->idxlen)
+        goto unmapidx;
+
+    pack->oids = pack->idx + IDXHEADER + IDXFANOUT;
+    pack->offsets = pack->oids + (n * (OIDLEN + 4));
+    pack->bigoffsets = pack->idx + fixed;
+    pack->nbig = (pack->idxlen - fixed - (2 * OIDLEN)) / 8;
+
+    size_t const len = strlen(idxpath);
+    char *packpath = malloc(len + 2);
+    if (packpath == NULL)
+        goto unmapidx;
+    memcpy(packpath, idxpath, len - 4);
+    memcpy(packpath + len - 4, ".pack", 6);
+    pack->data = mapfile(packpath, &pack->datalen);
+    free(packpath);
+
+    if (pack->data == NULL)
+        goto unmapidx;
+
+    if (pack->datalen < PACKHEADER + OIDLEN || memcmp(pack->data, "PACK", 4) != 0 || (be32(pack->data + 4) != 2 && be32(pack->data + 4) != 3))
+        goto unmappack;
+
+    return 0;
+
+unmappack:
+    munmap((void *)pack->data, pack->datalen);
+unmapidx:
+    munmap((void *)pack->idx, pack->idxlen);
+    pack->idx = NULL;
+    return -1;
+}
+
+static void packclose(struct Pack *pack)
+{
+    munmap((void *)pack->data, pack->datalen);
+    munmap((void *)pack->idx, pack->idxlen);
+}
+
+/* The fanout narrows the search to the objects sharing the first byte */
+static int packfind(struct Pack const *pack, unsigned char const *oid, uint64_t *off)
+{
+    unsigned char const *fanout = pack->idx + IDXHEADER;
+    size_t lo = oid[0] == 0 ? 0 : be32(fanout + (4 * (oid[0] - 1)));
+    size_t hi = be32(fanout + (4 * oid[0]));
+    if (hi > pack->nobjects || lo > hi)
+        return -1;
+
+    while (lo < hi)
+    {
+        size_t const mid = lo + ((hi - lo) / 2);
+        int const cmp = memcmp(pack->oids + (mid * OIDLEN), oid, OIDLEN);
+        if (cmp == 0)
+        {
+            uint32_t const o = be32(pack->offsets + (mid * 4));
+            if ((o & 0x80000000) == 0)
+                *off = o;
+            else if ((o & 0x7fffffff) < pack->nbig)
+                *off = be64(pack->bigoffsets + ((size_t)(o & 0x7fffffff) * 8));
+            else
+                return -1;
+            return *off < pack->datalen - OIDLEN ? 0 : -1;
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return -1;
+}
+
+static int odbfind(Odb *odb, unsigned char const *oid, struct Link *link)
+{
+    for (size_t i = 0; i < odb->npacks; ++i)
+    {
+        if (packfind(&odb->packs[i], oid, &link->off) == 0)
+        {
+            link->pack = &odb->packs[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* <type:3 size:4> then size continued 7 bits at a time, least significant first */
+static int entryheader(struct Pack const *pack, uint64_t off, int *type, size_t *size, uint64_t *dataoff)
+{
+    uint64_t const end = pack->datalen - OIDLEN;
+    if (off >= end)
+        return -1;
+
+    unsigned c = pack->data[off++];
+    *type = (int)((c >> 4) & 7);
+    uint64_t n = c & 15;
+
+    for (int shift = 4; c & 0x80; shift += 7)
+    {
+        if (off >= end || shift > 57)
+            return -1;
+        c = pack->data[off++];
+        n |= (uint64_t)(c & 0x7f) << shift;
+    }
+
+    if (n > SIZE_MAX - 1)
+        return -1;
+    *size = (size_t)n;
+    *dataoff = off;
+    return 0;
+}
+
+/* Inflates exactly size bytes, anything more or less means a corrupt entry */
+static unsigned char *inflateat(unsigned char const *in, size_t inlen, size_t size)
+{
+    /* zlib counts in unsigned ints, git cat-file handles anything larger */
+    if (size >= UINT_MAX)
+        return NULL;
+
+    unsigned char *out = malloc(size + 1);
+    if (out == NULL)
+        return NULL;
+
+    z_stream zs = { 0 };
+    if (inflateInit(&zs) != Z_OK)
+    {
+        free(out);
+        return NULL;
+    }
+
+    zs.next_in = (unsigned char *)in;
+    zs.avail_in = inlen < UINT_MAX ? (uInt)inlen : UINT_MAX;
+    zs.next_out = out;
+    zs.avail_out = (uInt)(size + 1);
+
+    int const ok = inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == size;
+    inflateEnd(&zs);
+    if (!ok)
+    {
+        free(out);
+        return NULL;
+    }
+
+    out[size] = '\0';
+    return out;
+}
+
+static int deltavarint(unsigned char const **p, unsigned char const *end, size_t *value)
+{
+    size_t v = 0;
+    unsigned c;
+    int shift = 0;
+
+    do
+    {
+        if (*p >= end || shift > 57)
+            return -1;
+        c = *(*p)++;
+        v |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    *value = v;
+    return 0;
+}
+
+/* Copy and insert instructions rebuild the target from its base */
+static unsigned char *deltaapply(unsigned char const *base, size_t baselen, unsigned char const *delta, size_t deltalen, size_t *outlen)
+{
+    unsigned char const *p = delta;
+    unsigned char const *end = delta + deltalen;
+    size_t srclen = 0;
+    size_t dstlen = 0;
+
+    if (deltavarint(&p, end, &srclen) != 0 || deltavarint(&p, end, &dstlen) != 0 || srclen != baselen || dstlen >= UINT_MAX)
+        return NULL;
+
+    unsigned char *out = malloc(dstlen + 1);
+    if (out == NULL)
+        return NULL;
+
+    size_t o = 0;
+    while (p < end)
+    {
+        unsigned const op = *p++;
+        if (op & 0x80)
+        {
+            size_t off = 0;
+            size_t len = 0;
+            for (int i = 0; i < 4; ++i)
+                if (op & (1u << i))
+                {
+                    if (p >= end)
+                        goto corrupt;
+                    off |= (size_t)*p++ << (8 * i);
+                }
+            for (int i = 0; i < 3; ++i)
+                if (op & (0x10u << i))
+                {
+                    if (p >= end)
+                        goto corrupt;
+                    len |= (size_t)*p++ << (8 * i);
+                }
+            if (len == 0)
+                len = 0x10000;
+            if (off > baselen || len > baselen - off || len > dstlen - o)
+                goto corrupt;
+            memcpy(out + o, base + off, len);
+            o += len;
+        }
+        else if (op > 0)
+        {
+            if (op > (size_t)(end - p) || op > dstlen - o)
+                goto corrupt;
+            memcpy(out + o, p, op);
+            p += op;
+            o += op;
+        }
+        else
+        {
+            goto corrupt;
+        }
+    }
+
+    if (o != dstlen)
+        goto corrupt;
+
+    out[o] = '\0';
+    *outlen = o;
+    return out;
+
+corrupt:
+    free(out);
+    return NULL;
+}
+
+static struct Cached *cacheslot(Odb *odb, struct Pack const *pack, uint64_t off)
+{
+    uintptr_t const key = (uintptr_t)pack ^ (uintptr_t)(off * 0x9E3779B97F4A7C15ULL);
+    return &odb->cache[(key >> 7) % NCACHED];
+}
+
+static void cacheevict(Odb *odb, struct Cached *c)
+{
+    if (c->data == NULL)
+        return;
+    odb->cachedbytes -= c->size;
+    free(c->data);
+    c->data = NULL;
+}
+
+/* Keeps a copy, evicting whatever held the slot and, when over budget, everything */
+static void cachekeep(Odb *odb, struct Pack const *pack, uint64_t off, int type, unsigned char const *data, size_t size)
+{
+    if (size > MAXCACHEDOBJECT)
+        return;
+
+    struct Cached *c = cacheslot(odb, pack, off);
+    cacheevict(odb, c);
+
+    if (odb->cachedbytes + size > MAXCACHED)
+        for (int i = 0; i < NCACHED; ++i)
+            cacheevict(odb, &odb->cache[i]);
+
+    c->data = malloc(size + 1);
+    if (c->data == NULL)
+        return;
+    memcpy(c->data, data, size + 1);
+    c->pack = pack;
+    c->off = off;
+    c->type = type;
+    c->size = size;
+    odb->cachedbytes += size;
+}
+
+static unsigned char *cachecopy(Odb *odb, struct Pack const *pack, uint64_t off, int *type, size_t *size)
+{
+    struct Cached const *c = cacheslot(odb, pack, off);
+    if (c->data == NULL || c->pack != pack || c->off != off)
+        return NULL;
+
+    unsigned char *data = malloc(c->size + 1);
+    if (data == NULL)
+        return NULL;
+    memcpy(data, c->data, c->size + 1);
+    *type = c->type;
+    *size = c->size;
+    return data;
+}
+
+/*
+ * Walks down the delta chain to a base, either a whole object or one found
+ * in the cache, then applies the deltas back up.  Every intermediate result
+ * is a base for the one above it, and likely for other objects too.
+ */
+static unsigned char *packread(Odb *odb, struct Link at, int *type, size_t *size)
+{
+    size_t depth = 0;
+    unsigned char *data = NULL;
+
+    for (;;)
+    {
+        data = cachecopy(odb, at.pack, at.off, type, size);
+        if (data)
+            break;
+
+        int t;
+        size_t n;
+        uint64_t dataoff;
+        if (entryheader(at.pack, at.off, &t, &n, &dataoff) != 0)
+            return NULL;
+
+        if (t != Tofsdelta && t != Trefdelta)
+        {
+            if (t < Tcommit || t > Ttag)
+                return NULL;
+            data = inflateat(at.pack->data + dataoff, at.pack->datalen - dataoff, n);
+            if (data == NULL)
+                return NULL;
+            *type = t;
+            *size = n;
+            if (depth > 0)
+                cachekeep(odb, at.pack, at.off, t, data, n);
+            break;
+        }
+
+        if (depth == MAXDELTADEPTH)
+            return NULL;
+        odb->chain[depth++] = at;
+
+        uint64_t const end = at.pack->datalen - OIDLEN;
+        if (t == Trefdelta)
+        {
+            if (dataoff + OIDLEN > end || odbfind(odb, at.pack->data + dataoff, &at) != 0)
+                return NULL;
+            continue;
+        }
+
+        /* Offset back to the base, big-endian 7 bits at a time, each continuation adding one */
+        if (dataoff >= end)
+            return NULL;
+        unsigned c = at.pack->data[dataoff++];
+        uint64_t back = c & 0x7f;
+        while (c & 0x80)
+        {
+            if (dataoff >= end || back > (UINT64_MAX >> 8))
+                return NULL;
+            c = at.pack->data[dataoff++];
+            back = ((back + 1) << 7) | (c & 0x7f);
+        }
+        if (back == 0 || back > at.off)
+            return NULL;
+        at.off -= back;
+    }
+
+    while (depth > 0)
+    {
+        struct Link const link = odb->chain[--depth];
+
+        int t;
+        size_t n;
+        uint64_t dataoff;
+        if (entryheader(link.pack, link.off, &t, &n, &dataoff) != 0)
+            goto fail;
+        dataoff += t == Trefdelta ? OIDLEN : 0;
+        if (t == Tofsdelta)
+            while (dataoff < link.pack->datalen && (link.pack->data[dataoff++] & 0x80))
+                ;
+
+        unsigned char *delta = inflateat(link.pack->data + dataoff, link.pack->datalen - dataoff, n);
+        if (delta == NULL)
+            goto fail;
+
+        size_t outlen = 0;
+        unsigned char *out = deltaapply(data, *size, delta, n, &outlen);
+        free(delta);
+        free(data);
+        data = out;
+        if (data == NULL)
+            return NULL;
+
+        *size = outlen;
+        if (depth > 0)
+            cachekeep(odb, link.pack, link.off, *type, data, outlen);
+    }
+
+    return data;
+
+fail:
+    free(data);
+    return NULL;
+}
+
+/* Inflates the start of a stream into out, enough for a header */
+static size_t inflatehead(unsigned char const *in, size_t inlen, unsigned char *out, size_t outlen)
+{
+    z_stream zs = { 0 };
+    if (inflateInit(&zs) != Z_OK)
+        return 0;
+
+    zs.next_in = (unsigned char *)in;
+    zs.avail_in = inlen < UINT_MAX ? (uInt)inlen : UINT_MAX;
+    zs.next_out = out;
+    zs.avail_out = (uInt)outlen;
+
+    int const rc = inflate(&zs, Z_SYNC_FLUSH);
+    size_t const got = rc == Z_OK || rc == Z_STREAM_END ? outlen - zs.avail_out : 0;
+    inflateEnd(&zs);
+    return got;
+}
+
+/* "<type> <size>\0", returning the length including the NUL */
+static size_t looseheader(unsigned char const *header, size_t len, int *type, size_t *size)
+{
+    unsigned char const *nul = memchr(header, '\0', len);
+    if (nul == NULL)
+        return 0;
+
+    char const *sp = memchr(header, ' ', (size_t)(nul - header));
+    if (sp == NULL)
+        return 0;
+
+    size_t const typelen = (size_t)(sp - (char const *)header);
+    *type = typelen == 4 && memcmp(header, "blob", 4) == 0 ? Tblob
+        : typelen == 4 && memcmp(header, "tree", 4) == 0   ? Ttree
+        : typelen == 6 && memcmp(header, "commit", 6) == 0 ? Tcommit
+        : typelen == 3 && memcmp(header, "tag", 3) == 0    ? Ttag
+                                                           : 0;
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long long const n = strtoull(sp + 1, &end, 10);
+    if (*type == 0 || end != (char const *)nul || errno != 0 || n >= SIZE_MAX || n >= UINT_MAX)
+        return 0;
+
+    *size = (size_t)n;
+    return (size_t)(nul + 1 - header);
+}
+
+/* Loose objects inflate to a header followed by the content */
+static unsigned char *looseread(Odb *odb, char const *hex, int *type, size_t *size)
+{
+    char path[PATH_MAX];
+    int const n = snprintf(path, sizeof(path), "%s/%.2s/%s", odb->objdir, hex, hex + 2);
+    if (n < 0 || (size_t)n >= sizeof(path))
+        return NULL;
+
+    size_t len = 0;
+    unsigned char const *map = mapfile(path, &len);
+    if (map == NULL)
+        return NULL;
+
+    unsigned char *out = NULL;
+    unsigned char header[LOOSEHEADER];
+    z_stream zs = { 0 };
+    if (inflateInit(&zs) != Z_OK)
+        goto unmap;
+
+    zs.next_in = (unsigned char *)map;
+    zs.avail_in = len < UINT_MAX ? (uInt)len : UINT_MAX;
+    zs.next_out = header;
+    zs.avail_out = sizeof(header);
+
+    int rc = inflate(&zs, Z_SYNC_FLUSH);
+    if (rc != Z_OK && rc != Z_STREAM_END)
+        goto end;
+
+    size_t total = 0;
+    size_t const got = sizeof(header) - zs.avail_out;
+    size_t const hdrlen = looseheader(header, got, type, &total);
+    if (hdrlen == 0 || len > UINT_MAX)
+        goto end;
+
+    out = malloc(total + 1);
+    if (out == NULL)
+        goto end;
+
+    size_t const have = got - hdrlen;
+    if (have > total)
+        goto corrupt;
+    memcpy(out, header + hdrlen, have);
+
+    zs.next_out = out + have;
+    zs.avail_out = (uInt)(total - have + 1);
+    if (rc != Z_STREAM_END)
+        rc = inflate(&zs, Z_FINISH);
+    if (rc != Z_STREAM_END || (size_t)(zs.next_out - out) != total)
+        goto corrupt;
+
+    out[total] = '\0';
+    *size = total;
+    goto end;
+
+corrupt:
+    free(out);
+    out = NULL;
+end:
+    inflateEnd(&zs);
+unmap:
+    munmap((void *)map, len);
+    return out;
+}
+
+static int addpacks(Odb *odb)
+{
+    char *packdir = joinpath2(odb->objdir, "pack");
+    if (packdir == NULL)
+        return -1;
+
+    DIR *dir = opendir(packdir);
+    if (dir == NULL)
+    {
+        free(packdir);
+        return 0;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        size_t const len = strlen(ent->d_name);
+        if (len < 5 || strcmp(ent->d_name + len - 4, ".idx") != 0)
+            continue;
+
+        char *idxpath = joinpath2(packdir, ent->d_name);
+        if (idxpath == NULL)
+            continue;
+
+        struct Pack *grown = realloc(odb->packs, (odb->npacks + 1) * sizeof(*grown));
+        if (grown)
+        {
+            odb->packs = grown;
+            if (packopen(&odb->packs[odb->npacks], idxpath) == 0)
+                odb->npacks++;
+            else
+                logdebug("Skipping unsupported pack %s", idxpath);
+        }
+        free(idxpath);
+    }
+
+    closedir(dir);
+    free(packdir);
+    return 0;
+}
+
+/* Git resolves the object directory, so worktrees and GIT_OBJECT_DIRECTORY work as usual */
+static char *objectdir(char const *repopath)
+{
+    char const *const args[] = { "rev-parse", "--show-object-format", "--git-path", "objects", NULL };
+
+    Git *g = gitopen(repopath, args);
+    if (g == NULL)
+        return NULL;
+
+    char *dir = NULL;
+    char *rec = NULL;
+    if (gitread(g, '\n', &rec) > 0 && strcmp(rec, "sha1") == 0 && gitread(g, '\n', &rec) > 0)
+        dir = rec[0] == '/' ? joinpath2(rec, "") : joinpath2(repopath, rec);
+
+    if (gitclose(g) != 0)
+    {
+        free(dir);
+        return NULL;
+    }
+
+    /* joinpath2 leaves a trailing slash on an absolute path joined with nothing */
+    size_t const len = dir ? strlen(dir) : 0;
+    if (len > 1 && dir[len - 1] == '/')
+        dir[len - 1] = '\0';
+    return dir;
+}
+
+Odb *odbopen(char const *repopath)
+{
+    Odb *odb = calloc(1, sizeof(*odb));
+    if (odb == NULL)
+        return NULL;
+
+    odb->objdir = objectdir(repopath);
+    if (odb->objdir == NULL)
+    {
+        free(odb);
+        return NULL;
+    }
+
+    if (addpacks(odb) != 0)
+    {
+        odbclose(odb);
+        return NULL;
+    }
+
+    return odb;
+}
+
+void odbclose(Odb *odb)
+{
+    if (odb == NULL)
+        return;
+
+    for (int i = 0; i < NCACHED; ++i)
+        free(odb->cache[i].data);
+    for (size_t i = 0; i < odb->npacks; ++i)
+        packclose(&odb->packs[i]);
+    free(odb->packs);
+    free(odb->objdir);
+    free(odb);
+}
+
+/* NULL when the object is missing, unreadable or not a blob, so the caller can ask git */
+char *odbblob(Odb *odb, char const *oid, size_t *size)
+{
+    unsigned char raw[OIDLEN];
+    if (hexoid(oid, raw) != 0)
+        return NULL;
+
+    int type = 0;
+    unsigned char *data = NULL;
+
+    struct Link at;
+    if (odbfind(odb, raw, &at) == 0)
+        data = packread(odb, at, &type, size);
+    if (data == NULL)
+        data = looseread(odb, oid, &type, size);
+
+    if (data && type != Tblob)
+    {
+        free(data);
+        data = NULL;
+    }
+    return (char *)data;
+}
+
+/*
+ * Sizes come from headers alone: a deltified entry's base is followed only
+ * as far as its type, and the size is the one the delta itself records.
+ */
+int odbblobsize(Odb *odb, char const *oid, size_t *size)
+{
+    unsigned char raw[OIDLEN];
+    if (hexoid(oid, raw) != 0)
+        return -1;
+
+    int type = 0;
+    unsigned char head[LOOSEHEADER];
+
+    struct Link at;
+    if (odbfind(odb, raw, &at) == 0)
+    {
+        uint64_t dataoff;
+        if (entryheader(at.pack, at.off, &type, size, &dataoff) != 0)
+            return -1;
+
+        if (type == Tofsdelta || type == Trefdelta)
+        {
+            struct Link top = at;
+            for (size_t depth = 0; type == Tofsdelta || type == Trefdelta; ++depth)
+            {
+                size_t n;
+                uint64_t const end = at.pack->datalen - OIDLEN;
+                if (depth == MAXDELTADEPTH || dataoff >= end)
+                    return -1;
+
+                if (type == Trefdelta)
+                {
+                    if (dataoff + OIDLEN > end || odbfind(odb, at.pack->data + dataoff, &at) != 0)
+                        return -1;
+                    if (depth == 0)
+                        top.off = dataoff + OIDLEN;
+                }
+                else
+                {
+                    unsigned c = at.pack->data[dataoff++];
+                    uint64_t back = c & 0x7f;
+                    while (c & 0x80)
+                    {
+                        if (dataoff >= end || back > (UINT64_MAX >> 8))
+                            return -1;
+                        c = at.pack->data[dataoff++];
+                        back = ((back + 1) << 7) | (c & 0x7f);
+                    }
+                    if (back == 0 || back > at.off)
+                        return -1;
+                    if (depth == 0)
+                        top.off = dataoff;
+                    at.off -= back;
+                }
+
+                if (entryheader(at.pack, at.off, &type, &n, &dataoff) != 0)
+                    return -1;
+            }
+
+            /* Base size, then result size, at the start of the top delta */
+            size_t const got = inflatehead(top.pack->data + top.off, top.pack->datalen - top.off, head, 2 * 10);
+            unsigned char const *p = head;
+            size_t basesize;
+            if (deltavarint(&p, head + got, &basesize) != 0 || deltavarint(&p, head + got, size) != 0)
+                return -1;
+        }
+    }
+    else
+    {
+        char path[PATH_MAX];
+        int const n = snprintf(path, sizeof(path), "%s/%.2s/%s", odb->objdir, oid, oid + 2);
+        if (n < 0 || (size_t)n >= sizeof(path))
+            return -1;
+
+        size_t len = 0;
+        unsigned char const *map = mapfile(path, &len);
+        if (map == NULL)
+            return -1;
+        size_t const got = inflatehead(map, len, head, sizeof(head));
+        munmap((void *)map, len);
+        if (looseheader(head, got, &type, size) == 0)
+            return -1;
+    }
+
+    return type == Tblob ? 0 : -1;
+}
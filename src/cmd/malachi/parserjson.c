@@ -1,6 +1,6 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -9,203 +9,472 @@
 
 #include "malachi.h"
 
-#if __has_attribute(__counted_by__)
-#    define COUNTED_BY(member) __attribute__((__counted_by__(member)))
-#else
-#    define COUNTED_BY(member)
-#endif
-
 #if __has_attribute(unused)
 #    define UNUSED __attribute__((unused))
 #else
 #    define UNUSED
 #endif
 
+enum
+{
+    NSLOTS = 32,
+};
+
 enum Parsestate
 {
     Statelen,
     Statejson,
+    Stateskip,
 };
 
+/*
+ * Frames are consumed in place: [head, tail) holds unparsed bytes, and
+ * parsing a frame only advances head.  The unparsed tail is moved to the
+ * front only when a read would otherwise find no room behind it, or when a
+ * frame at the end of the buffer leaves no room for the padding below.
+ *
+ * The buffer is basesize bytes, enough for any single command.  A longer
+ * frame, a batch of up to MAXFRAMESIZE bytes, grows the buffer and the pool
+ * to fit, and they shrink back once nothing is left buffered.
+ */
 struct Parser
 {
+    size_t basesize;
     size_t bufsize;
-    size_t bufused;
+    size_t head;
+    size_t tail;
     enum Parsestate state;
     uint32_t jsonlen;
-    char buf[] COUNTED_BY(bufsize);
+    size_t skip;
+    yyjson_alc alc;
+    yyjson_doc *doc;
+    void *pool;
+    Metric *parsetime;
+    Command *batch;
+    size_t batchcap;
+    char *buf;
 };
 
+/*
+ * Op names and field keys are looked up through per-table slots indexed by
+ * this hash, so a key costs one hash and one compare.  ISO C cannot hash a
+ * string literal in a constant expression, so the slots are filled from
+ * jsonops once per process.  A collision leaves the later key unfindable,
+ * and the parser test fails on it, so no build with one passes its tests.
+ */
+static unsigned char opslots[NSLOTS];
+static unsigned char fieldslots[NELEM(jsonops)][NSLOTS];
+static pthread_once_t slotsonce = PTHREAD_ONCE_INIT;
+static int slotsrc;
+
+static size_t keyhash(char const *key, size_t len)
+{
+    if (len == 0)
+        return 0;
+    return (len + (unsigned char)key[0] + (4 * (size_t)(unsigned char)key[len - 1])) & (NSLOTS - 1);
+}
+
+static int slotput(unsigned char *slots, char const *key, size_t len, size_t index)
+{
+    size_t const h = keyhash(key, len);
+    if (slots[h] != 0)
+    {
+        logerror("Hash collision on key %s", key);
+        return -1;
+    }
+    slots[h] = (unsigned char)(index + 1);
+    return 0;
+}
+
+static void slotsinit(void)
+{
+    STATIC_ASSERT(NELEM(jsonops) < UCHAR_MAX);
+
+    for (size_t i = 0; i < NELEM(jsonops); ++i)
+    {
+        if (slotput(opslots, jsonops[i].name, jsonops[i].namelen, i) != 0)
+            slotsrc = -1;
+
+        assert(jsonops[i].nfields < UCHAR_MAX);
+        for (size_t j = 0; j < jsonops[i].nfields; ++j)
+        {
+            struct Fieldspec const *f = &jsonops[i].fields[j];
+            if (slotput(fieldslots[i], f->jsonkey, f->keylen, j) != 0)
+                slotsrc = -1;
+        }
+    }
+}
+
+/* Fills the slots on first use, nonzero if any two keys of a table collide */
+int parserslots(void)
+{
+    (void)pthread_once(&slotsonce, slotsinit);
+    return slotsrc;
+}
+
+/* The pool is sized for the largest frame the buffer can hold, so decoding never falls back to malloc */
+static int parserresize(Parser *p, size_t bufsize)
+{
+    /* The last document lives in the pool being replaced */
+    yyjson_doc_free(p->doc);
+    p->doc = NULL;
+
+    size_t const poolsize = yyjson_read_max_memory_usage(bufsize, YYJSON_READ_INSITU);
+    void *pool = malloc(poolsize);
+    if (pool == NULL)
+        return -1;
+
+    char *buf = realloc(p->buf, bufsize);
+    if (buf == NULL || yyjson_alc_pool_init(&p->alc, pool, poolsize) == 0)
+    {
+        if (buf)
+            p->buf = buf;
+        free(pool);
+        return -1;
+    }
+
+    free(p->pool);
+    p->pool = pool;
+    p->buf = buf;
+    p->bufsize = bufsize;
+    return 0;
+}
+
 Parser *parsercreate(size_t bufsize)
 {
-    Parser *p = malloc(sizeof(*p) + (bufsize * sizeof(p->buf[0])));
+    Parser *p = malloc(sizeof(*p));
     if (p == NULL)
         return NULL;
 
-    p->bufsize = bufsize;
-    p->bufused = 0;
+    p->basesize = bufsize;
+    p->bufsize = 0;
+    p->buf = NULL;
+    p->pool = NULL;
+    p->head = 0;
+    p->tail = 0;
     p->state = Statelen;
     p->jsonlen = 0;
+    p->skip = 0;
+    p->doc = NULL;
+    p->batch = NULL;
+    p->batchcap = 0;
+    p->parsetime = metricget("parse", Mhistogram);
+
+    (void)parserslots();
+    if (parserresize(p, bufsize) != 0)
+    {
+        free(p->buf);
+        free(p);
+        return NULL;
+    }
+
     return p;
 }
 
 void parserdestroy(Parser *p)
 {
+    if (p == NULL)
+        return;
+
+    yyjson_doc_free(p->doc);
+    free(p->batch);
+    free(p->pool);
+    free(p->buf);
     free(p);
 }
 
 void parserreset(Parser *p)
 {
-    p->bufused = 0;
+    yyjson_doc_free(p->doc);
+    p->doc = NULL;
+    p->head = 0;
+    p->tail = 0;
     p->state = Statelen;
     p->jsonlen = 0;
+    p->skip = 0;
 }
 
 ssize_t parserinput(Parser *p, int fd)
 {
-    assert(p->bufused < p->bufsize);
+    assert(p->head <= p->tail && p->tail < p->bufsize);
+
+    /* A failure to shrink just keeps the larger buffer */
+    if (p->bufsize > p->basesize && p->head == p->tail)
+    {
+        p->head = 0;
+        p->tail = 0;
+        (void)parserresize(p, p->basesize);
+    }
 
-    size_t space = p->bufsize - p->bufused - 1;
+    if (p->tail == p->bufsize - 1 && p->head > 0)
+    {
+        memmove(p->buf, p->buf + p->head, p->tail - p->head);
+        p->tail -= p->head;
+        p->head = 0;
+    }
+
+    size_t space = p->bufsize - p->tail - 1;
     if (space == 0)
         return -Enospace;
 
-    ssize_t nread = read(fd, p->buf + p->bufused, space);
+    ssize_t nread = read(fd, p->buf + p->tail, space);
     if (nread <= 0)
         return nread; /* EOF (0) or error (-1) from read() */
 
-    p->bufused += nread;
-    assert(p->bufused < p->bufsize);
-    p->buf[p->bufused] = '\0';
+    p->tail += nread;
+    assert(p->tail < p->bufsize);
+    p->buf[p->tail] = '\0';
     return nread;
 }
 
-static int findjsonop(size_t oplen, char const *opstr)
+char const *opname(Opcode op)
 {
-    STATIC_ASSERT(NELEM(jsonops) <= INT_MAX);
-    int const njsonops = (int)NELEM(jsonops);
-    for (int i = 0; i < njsonops; ++i)
-        if (oplen == jsonops[i].namelen && strncmp(opstr, jsonops[i].name, oplen) == 0)
-            return i;
-    return -1;
+    for (size_t i = 0; i < NELEM(jsonops); ++i)
+        if (jsonops[i].op == op)
+            return jsonops[i].name;
+    return NULL;
 }
 
-static int parsejson(char const *jsonstr, size_t jsonlen, Command *cmd)
+static int findjsonop(char const *opstr, size_t oplen)
 {
-    int ret = -1;
-    memset(cmd, 0, sizeof(*cmd));
+    int const slot = opslots[keyhash(opstr, oplen)];
+    if (slot == 0)
+        return -1;
 
-    yyjson_doc *doc = yyjson_read(jsonstr, jsonlen, 0);
-    if (doc == NULL)
-    {
-        logerror("Failed to parse JSON");
+    int const i = slot - 1;
+    if (oplen != jsonops[i].namelen || memcmp(opstr, jsonops[i].name, oplen) != 0)
         return -1;
-    }
+    return i;
+}
+
+static struct Fieldspec const *findfield(int opindex, char const *key, size_t keylen)
+{
+    int const slot = fieldslots[opindex][keyhash(key, keylen)];
+    if (slot == 0)
+        return NULL;
+
+    struct Fieldspec const *f = &jsonops[opindex].fields[slot - 1];
+    if (keylen != f->keylen || memcmp(key, f->jsonkey, keylen) != 0)
+        return NULL;
+    return f;
+}
+
+static int decodecommand(yyjson_val *root, Command *cmd)
+{
+    memset(cmd, 0, sizeof(*cmd));
 
-    yyjson_val *root = yyjson_doc_get_root(doc);
     if (yyjson_is_obj(root) == 0)
     {
-        logerror("JSON root is not an object");
-        goto freedoc;
+        logerror("Command is not an object");
+        return -1;
     }
 
-    yyjson_val *opval = yyjson_obj_get(root, "op");
+    yyjson_val *opval = yyjson_obj_getn(root, "op", 2);
     if (opval == NULL || yyjson_is_str(opval) == 0)
     {
         logerror("Missing or invalid 'op' field");
-        goto freedoc;
+        return -1;
     }
 
     char const *opstr = yyjson_get_str(opval);
-    size_t oplen = yyjson_get_len(opval);
-
-    int const opindex = findjsonop(oplen, opstr);
+    int const opindex = findjsonop(opstr, yyjson_get_len(opval));
     if (opindex < 0)
     {
         logerror("Unknown operation: %s", opstr);
-        goto freedoc;
+        return -1;
     }
 
     cmd->op = jsonops[opindex].op;
 
     struct Fieldspec const *const fieldspecs = jsonops[opindex].fields;
-    if (fieldspecs == NULL)
+    size_t const nfields = jsonops[opindex].nfields;
+    unsigned int seen = 0;
+    STATIC_ASSERT(MAXFIELDS <= sizeof(seen) * CHAR_BIT);
+    assert(nfields <= MAXFIELDS);
+
+    /* Absent optional fields read as empty strings */
+    for (size_t i = 0; i < nfields; ++i)
     {
-        ret = 0;
-        goto freedoc;
+        assert(fieldspecs[i].offset + sizeof(Str) <= sizeof(*cmd));
+        Str *const dest = (Str *)((char *)cmd + fieldspecs[i].offset);
+        dest->s = "";
     }
 
-    int const nfields = (assert(jsonops[opindex].nfields <= INT_MAX), (int)jsonops[opindex].nfields);
-
-    for (int i = 0; i < nfields; ++i)
+    size_t idx = 0;
+    size_t max = 0;
+    yyjson_val *key = NULL;
+    yyjson_val *val = NULL;
+    yyjson_obj_foreach(root, idx, max, key, val)
     {
-        size_t const offset = fieldspecs[i].offset;
-        size_t const destsize = fieldspecs[i].size;
-        int const required = fieldspecs[i].required;
-        char const *const jsonkey = fieldspecs[i].jsonkey;
+        struct Fieldspec const *f = findfield(opindex, yyjson_get_str(key), yyjson_get_len(key));
+        if (f == NULL || yyjson_is_str(val) == 0)
+            continue;
+
+        size_t const len = yyjson_get_len(val);
+        if (len >= f->size)
+        {
+            logerror("%s too long: %zu", f->name, len);
+            return -1;
+        }
 
-        assert(offset + destsize <= sizeof(*cmd));
-        char *const dest = (char *)cmd + offset;
+        Str *const dest = (Str *)((char *)cmd + f->offset);
+        dest->s = yyjson_get_str(val);
+        dest->len = len;
+        seen |= 1U << (f - fieldspecs);
+    }
 
-        yyjson_val *fieldval = yyjson_obj_get(root, jsonkey);
-        if (fieldval == NULL || yyjson_is_str(fieldval) == 0)
+    for (size_t i = 0; i < nfields; ++i)
+    {
+        if (fieldspecs[i].required && (seen & (1U << i)) == 0)
         {
-            if (required == 0)
-                continue;
-            logerror("Missing or invalid '%s' field for %s operation", jsonkey, opstr);
-            goto freedoc;
+            logerror("Missing or invalid '%s' field for %s operation", fieldspecs[i].jsonkey, opstr);
+            return -1;
         }
+    }
+
+    return 0;
+}
+
+/* Batch entries are decoded into an array the Parser keeps, so it only grows on the largest batch yet */
+static int parsebatch(Parser *p, yyjson_val *root, Command *cmd)
+{
+    yyjson_val *ops = yyjson_obj_getn(root, "ops", 3);
+    if (yyjson_is_arr(ops) == 0)
+    {
+        logerror("Missing or invalid 'ops' field for batch operation");
+        return -1;
+    }
+
+    size_t const n = yyjson_arr_size(ops);
+    if (n > MAXBATCHOPS)
+    {
+        logerror("Batch too large: %zu operations", n);
+        return -1;
+    }
+
+    if (n > p->batchcap)
+    {
+        Command *batch = realloc(p->batch, n * sizeof(batch[0]));
+        if (batch == NULL)
+            return -1;
+        p->batch = batch;
+        p->batchcap = n;
+    }
+
+    size_t idx = 0;
+    size_t max = 0;
+    yyjson_val *val = NULL;
+    yyjson_arr_foreach(ops, idx, max, val)
+    {
+        Command *sub = &p->batch[idx];
+        if (decodecommand(val, sub) != 0)
+            return -1;
 
-        char const *fieldstr = yyjson_get_str(fieldval);
-        int const n = snprintf(dest, destsize, "%s", fieldstr);
-        if (n >= (assert(destsize <= INT_MAX), (int)destsize))
+        if (sub->op != Opadd && sub->op != Opremove)
         {
-            char const *const destname = fieldspecs[i].name;
-            logerror("%s too long: %d", destname, strlen(fieldstr));
-            goto freedoc;
+            logerror("Batch entry %zu is not an add or remove operation", idx);
+            return -1;
         }
     }
 
-    ret = 0;
+    cmd->batchop.cmds = p->batch;
+    cmd->batchop.ncmds = n;
+    return 0;
+}
+
+/*
+ * Parsed in situ, so strings are unescaped and terminated inside the frame
+ * itself and command fields point there.  The document only holds the
+ * values, it stays in the pool until the next frame.  jsonstr must be
+ * followed by YYJSON_PADDING_SIZE zero bytes.
+ */
+static int parsejson(Parser *p, char *jsonstr, size_t jsonlen, Command *cmd)
+{
+    memset(cmd, 0, sizeof(*cmd));
+
+    yyjson_doc_free(p->doc);
+    p->doc = yyjson_read_opts(jsonstr, jsonlen, YYJSON_READ_INSITU, &p->alc, NULL);
+    if (p->doc == NULL)
+    {
+        logerror("Failed to parse JSON");
+        return -1;
+    }
+
+    yyjson_val *root = yyjson_doc_get_root(p->doc);
+    if (decodecommand(root, cmd) != 0)
+        return -1;
+
+    if (cmd->op == Opbatch)
+        return parsebatch(p, root, cmd);
+
+    return 0;
+}
+
+static void parserskip(Parser *p, size_t n)
+{
+    p->head += n;
+    assert(p->head <= p->tail);
+
+    /* Once everything is consumed the next read can start at the front for free */
+    if (p->head == p->tail)
+    {
+        p->head = 0;
+        p->tail = 0;
+    }
+}
 
-freedoc:
-    yyjson_doc_free(doc);
-    return ret;
+static void parserdiscard(Parser *p)
+{
+    size_t const avail = p->tail - p->head;
+    size_t const n = avail < p->skip ? avail : p->skip;
+    parserskip(p, n);
+    p->skip -= n;
+    if (p->skip == 0)
+        p->state = Statelen;
 }
 
 int parsecommand(Parser *p, Command *cmd, UNUSED int *generation)
 {
-    size_t remaining = 0;
-    size_t skipbytes = 0;
-    int rc = 0;
-    assert(p->bufused <= p->bufsize);
+    assert(p->head <= p->tail && p->tail <= p->bufsize);
+
+    /* The rest of a rejected frame is discarded as it arrives, so the next length lines up */
+    if (p->state == Stateskip)
+    {
+        parserdiscard(p);
+        if (p->state == Stateskip)
+            return 0;
+    }
 
-    if (p->bufused == 0)
+    size_t const avail = p->tail - p->head;
+    if (avail == 0)
         return 0;
 
     if (p->state == Statelen)
     {
-        if (p->bufused < sizeof(uint32_t))
+        if (avail < sizeof(uint32_t))
             return 0;
 
         uint32_t len;
-        memcpy(&len, p->buf, sizeof(len));
+        memcpy(&len, p->buf + p->head, sizeof(len));
         p->jsonlen = len;
 
         if (p->jsonlen == 0)
         {
-            logerror("Invalid JSON length: 0, draining buffer");
-            skipbytes = p->bufused;
-            rc = -1;
-            goto compact;
+            logerror("Invalid JSON length: 0, skipping frame");
+            parserskip(p, sizeof(uint32_t));
+            return -1;
         }
 
-        if (p->jsonlen > p->bufsize - sizeof(uint32_t))
+        /* Room for the length, the frame, its padding, and the terminator parserinput writes */
+        size_t const need = sizeof(uint32_t) + (size_t)p->jsonlen + YYJSON_PADDING_SIZE + 1;
+        if (p->jsonlen > MAXFRAMESIZE || (need > p->bufsize && parserresize(p, need) != 0))
         {
-            logerror("JSON length too large: %u bytes, draining buffer", p->jsonlen);
-            skipbytes = p->bufused;
+            logerror("JSON length too large: %u bytes, skipping frame", p->jsonlen);
+            p->skip = sizeof(uint32_t) + (size_t)p->jsonlen;
             p->jsonlen = 0;
-            rc = -1;
-            goto compact;
+            p->state = Stateskip;
+            parserdiscard(p);
+            return -1;
         }
 
         p->state = Statejson;
@@ -214,29 +483,34 @@ int parsecommand(Parser *p, Command *cmd, UNUSED int *generation)
     if (p->state == Statejson)
     {
         size_t const totalneeded = sizeof(uint32_t) + p->jsonlen;
-        if (p->bufused < totalneeded)
+        if (avail < totalneeded)
             return 0;
 
-        char *jsonstart = p->buf + sizeof(uint32_t);
-        rc = parsejson(jsonstart, p->jsonlen, cmd);
+        /* The padding overlaps whatever follows the frame, which is put back after parsing */
+        if (p->head + totalneeded + YYJSON_PADDING_SIZE > p->bufsize)
+        {
+            memmove(p->buf, p->buf + p->head, avail);
+            p->tail = avail;
+            p->head = 0;
+            p->buf[p->tail] = '\0';
+        }
+
+        char *jsonstart = p->buf + p->head + sizeof(uint32_t);
+        char padding[YYJSON_PADDING_SIZE];
+        memcpy(padding, jsonstart + p->jsonlen, sizeof(padding));
+        memset(jsonstart + p->jsonlen, 0, sizeof(padding));
 
-        skipbytes = totalneeded;
+        double const start = clocksec();
+        int rc = parsejson(p, jsonstart, p->jsonlen, cmd);
+        metrictime(p->parsetime, clocksec() - start);
+
+        memcpy(jsonstart + p->jsonlen, padding, sizeof(padding));
+        parserskip(p, totalneeded);
         p->state = Statelen;
         p->jsonlen = 0;
-        goto compact;
+        return rc == 0 ? 1 : -1;
     }
 
     logerror("Invalid parser state: %d", p->state);
     return -1;
-
-compact:
-    /* Move remaining data to start of buffer */
-    remaining = p->bufused - skipbytes;
-    memmove(p->buf, p->buf + skipbytes, remaining);
-    p->bufused = remaining;
-    assert(p->bufused <= p->bufsize);
-
-    if (rc == 0)
-        return 1;
-    return -1;
 }
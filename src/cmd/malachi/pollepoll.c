@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "malachi.h"
+
+enum
+{
+    MAXEPOLLEVENTS = 64,
+};
+
+struct Poller
+{
+    int epfd;
+};
+
+Poller *pollercreate(void)
+{
+    Poller *p = malloc(sizeof(*p));
+    if (p == NULL)
+        return NULL;
+
+    p->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (p->epfd == -1)
+    {
+        free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+void pollerdestroy(Poller *p)
+{
+    if (p == NULL)
+        return;
+
+    close(p->epfd);
+    free(p);
+}
+
+static uint32_t epollevents(int events)
+{
+    return ((events & Pollin) ? EPOLLIN : 0) | ((events & Pollout) ? EPOLLOUT : 0);
+}
+
+int polleradd(Poller *p, int fd, int events, void *data)
+{
+    struct epoll_event ev = {
+        .events = epollevents(events),
+        .data.ptr = data,
+    };
+    return epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int pollermod(Poller *p, int fd, int events, void *data)
+{
+    struct epoll_event ev = {
+        .events = epollevents(events),
+        .data.ptr = data,
+    };
+    return epoll_ctl(p->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int pollerdel(Poller *p, int fd)
+{
+    return epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int pollerwait(Poller *p, Pollevent *events, int max, int timeoutms)
+{
+    struct epoll_event evs[MAXEPOLLEVENTS];
+    if (max > MAXEPOLLEVENTS)
+        max = MAXEPOLLEVENTS;
+
+    int n = epoll_wait(p->epfd, evs, max, timeoutms);
+    if (n == -1)
+        return -1;
+
+    for (int i = 0; i < n; ++i)
+    {
+        events[i].data = evs[i].data.ptr;
+        events[i].readable = (evs[i].events & EPOLLIN) != 0;
+        events[i].writable = (evs[i].events & EPOLLOUT) != 0;
+        events[i].hangup = (evs[i].events & EPOLLHUP) != 0;
+        events[i].error = (evs[i].events & EPOLLERR) != 0;
+    }
+
+    return n;
+}
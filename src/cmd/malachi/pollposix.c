@@ -0,0 +1,116 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+
+#include "malachi.h"
+
+/* Portable fallback, a linear scan per wait is fine for the handful of clients outside Linux */
+struct Poller
+{
+    size_t len;
+    size_t cap;
+    struct pollfd *fds;
+    void **data;
+};
+
+Poller *pollercreate(void)
+{
+    return calloc(1, sizeof(Poller));
+}
+
+void pollerdestroy(Poller *p)
+{
+    if (p == NULL)
+        return;
+
+    free(p->fds);
+    free(p->data);
+    free(p);
+}
+
+static short pollevents(int events)
+{
+    return (short)(((events & Pollin) ? POLLIN : 0) | ((events & Pollout) ? POLLOUT : 0));
+}
+
+int polleradd(Poller *p, int fd, int events, void *data)
+{
+    if (p->len == p->cap)
+    {
+        size_t const cap = p->cap ? 2 * p->cap : 16;
+
+        struct pollfd *fds = realloc(p->fds, cap * sizeof(fds[0]));
+        if (fds == NULL)
+            return -1;
+        p->fds = fds;
+
+        void **d = realloc(p->data, cap * sizeof(d[0]));
+        if (d == NULL)
+            return -1;
+        p->data = d;
+
+        p->cap = cap;
+    }
+
+    p->fds[p->len] = (struct pollfd){ .fd = fd, .events = pollevents(events) };
+    p->data[p->len] = data;
+    p->len++;
+    return 0;
+}
+
+int pollerdel(Poller *p, int fd)
+{
+    for (size_t i = 0; i < p->len; ++i)
+    {
+        if (p->fds[i].fd != fd)
+            continue;
+
+        p->len--;
+        p->fds[i] = p->fds[p->len];
+        p->data[i] = p->data[p->len];
+        return 0;
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+int pollermod(Poller *p, int fd, int events, void *data)
+{
+    for (size_t i = 0; i < p->len; ++i)
+    {
+        if (p->fds[i].fd != fd)
+            continue;
+
+        p->fds[i].events = pollevents(events);
+        p->data[i] = data;
+        return 0;
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+int pollerwait(Poller *p, Pollevent *events, int max, int timeoutms)
+{
+    int rc = poll(p->fds, (nfds_t)p->len, timeoutms);
+    if (rc <= 0)
+        return rc;
+
+    int n = 0;
+    for (size_t i = 0; i < p->len && n < max; ++i)
+    {
+        short const revents = p->fds[i].revents;
+        if (revents == 0)
+            continue;
+
+        events[n].data = p->data[i];
+        events[n].readable = (revents & POLLIN) != 0;
+        events[n].writable = (revents & POLLOUT) != 0;
+        events[n].hangup = (revents & POLLHUP) != 0;
+        events[n].error = (revents & (POLLERR | POLLNVAL)) != 0;
+        ++n;
+    }
+
+    return n;
+}
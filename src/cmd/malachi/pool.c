@@ -0,0 +1,103 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "malachi.h"
+
+struct Pool
+{
+    Queue *queue;
+    Poolfn *fn;
+    void *arg;
+    int nthreads;
+    pthread_t threads[];
+};
+
+static void *poolmain(void *arg)
+{
+    Pool *pool = arg;
+    void *item;
+
+    while ((item = queuepop(pool->queue)) != NULL)
+        pool->fn(item, pool->arg);
+
+    return NULL;
+}
+
+int threadspawn(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    sigset_t all;
+    sigset_t prev;
+
+    /* Signals are left to the main thread, which owns the daemon loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+    int rc = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+
+    return rc == 0 ? 0 : -1;
+}
+
+Pool *poolcreate(int nthreads, size_t depth, Poolfn *fn, void *arg)
+{
+    if (nthreads <= 0)
+        return NULL;
+
+    Pool *pool = malloc(sizeof(*pool) + ((size_t)nthreads * sizeof(pool->threads[0])));
+    if (pool == NULL)
+        return NULL;
+
+    pool->queue = queuecreate(depth);
+    if (pool->queue == NULL)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->nthreads = 0;
+
+    for (int i = 0; i < nthreads; ++i)
+    {
+        if (threadspawn(&pool->threads[i], poolmain, pool) != 0)
+        {
+            logerror("Failed to start worker thread %d", i);
+            pooldestroy(pool);
+            return NULL;
+        }
+        pool->nthreads++;
+    }
+
+    return pool;
+}
+
+void pooldestroy(Pool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    queueclose(pool->queue);
+    for (int i = 0; i < pool->nthreads; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    queuedestroy(pool->queue);
+    free(pool);
+}
+
+int poolsubmit(Pool *pool, void *item)
+{
+    return queuepush(pool->queue, item);
+}
+
+/* Returns -Ebusy instead of waiting when the pool is saturated */
+int pooltrysubmit(Pool *pool, void *item)
+{
+    int const rc = queuetrypush(pool->queue, item);
+    return rc > 0 ? -Ebusy : rc;
+}
+
+int poolsize(Pool const *pool)
+{
+    return pool->nthreads;
+}
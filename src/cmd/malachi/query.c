@@ -0,0 +1,222 @@
+#include <stdlib.h>
+
+#include "malachi.h"
+
+enum
+{
+    MAXPENDINGQUERIES = 64,
+    MAXHITS = 100,
+};
+
+/* Queries run on their own threads, each borrowing a read-only connection */
+struct Searcher
+{
+    Pool *workers;
+    Queue *readers;
+    Cache *cache;
+    int nreaders;
+    Database *conns[];
+};
+
+struct Query
+{
+    Reply *reply;
+    double queued;
+    char queryid[MAXQUERYIDLEN];
+    char terms[MAXQUERYTERMSLEN];
+    char repofilter[PATH_MAX];
+};
+
+struct Search
+{
+    Reply *reply;
+    char const *queryid;
+    Results *results;
+};
+
+/* Query ids name a file under the reply directory */
+int queryidvalid(char const *queryid)
+{
+    if (*queryid == '\0' || *queryid == '.')
+        return 0;
+
+    for (char const *c = queryid; *c; ++c)
+    {
+        int const ok = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '-' || *c == '_' || *c == '.';
+        if (!ok)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int sendhit(char const *root, char const *path, double score, void *arg)
+{
+    struct Search *x = arg;
+    return replyhit(x->reply, x->queryid, root, path, score);
+}
+
+/* Hits are recorded as they are sent, the complete set is cached once the query succeeds */
+static int sendrecord(char const *root, char const *path, double score, void *arg)
+{
+    struct Search *x = arg;
+
+    if (x->results && resultsadd(x->results, root, path, score) != 0)
+    {
+        resultsrelease(x->results);
+        x->results = NULL;
+    }
+
+    return sendhit(root, path, score, arg);
+}
+
+static void search(void *item, void *arg)
+{
+    Searcher *s = arg;
+    struct Query *q = item;
+
+    /* Queries from the pipe answer on a per-query FIFO, socket clients on their connection */
+    struct Search x = {
+        .reply = q->reply,
+        .queryid = q->queryid,
+    };
+
+    double const start = clocksec();
+    metrictime(metricget("query.wait", Mhistogram), start - q->queued);
+    uint64_t const gen = cachegen(s->cache, q->repofilter);
+
+    Results *cached = cacheget(s->cache, q->terms, q->repofilter, gen);
+    if (cached)
+    {
+        int const nhits = resultseach(cached, sendhit, &x);
+        resultsrelease(cached);
+        (void)replydone(x.reply, x.queryid, nhits);
+        metricsince("query.cached", start);
+        loginfo("Query %s: %d hits from cache in %.6fs", q->queryid, nhits, clocksec() - start);
+        goto releasereply;
+    }
+
+    Database *db = queuepop(s->readers);
+    if (db == NULL)
+        goto releasereply;
+
+    x.results = resultscreate();
+
+    int nhits = -1;
+    if (dbbeginread(db) == 0)
+    {
+        nhits = dbsearch(db, q->terms, q->repofilter, MAXHITS, sendrecord, &x);
+        (void)dbcommit(db);
+    }
+
+    (void)queuepush(s->readers, db);
+
+    if (nhits >= 0 && x.results)
+        cacheput(s->cache, q->terms, q->repofilter, gen, x.results);
+    resultsrelease(x.results);
+
+    (void)replydone(x.reply, x.queryid, nhits);
+    metricsince("query", start);
+
+    if (nhits < 0)
+        logerror("Query %s failed", q->queryid);
+    else
+        loginfo("Query %s: %d hits in %.3fs", q->queryid, nhits, clocksec() - start);
+
+releasereply:
+    replyrelease(x.reply);
+    free(q);
+}
+
+Searcher *searchercreate(Config const *config, Cache *cache, int nreaders)
+{
+    Error error = { 0 };
+
+    if (nreaders <= 0)
+        return NULL;
+
+    Searcher *s = malloc(sizeof(*s) + ((size_t)nreaders * sizeof(s->conns[0])));
+    if (s == NULL)
+        return NULL;
+
+    s->workers = NULL;
+    s->cache = cache;
+    s->nreaders = 0;
+
+    s->readers = queuecreate((size_t)nreaders);
+    if (s->readers == NULL)
+        goto freesearcher;
+
+    for (int i = 0; i < nreaders; ++i)
+    {
+        s->conns[i] = dbopenreader(config, &error);
+        if (s->conns[i] == NULL)
+        {
+            logerror("Failed to open read connection: %s", error.msg);
+            goto destroyreaders;
+        }
+        s->nreaders++;
+        (void)queuepush(s->readers, s->conns[i]);
+    }
+
+    s->workers = poolcreate(nreaders, MAXPENDINGQUERIES, search, s);
+    if (s->workers == NULL)
+        goto destroyreaders;
+
+    return s;
+
+destroyreaders:
+    for (int i = 0; i < s->nreaders; ++i)
+        dbdestroy(s->conns[i]);
+    queuedestroy(s->readers);
+freesearcher:
+    free(s);
+    return NULL;
+}
+
+void searcherdestroy(Searcher *s)
+{
+    if (s == NULL)
+        return;
+
+    pooldestroy(s->workers);
+
+    for (int i = 0; i < s->nreaders; ++i)
+        dbdestroy(s->conns[i]);
+
+    queuedestroy(s->readers);
+    free(s);
+}
+
+/* The reply, which every query needs, is held until the query is answered; -Ebusy means the queue is full */
+int searchersubmit(Searcher *s, Command const *cmd, Reply *reply)
+{
+    if (queryidvalid(cmd->queryop.queryid.s) == 0)
+    {
+        logerror("Invalid query id: %s", cmd->queryop.queryid.s);
+        return -1;
+    }
+
+    struct Query *q = malloc(sizeof(*q));
+    if (q == NULL)
+        return -1;
+
+    q->reply = reply;
+    q->queued = clocksec();
+    /* The parser bounds every field by these sizes, and the views die with the frame */
+    memcpy(q->queryid, cmd->queryop.queryid.s, cmd->queryop.queryid.len + 1);
+    memcpy(q->terms, cmd->queryop.terms.s, cmd->queryop.terms.len + 1);
+    memcpy(q->repofilter, cmd->queryop.repofilter.s, cmd->queryop.repofilter.len + 1);
+
+    replyretain(reply);
+
+    int const rc = pooltrysubmit(s->workers, q);
+    if (rc != 0)
+    {
+        replyrelease(reply);
+        free(q);
+        return rc;
+    }
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "malachi.h"
+
+struct Queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+    size_t cap;
+    size_t head;
+    size_t len;
+    int closed;
+    void *items[];
+};
+
+Queue *queuecreate(size_t cap)
+{
+    if (cap == 0)
+        return NULL;
+
+    Queue *q = malloc(sizeof(*q) + (cap * sizeof(q->items[0])));
+    if (q == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&q->lock, NULL) != 0)
+        goto freequeue;
+    if (pthread_cond_init(&q->notempty, NULL) != 0)
+        goto destroylock;
+    if (pthread_cond_init(&q->notfull, NULL) != 0)
+        goto destroynotempty;
+
+    q->cap = cap;
+    q->head = 0;
+    q->len = 0;
+    q->closed = 0;
+    return q;
+
+destroynotempty:
+    pthread_cond_destroy(&q->notempty);
+destroylock:
+    pthread_mutex_destroy(&q->lock);
+freequeue:
+    free(q);
+    return NULL;
+}
+
+void queuedestroy(Queue *q)
+{
+    if (q == NULL)
+        return;
+
+    pthread_cond_destroy(&q->notfull);
+    pthread_cond_destroy(&q->notempty);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+static int enqueue(Queue *q, void *item, int wait)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    while (wait && q->len == q->cap && q->closed == 0)
+        pthread_cond_wait(&q->notfull, &q->lock);
+
+    if (q->closed)
+    {
+        ret = -1;
+        goto unlock;
+    }
+
+    if (q->len == q->cap)
+    {
+        ret = 1;
+        goto unlock;
+    }
+
+    q->items[(q->head + q->len) % q->cap] = item;
+    q->len++;
+    pthread_cond_signal(&q->notempty);
+
+unlock:
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+static void *dequeue(Queue *q, int wait)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+
+    while (wait && q->len == 0 && q->closed == 0)
+        pthread_cond_wait(&q->notempty, &q->lock);
+
+    if (q->len > 0)
+    {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->len--;
+        pthread_cond_signal(&q->notfull);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+int queuepush(Queue *q, void *item)
+{
+    return enqueue(q, item, 1);
+}
+
+int queuetrypush(Queue *q, void *item)
+{
+    return enqueue(q, item, 0);
+}
+
+void *queuepop(Queue *q)
+{
+    return dequeue(q, 1);
+}
+
+void *queuetrypop(Queue *q)
+{
+    return dequeue(q, 0);
+}
+
+void queueclose(Queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->notempty);
+    pthread_cond_broadcast(&q->notfull);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* A snapshot, stale as soon as the lock is dropped */
+size_t queuelen(Queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    size_t const len = q->len;
+    pthread_mutex_unlock(&q->lock);
+    return len;
+}
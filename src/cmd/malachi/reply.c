@@ -0,0 +1,376 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <yyjson.h>
+
+#include "malachi.h"
+
+enum
+{
+    MAXREPLYQUEUE = 8 << 20,
+};
+
+/*
+ * A channel for length-prefixed JSON frames back to a client.  Connections
+ * share one Reply between the daemon loop and every query still running for
+ * them, so the descriptor is only closed when the last reference goes.
+ *
+ * A socket or a query's reply FIFO is nonblocking and only the daemon loop
+ * writes it: frames are queued in out, and the first one into an empty
+ * queue writes a byte to wakefd so the loop comes to flush it.  The loop
+ * sets wakefd to -1 when it lets go.
+ */
+struct Reply
+{
+    atomic_int refs;
+    atomic_int broken;
+    pthread_mutex_t lock;
+    int fd;
+    int socket;
+    int wakefd;
+    char *out;
+    size_t outoff;
+    size_t outlen;
+    size_t outcap;
+};
+
+static Reply *replycreate(int fd, int socket, int wakefd)
+{
+    Reply *r = malloc(sizeof(*r));
+    if (r == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&r->lock, NULL) != 0)
+    {
+        free(r);
+        return NULL;
+    }
+
+    atomic_init(&r->refs, 1);
+    atomic_init(&r->broken, 0);
+    r->fd = fd;
+    r->socket = socket;
+    r->wakefd = wakefd;
+    r->out = NULL;
+    r->outoff = 0;
+    r->outlen = 0;
+    r->outcap = 0;
+    return r;
+}
+
+/* Takes ownership of fd, a FIFO opened nonblocking, but not of wakefd */
+Reply *replyfifo(int fd, int wakefd)
+{
+    return replycreate(fd, 0, wakefd);
+}
+
+/* Takes ownership of fd, which must be nonblocking, but not of wakefd */
+Reply *replysocket(int fd, int wakefd)
+{
+    return replycreate(fd, 1, wakefd);
+}
+
+/* Called with the lock held, a full pipe means the loop is already due to wake */
+static void replywake(Reply *r)
+{
+    if (r->wakefd == -1)
+        return;
+
+    char const c = 0;
+    ssize_t const n = write(r->wakefd, &c, 1);
+    (void)n;
+}
+
+void replyretain(Reply *r)
+{
+    atomic_fetch_add(&r->refs, 1);
+}
+
+/*
+ * Dropping to the loop's own reference wakes it, so it can close a
+ * connection that was only waiting on its commands.  The count only falls
+ * under the lock, so whoever frees the Reply does so after any wake.
+ */
+void replyrelease(Reply *r)
+{
+    if (r == NULL)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    int const refs = atomic_fetch_sub(&r->refs, 1);
+    if (refs == 2)
+        replywake(r);
+    pthread_mutex_unlock(&r->lock);
+
+    if (refs != 1)
+        return;
+
+    close(r->fd);
+    pthread_mutex_destroy(&r->lock);
+    free(r->out);
+    free(r);
+}
+
+/* Commands still holding the reply, the caller's own reference aside */
+int replyinflight(Reply *r)
+{
+    return atomic_load(&r->refs) - 1;
+}
+
+/* The peer is gone, or the loop is done with it: fail pending and future sends */
+void replyclose(Reply *r)
+{
+    atomic_store(&r->broken, 1);
+    if (r->socket)
+        (void)shutdown(r->fd, SHUT_RDWR);
+
+    pthread_mutex_lock(&r->lock);
+    r->wakefd = -1;
+    r->outoff = 0;
+    r->outlen = 0;
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Bytes queued for the loop to write */
+size_t replyqueued(Reply *r)
+{
+    pthread_mutex_lock(&r->lock);
+    size_t const n = r->outlen - r->outoff;
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+/*
+ * Writes as much of the queue as the peer takes without blocking.
+ * Only the daemon loop calls this.  Returns 1 while frames remain queued,
+ * 0 once the queue is empty, and -1 once the reply is broken.
+ */
+int replyflush(Reply *r)
+{
+    pthread_mutex_lock(&r->lock);
+    while (atomic_load(&r->broken) == 0 && r->outoff < r->outlen)
+    {
+        ssize_t const n = write(r->fd, r->out + r->outoff, r->outlen - r->outoff);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+        {
+            logdebug("Failed to write reply: %s", strerror(errno));
+            atomic_store(&r->broken, 1);
+            break;
+        }
+        r->outoff += (size_t)n;
+    }
+
+    if (r->outoff == r->outlen)
+    {
+        r->outoff = 0;
+        r->outlen = 0;
+    }
+
+    int const rc = atomic_load(&r->broken) ? -1 : r->outlen > 0;
+    pthread_mutex_unlock(&r->lock);
+    return rc;
+}
+
+/* Called with the lock held, a client leaving MAXREPLYQUEUE bytes unread is cut off */
+static int replyqueue(Reply *r, struct iovec const *v, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        len += v[i].iov_len;
+
+    size_t const queued = r->outlen - r->outoff;
+    if (queued + len > MAXREPLYQUEUE)
+    {
+        logerror("Client is not reading its replies, closing it");
+        atomic_store(&r->broken, 1);
+        replywake(r);
+        return -1;
+    }
+
+    if (r->outoff > 0 && r->outlen + len > r->outcap)
+    {
+        memmove(r->out, r->out + r->outoff, queued);
+        r->outoff = 0;
+        r->outlen = queued;
+    }
+
+    if (r->outlen + len > r->outcap)
+    {
+        size_t const cap = 2 * (r->outlen + len);
+        char *out = realloc(r->out, cap);
+        if (out == NULL)
+            return -1;
+        r->out = out;
+        r->outcap = cap;
+    }
+
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        memcpy(r->out + r->outlen, v[i].iov_base, v[i].iov_len);
+        r->outlen += v[i].iov_len;
+    }
+
+    if (queued == 0)
+        replywake(r);
+    return 0;
+}
+
+/* Frames use the same native-endian length prefix as commands, whole frames are never interleaved */
+static int replysend(Reply *r, yyjson_mut_doc *doc)
+{
+    if (atomic_load(&r->broken))
+        return -1;
+
+    size_t len = 0;
+    char *json = yyjson_mut_write(doc, 0, &len);
+    if (json == NULL)
+        return -1;
+
+    if (len > UINT32_MAX)
+    {
+        free(json);
+        return -1;
+    }
+
+    uint32_t const prefix = (uint32_t)len;
+    struct iovec iov[2] = {
+        { .iov_base = (void *)&prefix, .iov_len = sizeof(prefix) },
+        { .iov_base = json, .iov_len = len },
+    };
+
+    pthread_mutex_lock(&r->lock);
+    int const rc = atomic_load(&r->broken) ? -1 : replyqueue(r, iov, 2);
+    pthread_mutex_unlock(&r->lock);
+
+    free(json);
+    return rc;
+}
+
+int replyhit(Reply *r, char const *queryid, char const *root, char const *path, double score)
+{
+    yyjson_mut_doc *doc = yyjson_mut_doc_new(NULL);
+    if (doc == NULL)
+        return -1;
+
+    yyjson_mut_val *obj = yyjson_mut_obj(doc);
+    yyjson_mut_doc_set_root(doc, obj);
+    yyjson_mut_obj_add_str(doc, obj, "queryId", queryid);
+    yyjson_mut_obj_add_str(doc, obj, "root", root);
+    yyjson_mut_obj_add_str(doc, obj, "path", path);
+    yyjson_mut_obj_add_real(doc, obj, "score", score);
+
+    int rc = replysend(r, doc);
+    yyjson_mut_doc_free(doc);
+    return rc;
+}
+
+int replydone(Reply *r, char const *queryid, int nhits)
+{
+    yyjson_mut_doc *doc = yyjson_mut_doc_new(NULL);
+    if (doc == NULL)
+        return -1;
+
+    yyjson_mut_val *obj = yyjson_mut_obj(doc);
+    yyjson_mut_doc_set_root(doc, obj);
+    yyjson_mut_obj_add_str(doc, obj, "queryId", queryid);
+    yyjson_mut_obj_add_bool(doc, obj, "done", 1);
+    if (nhits < 0)
+        yyjson_mut_obj_add_str(doc, obj, "error", "query failed");
+    else
+        yyjson_mut_obj_add_int(doc, obj, "hits", nhits);
+
+    int rc = replysend(r, doc);
+    yyjson_mut_doc_free(doc);
+    return rc;
+}
+
+int replyack(Reply *r, char const *op, char const *error)
+{
+    yyjson_mut_doc *doc = yyjson_mut_doc_new(NULL);
+    if (doc == NULL)
+        return -1;
+
+    yyjson_mut_val *obj = yyjson_mut_obj(doc);
+    yyjson_mut_doc_set_root(doc, obj);
+    if (op)
+        yyjson_mut_obj_add_str(doc, obj, "op", op);
+    yyjson_mut_obj_add_bool(doc, obj, "ok", error == NULL);
+    if (error)
+        yyjson_mut_obj_add_str(doc, obj, "error", error);
+
+    int rc = replysend(r, doc);
+    yyjson_mut_doc_free(doc);
+    return rc;
+}
+
+/* A batch is applied atomically, so one acknowledgement covers every operation in it */
+int replybatch(Reply *r, size_t nops, char const *error)
+{
+    yyjson_mut_doc *doc = yyjson_mut_doc_new(NULL);
+    if (doc == NULL)
+        return -1;
+
+    yyjson_mut_val *obj = yyjson_mut_obj(doc);
+    yyjson_mut_doc_set_root(doc, obj);
+    yyjson_mut_obj_add_str(doc, obj, "op", opname(Opbatch));
+    yyjson_mut_obj_add_bool(doc, obj, "ok", error == NULL);
+    yyjson_mut_obj_add_uint(doc, obj, "count", nops);
+    if (error)
+        yyjson_mut_obj_add_str(doc, obj, "error", error);
+
+    int rc = replysend(r, doc);
+    yyjson_mut_doc_free(doc);
+    return rc;
+}
+
+/* A command turned away under load, queries are also marked done so their client stops waiting */
+int replybusy(Reply *r, char const *op, char const *queryid, int retryms)
+{
+    yyjson_mut_doc *doc = yyjson_mut_doc_new(NULL);
+    if (doc == NULL)
+        return -1;
+
+    yyjson_mut_val *obj = yyjson_mut_obj(doc);
+    yyjson_mut_doc_set_root(doc, obj);
+    if (op)
+        yyjson_mut_obj_add_str(doc, obj, "op", op);
+    if (queryid)
+    {
+        yyjson_mut_obj_add_str(doc, obj, "queryId", queryid);
+        yyjson_mut_obj_add_bool(doc, obj, "done", 1);
+    }
+    yyjson_mut_obj_add_bool(doc, obj, "ok", 0);
+    yyjson_mut_obj_add_str(doc, obj, "error", "busy");
+    yyjson_mut_obj_add_int(doc, obj, "retryAfterMs", retryms);
+
+    int rc = replysend(r, doc);
+    yyjson_mut_doc_free(doc);
+    return rc;
+}
+
+/* The metrics snapshot is already JSON, it is embedded as is */
+int replystats(Reply *r, char const *json, size_t len)
+{
+    yyjson_mut_doc *doc = yyjson_mut_doc_new(NULL);
+    if (doc == NULL)
+        return -1;
+
+    yyjson_mut_val *obj = yyjson_mut_obj(doc);
+    yyjson_mut_doc_set_root(doc, obj);
+    yyjson_mut_obj_add_str(doc, obj, "op", opname(Opstats));
+    yyjson_mut_obj_add_bool(doc, obj, "ok", 1);
+    yyjson_mut_obj_add_val(doc, obj, "stats", yyjson_mut_rawn(doc, json, len));
+
+    int rc = replysend(r, doc);
+    yyjson_mut_doc_free(doc);
+    return rc;
+}
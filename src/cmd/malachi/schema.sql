@@ -1,3 +1,5 @@
+PRAGMA foreign_keys = ON;
+
 CREATE TABLE IF NOT EXISTS schema_version (
     major INTEGER NOT NULL,
     minor INTEGER NOT NULL,
@@ -13,91 +15,129 @@ CREATE TABLE IF NOT EXISTS roots (
     updated_at DATETIME DEFAULT CURRENT_TIMESTAMP
 );
 
-CREATE TABLE IF NOT EXISTS leaves (
+CREATE TABLE IF NOT EXISTS blobs (
     id INTEGER PRIMARY KEY AUTOINCREMENT,
-    root_id INTEGER NOT NULL,
-    leaf_hash TEXT NOT NULL,
-    leaf_path TEXT NOT NULL,
-    leaf_size INTEGER NOT NULL,
+    blob_hash TEXT NOT NULL UNIQUE,
+    blob_size INTEGER NOT NULL,
     mime_type TEXT,
     filter_name TEXT,
     content TEXT,
+    indexed_at DATETIME DEFAULT CURRENT_TIMESTAMP
+);
+
+CREATE TABLE IF NOT EXISTS leaves (
+    id INTEGER PRIMARY KEY AUTOINCREMENT,
+    root_id INTEGER NOT NULL,
+    blob_id INTEGER NOT NULL,
+    leaf_path TEXT NOT NULL,
     indexed_at DATETIME DEFAULT CURRENT_TIMESTAMP,
 
-    FOREIGN KEY (root_id) REFERENCES roots(id) ON DELETE CASCADE,
-    UNIQUE(root_id, leaf_hash, leaf_path)
+    FOREIGN KEY (blob_id) REFERENCES blobs(id),
+    UNIQUE(root_id, leaf_path)
 );
 
-CREATE TABLE IF NOT EXISTS leaf_pages (
+-- Long pages span several rows with one page_number
+CREATE TABLE IF NOT EXISTS blob_pages (
     id INTEGER PRIMARY KEY AUTOINCREMENT,
-    leaf_id INTEGER NOT NULL,
+    blob_id INTEGER NOT NULL,
     page_number INTEGER NOT NULL,
     content TEXT NOT NULL,
 
-    FOREIGN KEY (leaf_id) REFERENCES leaves(id) ON DELETE CASCADE,
-    UNIQUE(leaf_id, page_number)
+    FOREIGN KEY (blob_id) REFERENCES blobs(id) ON DELETE CASCADE
+);
+
+-- Removed roots with leaves left to delete
+CREATE TABLE IF NOT EXISTS root_tombstones (
+    root_id INTEGER PRIMARY KEY
+);
+
+-- Blobs that lost a leaf, swept after each index run
+CREATE TABLE IF NOT EXISTS blob_orphans (
+    blob_id INTEGER PRIMARY KEY
 );
 
 CREATE VIRTUAL TABLE IF NOT EXISTS leaves_fts USING fts5(
     leaf_path,
-    content,
     content=leaves,
     content_rowid=id
 );
 
-CREATE VIRTUAL TABLE IF NOT EXISTS leaf_pages_fts USING fts5(
+CREATE VIRTUAL TABLE IF NOT EXISTS blobs_fts USING fts5(
     content,
-    content=leaf_pages,
+    content=blobs,
+    content_rowid=id
+);
+
+CREATE VIRTUAL TABLE IF NOT EXISTS blob_pages_fts USING fts5(
+    content,
+    content=blob_pages,
     content_rowid=id
 );
 
 CREATE TRIGGER IF NOT EXISTS leaves_ai
     AFTER INSERT ON leaves
     BEGIN
-        INSERT INTO leaves_fts (rowid, leaf_path, content)
-        VALUES (new.id, new.leaf_path, new.content);
+        INSERT INTO leaves_fts (rowid, leaf_path)
+        VALUES (new.id, new.leaf_path);
     END;
 
 CREATE TRIGGER IF NOT EXISTS leaves_au
     AFTER UPDATE ON leaves
     BEGIN
-        UPDATE leaves_fts
-           SET leaf_path = new.leaf_path,
-               content = new.content
-         WHERE rowid = old.id;
+        INSERT INTO leaves_fts (leaves_fts, rowid, leaf_path)
+        VALUES ('delete', old.id, old.leaf_path);
+        INSERT INTO leaves_fts (rowid, leaf_path)
+        VALUES (new.id, new.leaf_path);
     END;
 
 CREATE TRIGGER IF NOT EXISTS leaves_ad
     AFTER DELETE ON leaves
     BEGIN
-        DELETE FROM leaves_fts
-         WHERE rowid = old.id;
+        INSERT INTO leaves_fts (leaves_fts, rowid, leaf_path)
+        VALUES ('delete', old.id, old.leaf_path);
+        INSERT OR IGNORE INTO blob_orphans (blob_id)
+        VALUES (old.blob_id);
     END;
 
-CREATE TRIGGER IF NOT EXISTS leaf_pages_ai
-    AFTER INSERT ON leaf_pages
+CREATE TRIGGER IF NOT EXISTS blobs_ai
+    AFTER INSERT ON blobs
     BEGIN
-        INSERT INTO leaf_pages_fts (rowid, content)
+        INSERT INTO blobs_fts (rowid, content)
         VALUES (new.id, new.content);
     END;
 
-CREATE TRIGGER IF NOT EXISTS leaf_pages_au
-    AFTER UPDATE ON leaf_pages
+CREATE TRIGGER IF NOT EXISTS blobs_au
+    AFTER UPDATE ON blobs
     BEGIN
-        UPDATE leaf_pages_fts
-           SET content = new.content
-         WHERE rowid = old.id;
+        INSERT INTO blobs_fts (blobs_fts, rowid, content)
+        VALUES ('delete', old.id, old.content);
+        INSERT INTO blobs_fts (rowid, content)
+        VALUES (new.id, new.content);
+    END;
+
+CREATE TRIGGER IF NOT EXISTS blobs_ad
+    AFTER DELETE ON blobs
+    BEGIN
+        INSERT INTO blobs_fts (blobs_fts, rowid, content)
+        VALUES ('delete', old.id, old.content);
+    END;
+
+CREATE TRIGGER IF NOT EXISTS blob_pages_ai
+    AFTER INSERT ON blob_pages
+    BEGIN
+        INSERT INTO blob_pages_fts (rowid, content)
+        VALUES (new.id, new.content);
     END;
 
-CREATE TRIGGER IF NOT EXISTS leaf_pages_ad
-    AFTER DELETE ON leaf_pages
+CREATE TRIGGER IF NOT EXISTS blob_pages_ad
+    AFTER DELETE ON blob_pages
     BEGIN
-        DELETE FROM leaf_pages_fts
-         WHERE rowid = old.id;
+        INSERT INTO blob_pages_fts (blob_pages_fts, rowid, content)
+        VALUES ('delete', old.id, old.content);
     END;
 
-CREATE INDEX IF NOT EXISTS idx_leaves_root_hash
-    ON leaves(root_id, leaf_hash);
+CREATE INDEX IF NOT EXISTS idx_leaves_blob
+    ON leaves(blob_id);
 
 CREATE INDEX IF NOT EXISTS idx_leaves_path
     ON leaves(root_id, leaf_path);
@@ -105,7 +145,7 @@ CREATE INDEX IF NOT EXISTS idx_leaves_path
 CREATE INDEX IF NOT EXISTS idx_roots_path
     ON roots(root_path);
 
-CREATE INDEX IF NOT EXISTS idx_leaf_pages_leaf
-    ON leaf_pages(leaf_id, page_number);
+CREATE INDEX IF NOT EXISTS idx_blob_pages_blob
+    ON blob_pages(blob_id, page_number);
 
-INSERT OR IGNORE INTO schema_version (major, minor, patch) VALUES (0, 1, 0);
+INSERT OR IGNORE INTO schema_version (major, minor, patch) VALUES (0, 4, 0);
@@ -1,4 +1,8 @@
+#include <ftw.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "malachi.h"
 
@@ -68,3 +72,63 @@ int testone(char const *name)
     printf("Test '%s' not found\n", name);
     return 1;
 }
+
+/* Unique to this process, since every test runs as its own malachi -t */
+char *testdirmake(char const *name)
+{
+    char const *tmpdir = getenv("TMPDIR");
+    char dir[PATH_MAX];
+
+    int const n = snprintf(dir, sizeof(dir), "%s/malachi-test-%ld-%s", tmpdir && *tmpdir ? tmpdir : "/tmp", (long)getpid(), name);
+    if (n < 0 || (size_t)n >= sizeof(dir))
+        return NULL;
+    if (mkdirp(dir, 0700) != 0)
+        return NULL;
+    return strdup(dir);
+}
+
+static int removeentry(char const *path, struct stat const *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    (void)remove(path);
+    return 0;
+}
+
+void testdirremove(char const *dir)
+{
+    if (dir)
+        (void)nftw(dir, removeentry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int testfile(char const *dir, char const *name, char const *data, size_t len)
+{
+    char *path = joinpath2(dir, name);
+    FILE *f = path ? fopen(path, "wb") : NULL;
+    free(path);
+    if (f == NULL)
+        return -1;
+
+    int const ok = fwrite(data, 1, len, f) == len;
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+/* Runs git to completion with its output discarded, failing unless it exits 0 */
+int testgit(char const *repo, char const *const args[])
+{
+    Git *g = gitopen(repo, args);
+    if (g == NULL)
+        return -1;
+
+    char *rec = NULL;
+    while (gitread(g, '\n', &rec) > 0)
+        ;
+
+    if (gitclose(g) != 0)
+    {
+        eprintf("git %s failed in %s\n", args[0], repo);
+        return -1;
+    }
+    return 0;
+}
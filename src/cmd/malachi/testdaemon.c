@@ -0,0 +1,359 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "malachi.h"
+
+enum
+{
+    NSTATS = 4096,  /* About 5 MB of replies, far more than the socket buffers hold */
+    NFIFOS = 8,     /* More than there are query threads */
+    WAITMS = 5000,
+};
+
+static void sleepms(int ms)
+{
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000L };
+    (void)nanosleep(&ts, NULL);
+}
+
+/* The daemon runs from this binary with every XDG directory pointed at the scratch directory */
+static pid_t daemonstart(char const *dir)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0)
+    {
+        (void)dup2(devnull, STDOUT_FILENO);
+        (void)dup2(devnull, STDERR_FILENO);
+    }
+
+    char const *const vars[] = { "HOME", "XDG_CONFIG_HOME", "XDG_DATA_HOME", "XDG_CACHE_HOME", "XDG_RUNTIME_DIR" };
+    for (size_t i = 0; i < NELEM(vars); ++i)
+        (void)setenv(vars[i], dir, 1);
+
+    char *const argv[] = { (char *)selfpath, NULL };
+    (void)execvp(selfpath, argv);
+    _exit(127);
+}
+
+static int daemonwait(pid_t pid)
+{
+    int status = 0;
+
+    for (int waited = 0; waited < WAITMS; waited += 50)
+    {
+        pid_t const rc = waitpid(pid, &status, WNOHANG);
+        if (rc == pid)
+            return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+        if (rc < 0)
+            return -1;
+        sleepms(50);
+    }
+
+    eprintf("daemon did not exit\n");
+    (void)kill(pid, SIGKILL);
+    (void)waitpid(pid, &status, 0);
+    return -1;
+}
+
+/* Retried until the daemon has bound its socket */
+static int clientopen(char const *sockpath)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(sockpath) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, sockpath);
+
+    for (int waited = 0; waited < WAITMS; waited += 50)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        (void)close(fd);
+        sleepms(50);
+    }
+
+    eprintf("daemon socket %s never appeared\n", sockpath);
+    return -1;
+}
+
+static size_t frame(char *buf, char const *json)
+{
+    uint32_t const len = (uint32_t)strlen(json);
+    memcpy(buf, &len, sizeof(len));
+    memcpy(buf + sizeof(len), json, len);
+    return sizeof(len) + len;
+}
+
+static int sendframe(int fd, char const *json)
+{
+    char buf[256];
+    if (strlen(json) > sizeof(buf) - sizeof(uint32_t))
+        return -1;
+
+    size_t const len = frame(buf, json);
+    for (size_t off = 0; off < len;)
+    {
+        ssize_t const n = write(fd, buf + off, len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        off += (size_t)n;
+    }
+    return 0;
+}
+
+static int readfull(int fd, char *buf, size_t len)
+{
+    for (size_t off = 0; off < len;)
+    {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int const rc = poll(&pfd, 1, WAITMS);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+
+        ssize_t const n = read(fd, buf + off, len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        off += (size_t)n;
+    }
+    return 0;
+}
+
+/* Reads one reply, failing if it takes longer than WAITMS or does not match */
+static int expectframe(int fd, char const *want)
+{
+    char buf[256];
+    uint32_t len;
+
+    if (readfull(fd, (char *)&len, sizeof(len)) != 0)
+    {
+        eprintf("no reply, expected %s\n", want);
+        return -1;
+    }
+    if (len >= sizeof(buf) || readfull(fd, buf, len) != 0)
+    {
+        eprintf("short or oversized reply, expected %s\n", want);
+        return -1;
+    }
+    buf[len] = '\0';
+
+    if (strcmp(buf, want) != 0)
+    {
+        eprintf("reply mismatch: got %s, expected %s\n", buf, want);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Queries sent on the command pipe whose reply FIFOs are opened but already
+ * full, as if their clients had stopped reading.
+ */
+static int fifostall(char const *rundir, int *fds)
+{
+    char *pipepath = joinpath2(rundir, "command");
+    char *replydir = joinpath2(rundir, "replies");
+    int ret = -1;
+    int cmdfd = -1;
+
+    if (pipepath == NULL || replydir == NULL)
+        goto freepaths;
+
+    cmdfd = open(pipepath, O_WRONLY);
+    if (cmdfd < 0)
+        goto freepaths;
+
+    for (int i = 0; i < NFIFOS; ++i)
+    {
+        char name[32];
+        (void)snprintf(name, sizeof(name), "stall%d", i);
+        char *path = joinpath2(replydir, name);
+        if (path == NULL || mkfifo(path, 0600) != 0)
+        {
+            free(path);
+            goto closecmd;
+        }
+
+        fds[i] = open(path, O_RDONLY | O_NONBLOCK);
+        int const w = open(path, O_WRONLY | O_NONBLOCK);
+        free(path);
+        if (fds[i] < 0 || w < 0)
+        {
+            if (w >= 0)
+                (void)close(w);
+            goto closecmd;
+        }
+
+        char junk[4096] = { 0 };
+        while (write(w, junk, sizeof(junk)) > 0)
+            ;
+        (void)close(w);
+
+        char json[128];
+        (void)snprintf(json, sizeof(json), "{\"op\":\"query\",\"queryId\":\"%s\",\"terms\":\"anything\"}", name);
+        if (sendframe(cmdfd, json) != 0)
+            goto closecmd;
+    }
+
+    ret = 0;
+
+closecmd:
+    (void)close(cmdfd);
+freepaths:
+    free(replydir);
+    free(pipepath);
+    return ret;
+}
+
+/*
+ * Client A sends stats requests and never reads the replies, and more
+ * queries than there are query threads wait on full reply FIFOs.  Client B
+ * must still have its query answered and its shutdown acknowledged, and
+ * the daemon must exit with all of them still open.
+ */
+static int testslowclient(char const *dir)
+{
+    int ret = -1;
+
+    pid_t pid = daemonstart(dir);
+    if (pid < 0)
+        return -1;
+
+    char *rundir = joinpath2(dir, "malachi");
+    char *sockpath = rundir ? joinpath2(rundir, "socket") : NULL;
+    char *stats = malloc(NSTATS * 32);
+    int a = -1;
+    int b = -1;
+    int fifos[NFIFOS];
+    for (int i = 0; i < NFIFOS; ++i)
+        fifos[i] = -1;
+
+    if (sockpath == NULL || stats == NULL)
+        goto stop;
+
+    a = clientopen(sockpath);
+    if (a < 0)
+        goto stop;
+
+    size_t len = 0;
+    for (int i = 0; i < NSTATS; ++i)
+        len += frame(stats + len, "{\"op\":\"stats\"}");
+
+    /* The daemon stops reading A once it is far enough behind, so A may not get everything out */
+    if (fcntl(a, F_SETFL, O_NONBLOCK) != 0)
+        goto stop;
+    for (size_t off = 0; off < len;)
+    {
+        ssize_t const n = write(a, stats + off, len - off);
+        if (n > 0)
+        {
+            off += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            goto stop;
+
+        struct pollfd pfd = { .fd = a, .events = POLLOUT };
+        if (poll(&pfd, 1, 500) == 0)
+            break;
+    }
+
+    struct pollfd pfd = { .fd = a, .events = POLLIN };
+    if (poll(&pfd, 1, WAITMS) != 1)
+    {
+        eprintf("client A got no replies\n");
+        goto stop;
+    }
+
+    if (fifostall(rundir, fifos) != 0)
+    {
+        eprintf("failed to queue queries on the command pipe\n");
+        goto stop;
+    }
+    /* The pipe and the socket are separate sources, give the pipe's queries a head start */
+    sleepms(200);
+
+    b = clientopen(sockpath);
+    if (b < 0)
+        goto stop;
+
+    if (sendframe(b, "{\"op\":\"query\",\"queryId\":\"b\",\"terms\":\"anything\"}") != 0)
+        goto stop;
+    if (expectframe(b, "{\"queryId\":\"b\",\"done\":true,\"hits\":0}") != 0)
+        goto stop;
+
+    if (sendframe(b, "{\"op\":\"shutdown\"}") != 0)
+        goto stop;
+    if (expectframe(b, "{\"op\":\"shutdown\",\"ok\":true}") != 0)
+        goto stop;
+
+    ret = daemonwait(pid);
+    pid = -1;
+
+stop:
+    if (pid > 0)
+    {
+        (void)kill(pid, SIGTERM);
+        (void)daemonwait(pid);
+    }
+    if (b >= 0)
+        (void)close(b);
+    if (a >= 0)
+        (void)close(a);
+    for (int i = 0; i < NFIFOS; ++i)
+        if (fifos[i] >= 0)
+            (void)close(fifos[i]);
+    free(stats);
+    free(sockpath);
+    free(rundir);
+    return ret;
+}
+
+static int run(void)
+{
+    char *dir = testdirmake("daemon");
+    if (dir == NULL)
+        return -1;
+
+    /* A's replies are abandoned unread, and B's writes must not kill the test if the daemon is gone */
+    (void)signal(SIGPIPE, SIG_IGN);
+
+    int failures = 0;
+    if (testslowclient(dir) != 0)
+        failures++;
+
+    testdirremove(dir);
+    free(dir);
+    return failures;
+}
+
+static Test const test = {
+    .name = "daemon",
+    .run = run,
+};
+
+__attribute__((constructor)) static void init(void)
+{
+    testadd(&test);
+}
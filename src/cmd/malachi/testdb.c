@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "malachi.h"
+
+enum
+{
+    NUNIQUE = 25,
+    RECLAIMLIMIT = 10,
+    MAXHITS = 100,
+};
+
+static char const removedroot[] = "/test/removed";
+static char const keptroot[] = "/test/kept";
+
+struct Hits
+{
+    int n;
+    int removed;
+    int readded;
+};
+
+static int hitcount(char const *root, char const *path, double score, void *arg)
+{
+    struct Hits *h = arg;
+    (void)score;
+    h->n++;
+    if (strcmp(root, removedroot) == 0)
+    {
+        if (strcmp(path, "again.txt") == 0)
+            h->readded++;
+        else
+            h->removed++;
+    }
+    return 0;
+}
+
+static int search(Database *reader, char const *terms, struct Hits *h)
+{
+    *h = (struct Hits){ 0 };
+    if (dbbeginread(reader) != 0)
+        return -1;
+    int const rc = dbsearch(reader, terms, NULL, MAXHITS, hitcount, h);
+    (void)dbcommit(reader);
+    return rc < 0 ? -1 : 0;
+}
+
+static int leafput(Database *db, int64_t rootid, char const *hash, char const *path, char const *content)
+{
+    int64_t blobid = dbblobfind(db, hash);
+    if (blobid == 0)
+    {
+        Leaf const leaf = {
+            .hash = hash,
+            .path = path,
+            .size = (int64_t)strlen(content),
+            .filter = "text",
+            .content = content,
+        };
+        blobid = dbblobput(db, &leaf);
+    }
+    return blobid > 0 ? dbleafput(db, rootid, blobid, path) : -1;
+}
+
+static void blobhash(char *hash, size_t size, int i)
+{
+    (void)snprintf(hash, size, "%040d", i);
+}
+
+/*
+ * One root with blobs of its own and one shared with a second root.  The
+ * first is removed, then added back with the shared blob before its old
+ * leaves are reclaimed.
+ */
+static int testdbreclaim(Database *db, Database *reader)
+{
+    char const *const shared = "0000000000000000000000000000000000000999";
+    char const *const readded = "0000000000000000000000000000000000000998";
+    char hash[MAXHASHLEN];
+    struct Hits h;
+
+    if (dbbegin(db) != 0)
+        return -1;
+    int64_t const rootid = dbrootadd(db, removedroot);
+    int64_t const keptid = dbrootadd(db, keptroot);
+    int rc = rootid > 0 && keptid > 0 ? 0 : -1;
+    for (int i = 0; rc == 0 && i < NUNIQUE; ++i)
+    {
+        char path[32];
+        blobhash(hash, sizeof(hash), i);
+        (void)snprintf(path, sizeof(path), "unique%d.txt", i);
+        rc = leafput(db, rootid, hash, path, "onlyremoved words");
+    }
+    if (rc == 0)
+        rc = leafput(db, rootid, shared, "shared.txt", "sharedword");
+    if (rc == 0)
+        rc = leafput(db, keptid, shared, "shared.txt", "sharedword");
+    if (rc != 0 || dbcommit(db) != 0)
+    {
+        (void)dbrollback(db);
+        return -1;
+    }
+
+    if (search(reader, "onlyremoved", &h) != 0 || h.removed != NUNIQUE)
+    {
+        eprintf("expected %d hits before the remove, got %d\n", NUNIQUE, h.removed);
+        return -1;
+    }
+
+    if (dbbegin(db) != 0 || dbrootdel(db, removedroot) != 0 || dbcommit(db) != 0)
+        return -1;
+
+    /* Leaves are still there, but the root is gone from every search at once */
+    if (search(reader, "onlyremoved", &h) != 0 || h.n != 0 || search(reader, "sharedword", &h) != 0 || h.n != 1 || h.removed != 0)
+    {
+        eprintf("removed root still searched: %d hits, %d from it\n", h.n, h.removed);
+        return -1;
+    }
+
+    if (dbbegin(db) != 0)
+        return -1;
+    int64_t const newid = dbrootadd(db, removedroot);
+    if (newid <= 0 || newid == rootid || leafput(db, newid, shared, "again.txt", "sharedword") != 0 ||
+        leafput(db, newid, readded, "again2.txt", "readdedword") != 0 || dbcommit(db) != 0)
+    {
+        (void)dbrollback(db);
+        eprintf("failed to add the root back\n");
+        return -1;
+    }
+
+    int steps = 0;
+    while ((rc = dbrootreclaim(db, RECLAIMLIMIT)) > 0)
+        steps++;
+    if (rc < 0 || steps < NUNIQUE / RECLAIMLIMIT)
+    {
+        eprintf("reclaim failed after %d steps\n", steps);
+        return -1;
+    }
+
+    /* A blob is only swept once no leaf uses it, so these being gone means the old leaves are too */
+    for (int i = 0; i < NUNIQUE; ++i)
+    {
+        blobhash(hash, sizeof(hash), i);
+        if (dbblobfind(db, hash) != 0)
+        {
+            eprintf("orphan blob %s left after reclaim\n", hash);
+            return -1;
+        }
+    }
+    if (dbblobfind(db, shared) <= 0 || dbblobfind(db, readded) <= 0)
+    {
+        eprintf("reclaim deleted a blob still in use\n");
+        return -1;
+    }
+
+    if (search(reader, "sharedword", &h) != 0 || h.n != 2 || h.readded != 1 || h.removed != 0)
+    {
+        eprintf("expected the kept root and the added back one, got %d hits, %d old\n", h.n, h.removed);
+        return -1;
+    }
+    if (search(reader, "readdedword", &h) != 0 || h.n != 1)
+    {
+        eprintf("root added back lost its new leaf\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int run(void)
+{
+    Error err = { 0 };
+    char *dir = testdirmake("db");
+    if (dir == NULL)
+        return -1;
+
+    Config config = { .cachedir = dir };
+    int failures = 0;
+
+    Database *db = dbcreate(&config, &err);
+    Database *reader = db ? dbopenreader(&config, &err) : NULL;
+    if (reader == NULL)
+    {
+        eprintf("Failed to open database in %s: %s\n", dir, err.msg);
+        failures++;
+    }
+    else if (testdbreclaim(db, reader) != 0)
+        failures++;
+
+    dbdestroy(reader);
+    dbdestroy(db);
+    testdirremove(dir);
+    free(dir);
+    return failures;
+}
+
+static Test const test = {
+    .name = "db",
+    .run = run,
+};
+
+__attribute__((constructor)) static void init(void)
+{
+    testadd(&test);
+}
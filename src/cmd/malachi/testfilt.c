@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "malachi.h"
+
+enum
+{
+    NMANY = 40,
+    LONGTEXT = 4096,
+};
+
+static char const *version(void)
+{
+    return "0";
+}
+
+static char manyexts[NMANY][16];
+static char const *manyextlists[NMANY][2];
+static Filter manyfilters[NMANY];
+
+/* Far more filters than the registry once held, each found by its own extension */
+static int testfiltermany(void)
+{
+    for (int i = 0; i < NMANY; ++i)
+    {
+        (void)snprintf(manyexts[i], sizeof(manyexts[i]), ".test%d", i);
+        manyextlists[i][0] = manyexts[i];
+        manyextlists[i][1] = NULL;
+        manyfilters[i] = (Filter){
+            .name = "testmany",
+            .exts = manyextlists[i],
+            .version = version,
+        };
+        filteradd(&manyfilters[i]);
+    }
+
+    for (int i = 0; i < NMANY; ++i)
+    {
+        if (filterget(manyexts[i]) != &manyfilters[i])
+        {
+            eprintf("extension %s maps to the wrong filter\n", manyexts[i]);
+            return -1;
+        }
+    }
+
+    if (filterget(".test") != NULL || filterget(".test400") != NULL)
+    {
+        eprintf("unregistered extension matched a filter\n");
+        return -1;
+    }
+
+    int n = 0;
+    for (Filter const **f = filterall(); *f; ++f)
+        n += *f >= &manyfilters[0] && *f <= &manyfilters[NMANY - 1];
+    if (n != NMANY)
+    {
+        eprintf("expected %d registered filters, found %d\n", NMANY, n);
+        return -1;
+    }
+
+    return 0;
+}
+
+static char const *sniffexts[] = { ".testsniff", NULL };
+static char const *sniffmagics[] = { "\x7fTEST", "\x7fTST2", NULL };
+static Filter const sniffer = {
+    .name = "testsniff",
+    .exts = sniffexts,
+    .magics = sniffmagics,
+    .version = version,
+};
+
+static char const *shadowexts[] = { ".testsniff", ".testshadow", NULL };
+static char const *shadowmagics[] = { "\x7fTEST", NULL };
+static Filter const shadow = {
+    .name = "testshadow",
+    .exts = shadowexts,
+    .magics = shadowmagics,
+    .version = version,
+};
+
+/* Earlier filters keep their extensions and magic numbers, content overrides a wrong name */
+static int testfiltersniff(void)
+{
+    filteradd(&sniffer);
+    filteradd(&shadow);
+
+    if (filterget(".testsniff") != &sniffer || filterget(".testshadow") != &shadow)
+    {
+        eprintf("extension claimed by a later filter\n");
+        return -1;
+    }
+
+    if (filtersniff("\x7fTEST data", 10) != &sniffer || filtersniff("\x7fTST2", 5) != &sniffer)
+    {
+        eprintf("magic number not recognised\n");
+        return -1;
+    }
+
+    if (filtersniff("\x7fTES", 4) != NULL || filtersniff("", 0) != NULL)
+    {
+        eprintf("truncated magic number matched\n");
+        return -1;
+    }
+
+    if (filtercheck(&shadow, "\x7fTST2 data", 10) != &sniffer)
+    {
+        eprintf("mislabeled content kept its extension's filter\n");
+        return -1;
+    }
+
+    if (filtercheck(&sniffer, "plain text", 10) != filterdefault() || filtercheck(NULL, "\x7fTEST", 5) != &sniffer)
+    {
+        eprintf("content check ignored the magic numbers\n");
+        return -1;
+    }
+
+    if (filtercheck(&manyfilters[0], "anything", 8) != &manyfilters[0])
+    {
+        eprintf("filter without magic numbers was second-guessed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int textcase(Filter const *text, char const *input, size_t len, char const *expect)
+{
+    char *output = NULL;
+    int const rc = text->extract(input, len, &output);
+
+    int const ok = expect ? rc == 0 && strcmp(output, expect) == 0 : rc != 0;
+    if (!ok)
+        eprintf("text filter on %zu bytes: expected %.40s, got %.40s\n", len, expect ? expect : "rejection", rc == 0 ? output : "rejection");
+
+    free(output);
+    return ok ? 0 : -1;
+}
+
+/* Line endings become LF, malformed UTF-8 is replaced, binary content is rejected */
+static int testfiltertext(void)
+{
+    Filter const *text = filterdefault();
+    if (text == NULL || strcmp(text->name, "text") != 0)
+    {
+        eprintf("text filter is not the default\n");
+        return -1;
+    }
+
+    struct
+    {
+        char const *input;
+        size_t len;
+        char const *expect;
+    } const cases[] = {
+#define CASE(in, out) { in, sizeof(in) - 1, out }
+        CASE("a\r\nb\rc\n", "a\nb\nc\n"),
+        CASE("caf\xC3\xA9 \xE2\x82\xAC \xF0\x9F\x98\x80", "caf\xC3\xA9 \xE2\x82\xAC \xF0\x9F\x98\x80"),
+        CASE("overlong \xC0\xAF here, and a long line", "overlong \xEF\xBF\xBD\xEF\xBF\xBD here, and a long line"),
+        CASE("surrogate \xED\xA0\x80 is not text, so it", "surrogate \xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD is not text, so it"),
+        CASE("truncated \xE2\x82", NULL),
+        CASE("nul\0byte", NULL),
+        CASE("\x01\x02\x03\x04 mostly control", NULL),
+        CASE("\xFF\xFE\xFD\xFC\xFB", NULL),
+        CASE("", ""),
+#undef CASE
+    };
+
+    for (size_t i = 0; i < NELEM(cases); ++i)
+        if (textcase(text, cases[i].input, cases[i].len, cases[i].expect) != 0)
+            return -1;
+
+    /* Every offset of a stray byte within a long run, across every vector width */
+    char *input = malloc(LONGTEXT + 1);
+    char *expect = malloc(LONGTEXT + 1);
+    if (input == NULL || expect == NULL)
+    {
+        free(input);
+        free(expect);
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t at = 0; at < 100 && ret == 0; ++at)
+    {
+        for (size_t i = 0; i < LONGTEXT; ++i)
+            input[i] = (char)(i % 61 == 60 ? '\n' : i % 7 == 6 ? '\t' : 'a' + (char)(i % 26));
+        memcpy(expect, input, LONGTEXT);
+
+        /* A lone CR, since one before LF would fold into it */
+        size_t const pos = LONGTEXT - 1 - at;
+        if (pos + 1 < LONGTEXT && input[pos + 1] == '\n')
+            continue;
+        input[pos] = '\r';
+        expect[pos] = '\n';
+        input[LONGTEXT] = '\0';
+        expect[LONGTEXT] = '\0';
+        ret = textcase(text, input, LONGTEXT, expect);
+    }
+
+    free(input);
+    free(expect);
+    return ret;
+}
+
+/* A page of accented text with nowhere to break is cut between characters, whatever its length */
+static int testfiltersplit(void)
+{
+    static char const *const chars[] = { "\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80" };
+
+    for (size_t i = 0; i < NELEM(chars); ++i)
+    {
+        size_t const charlen = strlen(chars[i]);
+        for (size_t len = 16 * charlen; len > 12 * charlen; --len)
+        {
+            /* Exactly len bytes, so reading past the page is caught under a sanitizer */
+            char *page = malloc(len);
+            if (page == NULL)
+                return -1;
+            for (size_t j = 0; j < len; ++j)
+                page[j] = chars[i][j % charlen];
+
+            size_t const cut = pagesplit(page, len);
+            free(page);
+
+            size_t const expect = len - (len % charlen);
+            if (cut != expect)
+            {
+                eprintf("split of %zu bytes of %zu-byte characters at %zu, expected %zu\n", len, charlen, cut, expect);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int run(void)
+{
+    int failures = 0;
+
+    if (testfiltermany() != 0)
+        failures++;
+    if (testfiltersniff() != 0)
+        failures++;
+    if (testfiltertext() != 0)
+        failures++;
+    if (testfiltersplit() != 0)
+        failures++;
+
+    return failures;
+}
+
+static Test const test = {
+    .name = "filter",
+    .run = run,
+};
+
+__attribute__((constructor)) static void init(void)
+{
+    testadd(&test);
+}
@@ -0,0 +1,293 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "malachi.h"
+
+enum
+{
+    MAXEXPECTED = 8,
+    WAITMS = 10000,
+};
+
+/* One scratch repository indexed by a real Indexer, with its rows read back over a separate connection */
+struct Fixture
+{
+    char *dir;
+    char *repo;
+    Config config;
+    Database *db;
+    Cache *cache;
+    Indexer *ix;
+    sqlite3 *conn;
+};
+
+static void sleepms(int ms)
+{
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000L };
+    (void)nanosleep(&ts, NULL);
+}
+
+static int commit(char const *repo, char const *msg)
+{
+    char const *const add[] = { "add", "-A", NULL };
+    char const *const ci[] = { "-c", "user.name=test", "-c", "user.email=test@localhost", "-c", "commit.gpgsign=false", "commit", "-q", "-m", msg, NULL };
+    return testgit(repo, add) == 0 && testgit(repo, ci) == 0 ? 0 : -1;
+}
+
+static int writetext(char const *repo, char const *name, char const *text)
+{
+    return testfile(repo, name, text, strlen(text));
+}
+
+static int makelink(char const *repo, char const *name, char const *target)
+{
+    char *path = joinpath2(repo, name);
+    int const rc = path ? symlink(target, path) : -1;
+    free(path);
+    return rc;
+}
+
+static int removefile(char const *repo, char const *name)
+{
+    char *path = joinpath2(repo, name);
+    int const rc = path ? unlink(path) : -1;
+    free(path);
+    return rc;
+}
+
+static int fixtureopen(struct Fixture *f)
+{
+    Error err = { 0 };
+
+    f->dir = testdirmake("index");
+    if (f->dir == NULL)
+        return -1;
+    f->repo = joinpath2(f->dir, "repo");
+    f->config.cachedir = joinpath2(f->dir, "cache");
+    f->config.runtimedir = f->dir;
+    if (f->repo == NULL || f->config.cachedir == NULL || mkdirp(f->repo, 0700) != 0 || mkdirp(f->config.cachedir, 0700) != 0)
+        return -1;
+
+    char const *const init[] = { "init", "-q", "-b", "main", NULL };
+    if (testgit(f->repo, init) != 0)
+        return -1;
+
+    f->db = dbcreate(&f->config, &err);
+    if (f->db == NULL)
+    {
+        eprintf("Failed to create database: %s\n", err.msg);
+        return -1;
+    }
+
+    char *dbpath = joinpath2(f->config.cachedir, "index.db");
+    int const rc = dbpath ? sqlite3_open_v2(dbpath, &f->conn, SQLITE_OPEN_READONLY, NULL) : SQLITE_NOMEM;
+    free(dbpath);
+    if (rc != SQLITE_OK)
+        return -1;
+
+    f->cache = cachecreate(16);
+    f->ix = f->cache ? indexercreate(f->db, f->cache, f->dir, 1) : NULL;
+    return f->ix ? 0 : -1;
+}
+
+static void fixtureclose(struct Fixture *f)
+{
+    indexerdestroy(f->ix);
+    cachedestroy(f->cache);
+    (void)sqlite3_close(f->conn);
+    dbdestroy(f->db);
+    testdirremove(f->dir);
+    free(f->config.cachedir);
+    free(f->repo);
+    free(f->dir);
+}
+
+/* root_hash as the writer last committed it, "" while unindexed */
+static int roothash(struct Fixture const *f, char *out, size_t outsize)
+{
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(f->conn, "SELECT root_hash FROM roots WHERE root_path = ?", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+
+    out[0] = '\0';
+    (void)sqlite3_bind_text(stmt, 1, f->repo, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW)
+        (void)snprintf(out, outsize, "%s", (char const *)sqlite3_column_text(stmt, 0));
+    (void)sqlite3_finalize(stmt);
+    return rc == SQLITE_ROW || rc == SQLITE_DONE ? 0 : -1;
+}
+
+/* Adds the root as a client would and waits for the writer to commit HEAD */
+static int indexhead(struct Fixture *f)
+{
+    char head[MAXHASHLEN];
+    if (gitrevparse(f->repo, "HEAD", head, sizeof(head)) != 0)
+        return -1;
+
+    Command cmd = { .op = Opadd };
+    cmd.pathop.path = (Str){ .s = f->repo, .len = strlen(f->repo) };
+    if (indexersubmit(f->ix, Opadd, &cmd, 1, NULL) != 0)
+        return -1;
+
+    for (int waited = 0; waited < WAITMS; waited += 20)
+    {
+        char hash[MAXHASHLEN];
+        if (roothash(f, hash, sizeof(hash)) != 0)
+            return -1;
+        if (strcmp(hash, head) == 0)
+            return 0;
+        sleepms(20);
+    }
+
+    eprintf("root was not indexed at %s\n", head);
+    return -1;
+}
+
+/*
+ * The root's leaves are exactly paths, in order, each pointing at the blob
+ * HEAD has there.  Their row ids are returned in ids when it is not NULL.
+ */
+static int expectleaves(struct Fixture const *f, char const *what, char const *const paths[], int64_t *ids)
+{
+    static char const sql[] = "SELECT l.leaf_path, b.blob_hash, l.id FROM leaves l "
+                              "JOIN roots r ON r.id = l.root_id JOIN blobs b ON b.id = l.blob_id "
+                              "WHERE r.root_path = ? ORDER BY l.leaf_path";
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(f->conn, sql, -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    (void)sqlite3_bind_text(stmt, 1, f->repo, -1, SQLITE_STATIC);
+
+    int ret = -1;
+    size_t n = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        char const *path = (char const *)sqlite3_column_text(stmt, 0);
+        char const *hash = (char const *)sqlite3_column_text(stmt, 1);
+        if (paths[n] == NULL || strcmp(path, paths[n]) != 0)
+        {
+            eprintf("%s: unexpected leaf %s\n", what, path);
+            goto finalize;
+        }
+
+        char rev[PATH_MAX + 8];
+        char want[MAXHASHLEN];
+        (void)snprintf(rev, sizeof(rev), "HEAD:%s", path);
+        if (gitrevparse(f->repo, rev, want, sizeof(want)) != 0 || strcmp(hash, want) != 0)
+        {
+            eprintf("%s: leaf %s has blob %s, HEAD has %s\n", what, path, hash, want);
+            goto finalize;
+        }
+
+        if (ids)
+            ids[n] = sqlite3_column_int64(stmt, 2);
+        n++;
+    }
+
+    if (rc != SQLITE_DONE || paths[n] != NULL)
+    {
+        eprintf("%s: leaf %s missing\n", what, rc == SQLITE_DONE ? paths[n] : sqlite3_errmsg(f->conn));
+        goto finalize;
+    }
+
+    ret = 0;
+
+finalize:
+    (void)sqlite3_finalize(stmt);
+    return ret;
+}
+
+/* Each kind of change diff-tree reports, applied to the rows the previous commit left */
+static int testindexdiff(struct Fixture *f)
+{
+    int64_t ids[MAXEXPECTED];
+
+    if (writetext(f->repo, "a.txt", "alpha\n") != 0 || writetext(f->repo, "b.txt", "beta\n") != 0 ||
+        writetext(f->repo, "c.txt", "gamma\n") != 0 || makelink(f->repo, "link", "a.txt") != 0 ||
+        commit(f->repo, "initial") != 0 || indexhead(f) != 0)
+        return -1;
+
+    char const *const walked[] = { "a.txt", "b.txt", "c.txt", NULL };
+    if (expectleaves(f, "full walk", walked, ids) != 0)
+        return -1;
+    int64_t const aid = ids[0];
+
+    /* A rename with score 100 moves the row, keeping its id */
+    char const *const mv[] = { "mv", "a.txt", "moved.txt", NULL };
+    if (testgit(f->repo, mv) != 0 || commit(f->repo, "move") != 0 || indexhead(f) != 0)
+        return -1;
+    char const *const moved[] = { "b.txt", "c.txt", "moved.txt", NULL };
+    if (expectleaves(f, "move", moved, ids) != 0)
+        return -1;
+    if (ids[2] != aid)
+    {
+        eprintf("move: moved.txt is row %lld, a.txt was %lld\n", (long long)ids[2], (long long)aid);
+        return -1;
+    }
+
+    /* A regular file becoming a symlink drops its leaf, and a symlink becoming a file gains one */
+    if (removefile(f->repo, "b.txt") != 0 || makelink(f->repo, "b.txt", "c.txt") != 0 ||
+        removefile(f->repo, "link") != 0 || writetext(f->repo, "link", "now a file\n") != 0 ||
+        commit(f->repo, "type changes") != 0 || indexhead(f) != 0)
+        return -1;
+    char const *const typed[] = { "c.txt", "link", "moved.txt", NULL };
+    if (expectleaves(f, "type change", typed, NULL) != 0)
+        return -1;
+
+    char const *const rm[] = { "rm", "-q", "c.txt", NULL };
+    if (testgit(f->repo, rm) != 0 || writetext(f->repo, "moved.txt", "alpha, edited\n") != 0 ||
+        commit(f->repo, "delete and modify") != 0 || indexhead(f) != 0)
+        return -1;
+    char const *const deleted[] = { "link", "moved.txt", NULL };
+    if (expectleaves(f, "deletion", deleted, NULL) != 0)
+        return -1;
+
+    /* History rewritten and the indexed commit pruned: the root is walked again from scratch */
+    char const *const orphan[] = { "checkout", "-q", "--orphan", "rewritten", NULL };
+    char const *const dropmain[] = { "branch", "-q", "-D", "main", NULL };
+    char const *const expire[] = { "reflog", "expire", "--expire=now", "--all", NULL };
+    char const *const gc[] = { "gc", "-q", "--prune=now", NULL };
+    char prev[MAXHASHLEN + 16];
+    char resolved[MAXHASHLEN];
+    if (roothash(f, prev, MAXHASHLEN) != 0 || testgit(f->repo, orphan) != 0 || writetext(f->repo, "fresh.txt", "delta\n") != 0 ||
+        commit(f->repo, "rewritten") != 0 || testgit(f->repo, dropmain) != 0 || testgit(f->repo, expire) != 0 || testgit(f->repo, gc) != 0)
+        return -1;
+    strcat(prev, "^{commit}");
+    if (gitrevparse(f->repo, prev, resolved, sizeof(resolved)) == 0)
+    {
+        eprintf("rewritten history: %s still resolves\n", prev);
+        return -1;
+    }
+    if (indexhead(f) != 0)
+        return -1;
+    char const *const rewalked[] = { "fresh.txt", "link", "moved.txt", NULL };
+    return expectleaves(f, "rewritten history", rewalked, NULL);
+}
+
+static int run(void)
+{
+    struct Fixture f = { 0 };
+    int failures = 0;
+
+    if (fixtureopen(&f) != 0 || testindexdiff(&f) != 0)
+        failures++;
+
+    fixtureclose(&f);
+    return failures;
+}
+
+static Test const test = {
+    .name = "index",
+    .run = run,
+};
+
+__attribute__((constructor)) static void init(void)
+{
+    testadd(&test);
+}
@@ -0,0 +1,180 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <yyjson.h>
+
+#include "malachi.h"
+
+enum
+{
+    NTHREADS = 4,
+    NADDS = 100000,
+    NSAMPLES = 1000,
+};
+
+static void *adder(void *arg)
+{
+    Metric *m = arg;
+    for (int i = 0; i < NADDS; ++i)
+        metricadd(m, 1);
+    return NULL;
+}
+
+/* Looks up section.name in a fresh snapshot */
+static yyjson_val *snapshot(yyjson_doc **doc, char const *section, char const *name)
+{
+    size_t len = 0;
+    char *json = metricsjson(&len);
+    if (json == NULL)
+        return NULL;
+
+    *doc = yyjson_read(json, len, 0);
+    free(json);
+    return yyjson_obj_get(yyjson_obj_get(yyjson_doc_get_root(*doc), section), name);
+}
+
+/* A name belongs to the first kind it was created as, and names must fit */
+static int testmetricsnames(void)
+{
+    Metric *m = metricget("test.kind", Mcounter);
+    if (m == NULL || metricget("test.kind", Mcounter) != m)
+    {
+        eprintf("counter not found again by name\n");
+        return -1;
+    }
+
+    if (metricget("test.kind", Mhistogram) != NULL || metricget("test.kind", Mgauge) != NULL)
+    {
+        eprintf("name reused for another kind of metric\n");
+        return -1;
+    }
+
+    if (metricget("test.a.name.far.too.long.to.fit.in.the.metrics.table", Mcounter) != NULL)
+    {
+        eprintf("overlong name accepted\n");
+        return -1;
+    }
+
+    /* Updates through a missing metric are ignored */
+    metricadd(NULL, 1);
+    metricset(NULL, 1);
+    metrictime(NULL, 1.0);
+    return 0;
+}
+
+/* Concurrent increments are never lost */
+static int testmetricscounter(void)
+{
+    Metric *m = metricget("test.concurrent", Mcounter);
+    pthread_t threads[NTHREADS];
+    int n = 0;
+
+    for (; n < NTHREADS; ++n)
+        if (threadspawn(&threads[n], adder, m) != 0)
+            break;
+    for (int i = 0; i < n; ++i)
+        pthread_join(threads[i], NULL);
+
+    yyjson_doc *doc = NULL;
+    uint64_t const total = yyjson_get_uint(snapshot(&doc, "counters", "test.concurrent"));
+    yyjson_doc_free(doc);
+
+    if (n != NTHREADS || total != (uint64_t)NTHREADS * NADDS)
+    {
+        eprintf("expected %d increments, counted %llu\n", NTHREADS * NADDS, (unsigned long long)total);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int near(double got, double want)
+{
+    return got >= want && got <= want * (1.0 + 1.0 / 16);
+}
+
+/* Percentiles of 1..1000us land within a sub-bucket of the true value */
+static int testmetricshistogram(void)
+{
+    Metric *m = metricget("test.latency", Mhistogram);
+    for (int i = NSAMPLES; i >= 1; --i)
+        metrictime(m, i * 1e-6);
+
+    yyjson_doc *doc = NULL;
+    yyjson_val *h = snapshot(&doc, "histograms", "test.latency");
+
+    uint64_t const count = yyjson_get_uint(yyjson_obj_get(h, "count"));
+    double const p50 = yyjson_get_num(yyjson_obj_get(h, "p50"));
+    double const p99 = yyjson_get_num(yyjson_obj_get(h, "p99"));
+    double const max = yyjson_get_num(yyjson_obj_get(h, "max"));
+    double const mean = yyjson_get_num(yyjson_obj_get(h, "mean"));
+    yyjson_doc_free(doc);
+
+    /* Seconds to nanoseconds truncates, so allow for a nanosecond short */
+    int const ok = count == NSAMPLES && near(p50 + 0.001, 500) && near(p99 + 0.001, 990) && near(max + 0.001, 1000) && max <= 1000 && mean > 499 && mean < 501;
+    if (!ok)
+    {
+        eprintf("histogram: count %llu, p50 %.3f, p99 %.3f, max %.3f, mean %.3f\n", (unsigned long long)count, p50, p99, max, mean);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* With few samples each quantile is the sample at its nearest rank, never the one after */
+static int testmetricssmall(void)
+{
+    Metric *one = metricget("test.one", Mhistogram);
+    Metric *four = metricget("test.four", Mhistogram);
+    metrictime(one, 7e-6);
+    for (int i = 4; i >= 1; --i)
+        metrictime(four, i * 1e-6);
+
+    yyjson_doc *doc = NULL;
+    yyjson_val *h = snapshot(&doc, "histograms", "test.one");
+    double const onep50 = yyjson_get_num(yyjson_obj_get(h, "p50"));
+    double const onep99 = yyjson_get_num(yyjson_obj_get(h, "p99"));
+    yyjson_doc_free(doc);
+
+    doc = NULL;
+    h = snapshot(&doc, "histograms", "test.four");
+    double const p50 = yyjson_get_num(yyjson_obj_get(h, "p50"));
+    double const p90 = yyjson_get_num(yyjson_obj_get(h, "p90"));
+    double const p99 = yyjson_get_num(yyjson_obj_get(h, "p99"));
+    yyjson_doc_free(doc);
+
+    int const ok = near(onep50 + 0.001, 7) && near(onep99 + 0.001, 7) && near(p50 + 0.001, 2) && near(p90 + 0.001, 4) && near(p99 + 0.001, 4);
+    if (!ok)
+    {
+        eprintf("small histograms: one p50 %.3f p99 %.3f, four p50 %.3f p90 %.3f p99 %.3f\n", onep50, onep99, p50, p90, p99);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int run(void)
+{
+    int failures = 0;
+
+    if (testmetricsnames() != 0)
+        failures++;
+    if (testmetricscounter() != 0)
+        failures++;
+    if (testmetricshistogram() != 0)
+        failures++;
+    if (testmetricssmall() != 0)
+        failures++;
+
+    return failures;
+}
+
+static Test const test = {
+    .name = "metrics",
+    .run = run,
+};
+
+__attribute__((constructor)) static void init(void)
+{
+    testadd(&test);
+}
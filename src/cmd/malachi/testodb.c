@@ -0,0 +1,373 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "malachi.h"
+
+enum
+{
+    NLINES = 2000,
+    NVERSIONS = 8,
+    BINSIZE = 4096,
+    MAXOBJECTS = 64,
+};
+
+/* A blob as git cat-file returns it */
+struct Object
+{
+    char oid[MAXHASHLEN];
+    char *data;
+    size_t size;
+};
+
+struct Objects
+{
+    struct Object blobs[MAXOBJECTS];
+    size_t nblobs;
+    char tree[MAXHASHLEN];
+};
+
+static void objectsfree(struct Objects *objs)
+{
+    for (size_t i = 0; i < objs->nblobs; ++i)
+        free(objs->blobs[i].data);
+    objs->nblobs = 0;
+}
+
+static int commit(char const *repo, char const *msg)
+{
+    char const *const add[] = { "add", "-A", NULL };
+    char const *const ci[] = { "-c", "user.name=test", "-c", "user.email=test@localhost", "-c", "commit.gpgsign=false", "commit", "-q", "-m", msg, NULL };
+    return testgit(repo, add) == 0 && testgit(repo, ci) == 0 ? 0 : -1;
+}
+
+/* Most lines survive from one version to the next, so repacking stores later versions as deltas */
+static int writeversion(char const *repo, int v)
+{
+    size_t const cap = (size_t)NLINES * 64;
+    char *text = malloc(cap);
+    if (text == NULL)
+        return -1;
+
+    size_t len = 0;
+    for (int i = 0; i < NLINES; ++i)
+        len += (size_t)snprintf(text + len, cap - len, "line %d: the quick brown fox %d\n", i, i % 97 == v ? v : 0);
+    int rc = testfile(repo, "text.txt", text, len);
+
+    char bin[BINSIZE];
+    uint64_t state = 42;
+    for (size_t i = 0; i < sizeof(bin); ++i)
+    {
+        state = (state * 6364136223846793005ULL) + 1442695040888963407ULL;
+        bin[i] = (char)(i % 7 == 0 ? 0 : state >> 56);
+    }
+    bin[v] = (char)v;
+    if (rc == 0)
+        rc = testfile(repo, "data.bin", bin, sizeof(bin));
+    if (rc == 0 && v == 0)
+        rc = testfile(repo, "empty", "", 0);
+
+    char msg[32];
+    (void)snprintf(msg, sizeof(msg), "version %d", v);
+    if (rc == 0)
+        rc = commit(repo, msg);
+
+    free(text);
+    return rc;
+}
+
+/* Every blob git knows of, read back through cat-file, and one tree */
+static int listobjects(char const *repo, struct Objects *objs)
+{
+    char const *const listargs[] = { "cat-file", "--batch-all-objects", "--batch-check", NULL };
+    char const *const catargs[] = { "cat-file", "--batch", NULL };
+    int ret = -1;
+
+    objectsfree(objs);
+    objs->tree[0] = '\0';
+
+    Git *list = gitopen(repo, listargs);
+    Git *cat = gitopen(repo, catargs);
+    if (list == NULL || cat == NULL)
+        goto close;
+
+    char *rec = NULL;
+    while (gitread(list, '\n', &rec) > 0)
+    {
+        char oid[MAXHASHLEN];
+        char type[16];
+        if (sscanf(rec, "%64s %15s", oid, type) != 2)
+            goto close;
+
+        if (strcmp(type, "tree") == 0)
+            memcpy(objs->tree, oid, sizeof(oid));
+        if (strcmp(type, "blob") != 0)
+            continue;
+        if (objs->nblobs == MAXOBJECTS)
+            goto close;
+
+        struct Object *o = &objs->blobs[objs->nblobs];
+        memcpy(o->oid, oid, sizeof(oid));
+        o->data = gitblob(cat, oid, &o->size);
+        if (o->data == NULL)
+            goto close;
+        objs->nblobs++;
+    }
+
+    ret = objs->nblobs > NVERSIONS && objs->tree[0] ? 0 : -1;
+
+close:
+    if (list)
+        (void)gitclose(list);
+    if (cat)
+        (void)gitclose(cat);
+    return ret;
+}
+
+/* odbblob and odbblobsize agree with git byte for byte, and refuse anything but a blob */
+static int checkobjects(char const *repo, struct Objects const *objs, char const *what)
+{
+    Odb *odb = odbopen(repo);
+    if (odb == NULL)
+    {
+        eprintf("%s: odbopen failed\n", what);
+        return -1;
+    }
+
+    int ret = -1;
+    for (size_t i = 0; i < objs->nblobs; ++i)
+    {
+        struct Object const *o = &objs->blobs[i];
+        size_t size = 0;
+        char *data = odbblob(odb, o->oid, &size);
+        int const same = data && size == o->size && memcmp(data, o->data, size) == 0;
+        free(data);
+        if (!same)
+        {
+            eprintf("%s: blob %s differs from git cat-file\n", what, o->oid);
+            goto close;
+        }
+
+        size = 0;
+        if (odbblobsize(odb, o->oid, &size) != 0 || size != o->size)
+        {
+            eprintf("%s: size of blob %s is %zu, git says %zu\n", what, o->oid, size, o->size);
+            goto close;
+        }
+    }
+
+    size_t size = 0;
+    char *tree = odbblob(odb, objs->tree, &size);
+    if (tree || odbblobsize(odb, objs->tree, &size) == 0)
+    {
+        free(tree);
+        eprintf("%s: tree %s read as a blob\n", what, objs->tree);
+        goto close;
+    }
+
+    ret = 0;
+
+close:
+    odbclose(odb);
+    return ret;
+}
+
+/* Objects git stored as deltas, from verify-pack, which lists their depth and base */
+static int countdeltas(char const *idxpath)
+{
+    char const *const args[] = { "verify-pack", "-v", idxpath, NULL };
+    Git *g = gitopen(".", args);
+    if (g == NULL)
+        return -1;
+
+    int n = 0;
+    char *rec = NULL;
+    while (gitread(g, '\n', &rec) > 0)
+    {
+        char oid[MAXHASHLEN];
+        char type[16];
+        char base[MAXHASHLEN];
+        unsigned long size, packed, off, depth;
+        if (sscanf(rec, "%64s %15s %lu %lu %lu %lu %64s", oid, type, &size, &packed, &off, &depth, base) == 7 && strcmp(type, "blob") == 0)
+            n++;
+    }
+
+    return gitclose(g) == 0 ? n : -1;
+}
+
+/* The single pack left after repack -adf, as a path ending in .idx */
+static char *findidx(char const *repo)
+{
+    char *packdir = joinpath2(repo, ".git/objects/pack");
+    DIR *dir = packdir ? opendir(packdir) : NULL;
+    char *idx = NULL;
+    int n = 0;
+
+    struct dirent *ent;
+    while (dir && (ent = readdir(dir)) != NULL)
+    {
+        size_t const len = strlen(ent->d_name);
+        if (len < 5 || strcmp(ent->d_name + len - 4, ".idx") != 0)
+            continue;
+        free(idx);
+        idx = joinpath2(packdir, ent->d_name);
+        n++;
+    }
+
+    if (dir)
+        closedir(dir);
+    free(packdir);
+    if (n != 1)
+    {
+        free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+/* Truncated files may still hold some objects whole, but nothing read past their end may come back */
+static int checktruncated(char const *repo, struct Objects const *objs, char const *path, char const *what)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+
+    int ret = -1;
+    long len = -1;
+    char *saved = NULL;
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0)
+        saved = malloc((size_t)len);
+    int const ok = saved && fread(saved, 1, (size_t)len, f) == (size_t)len;
+    (void)fclose(f);
+    /* Git writes packs read-only */
+    if (!ok || chmod(path, 0600) != 0 || truncate(path, len / 2) != 0)
+        goto freesaved;
+
+    Odb *odb = odbopen(repo);
+    if (odb == NULL)
+    {
+        eprintf("%s: odbopen failed\n", what);
+        goto restore;
+    }
+
+    int nmissing = 0;
+    for (size_t i = 0; i < objs->nblobs; ++i)
+    {
+        struct Object const *o = &objs->blobs[i];
+        size_t size = 0;
+        char *data = odbblob(odb, o->oid, &size);
+        if (data == NULL)
+        {
+            nmissing++;
+            continue;
+        }
+        int const same = size == o->size && memcmp(data, o->data, size) == 0;
+        free(data);
+        if (!same)
+        {
+            eprintf("%s: blob %s read wrongly\n", what, o->oid);
+            odbclose(odb);
+            goto restore;
+        }
+    }
+    odbclose(odb);
+
+    if (nmissing == 0)
+    {
+        eprintf("%s: every blob still read\n", what);
+        goto restore;
+    }
+
+    ret = 0;
+
+restore:
+    f = fopen(path, "wb");
+    if (f == NULL || fwrite(saved, 1, (size_t)len, f) != (size_t)len)
+        ret = -1;
+    if (f && fclose(f) != 0)
+        ret = -1;
+freesaved:
+    free(saved);
+    return ret;
+}
+
+static int testodbgit(char const *repo)
+{
+    char const *const init[] = { "init", "-q", NULL };
+    char const *const repack[] = { "repack", "-adf", "-q", NULL };
+    char const *const refrepack[] = { "-c", "repack.useDeltaBaseOffset=false", "repack", "-adf", "-q", NULL };
+    struct Objects objs = { .nblobs = 0 };
+    char *idx = NULL;
+    int ret = -1;
+
+    if (testgit(repo, init) != 0)
+        goto done;
+    for (int v = 0; v < NVERSIONS; ++v)
+        if (writeversion(repo, v) != 0)
+            goto done;
+
+    if (listobjects(repo, &objs) != 0 || checkobjects(repo, &objs, "loose") != 0)
+        goto done;
+
+    if (testgit(repo, repack) != 0 || (idx = findidx(repo)) == NULL)
+        goto done;
+    if (countdeltas(idx) <= 0)
+    {
+        eprintf("repack stored no blob as a delta\n");
+        goto done;
+    }
+    if (checkobjects(repo, &objs, "offset deltas") != 0)
+        goto done;
+
+    /* A newer version stays loose on top of the pack */
+    if (writeversion(repo, NVERSIONS) != 0 || listobjects(repo, &objs) != 0 || checkobjects(repo, &objs, "loose over a pack") != 0)
+        goto done;
+
+    free(idx);
+    idx = NULL;
+    if (testgit(repo, refrepack) != 0 || (idx = findidx(repo)) == NULL || checkobjects(repo, &objs, "ref deltas") != 0)
+        goto done;
+
+    size_t const len = strlen(idx);
+    char *pack = malloc(len + 2);
+    if (pack == NULL)
+        goto done;
+    memcpy(pack, idx, len - 4);
+    memcpy(pack + len - 4, ".pack", 6);
+    int const rc = checktruncated(repo, &objs, idx, "truncated idx") == 0 && checktruncated(repo, &objs, pack, "truncated pack") == 0;
+    free(pack);
+
+    ret = rc ? 0 : -1;
+
+done:
+    free(idx);
+    objectsfree(&objs);
+    return ret;
+}
+
+static int run(void)
+{
+    char *repo = testdirmake("odb");
+    if (repo == NULL)
+        return -1;
+
+    int failures = 0;
+    if (testodbgit(repo) != 0)
+        failures++;
+
+    testdirremove(repo);
+    free(repo);
+    return failures;
+}
+
+static Test const test = {
+    .name = "odb",
+    .run = run,
+};
+
+__attribute__((constructor)) static void init(void)
+{
+    testadd(&test);
+}
@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "malachi.h"
+
+enum
+{
+    NFRAMES = 200,
+    SMALLBUF = 96,
+};
+
+static int writeframe(int fd, char const *json)
+{
+    uint32_t const len = (uint32_t)strlen(json);
+    if (write(fd, &len, sizeof(len)) != sizeof(len))
+        return -1;
+    if (write(fd, json, len) != (ssize_t)len)
+        return -1;
+    return 0;
+}
+
+/* A buffer holding only a couple of frames forces consumed bytes to be reclaimed */
+static int testparserframes(void)
+{
+    int ret = -1;
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+
+    Parser *p = parsercreate(SMALLBUF);
+    if (p == NULL)
+        goto closepipe;
+
+    for (int i = 0; i < NFRAMES; ++i)
+    {
+        char json[64];
+        (void)snprintf(json, sizeof(json), "{\"op\":\"add\",\"path\":\"/r/%d\"}", i);
+        if (writeframe(fds[1], json) != 0)
+            goto destroyparser;
+    }
+    close(fds[1]);
+    fds[1] = -1;
+
+    Command cmd;
+    int nparsed = 0;
+    while (parserinput(p, fds[0]) > 0)
+    {
+        int rc;
+        while ((rc = parsecommand(p, &cmd, NULL)) > 0)
+        {
+            char expect[16];
+            (void)snprintf(expect, sizeof(expect), "/r/%d", nparsed);
+            if (cmd.op != Opadd || strcmp(cmd.pathop.path.s, expect) != 0)
+            {
+                eprintf("frame %d: expected add %s, got op=%d path=%s\n", nparsed, expect, cmd.op, cmd.pathop.path.s);
+                goto destroyparser;
+            }
+            nparsed++;
+        }
+        if (rc < 0)
+        {
+            eprintf("frame %d: parse failed\n", nparsed);
+            goto destroyparser;
+        }
+    }
+
+    if (nparsed != NFRAMES)
+    {
+        eprintf("expected %d frames, got %d\n", NFRAMES, nparsed);
+        goto destroyparser;
+    }
+
+    ret = 0;
+
+destroyparser:
+    parserdestroy(p);
+closepipe:
+    close(fds[0]);
+    if (fds[1] != -1)
+        close(fds[1]);
+    return ret;
+}
+
+static int testparseroversize(void)
+{
+    int ret = -1;
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+
+    Parser *p = parsercreate(SMALLBUF);
+    if (p == NULL)
+        goto closepipe;
+
+    /* A frame longer than any batch is dropped rather than waited for */
+    uint32_t const len = MAXFRAMESIZE + 1;
+    if (write(fds[1], &len, sizeof(len)) != sizeof(len))
+        goto destroyparser;
+    if (writeframe(fds[1], "{\"op\":\"shutdown\"}") != 0)
+        goto destroyparser;
+
+    Command cmd;
+    if (parserinput(p, fds[0]) <= 0 || parsecommand(p, &cmd, NULL) != -1)
+    {
+        eprintf("oversized frame was not rejected\n");
+        goto destroyparser;
+    }
+
+    if (parsecommand(p, &cmd, NULL) != 0)
+    {
+        eprintf("parser kept data after draining\n");
+        goto destroyparser;
+    }
+
+    ret = 0;
+
+destroyparser:
+    parserdestroy(p);
+closepipe:
+    close(fds[0]);
+    close(fds[1]);
+    return ret;
+}
+
+/* The body of an oversized frame is skipped as it arrives, the frame after it still parses */
+static int testparserresync(void)
+{
+    int ret = -1;
+    FILE *f = tmpfile();
+    if (f == NULL)
+        return -1;
+
+    Parser *p = parsercreate(SMALLBUF);
+    char *body = malloc((size_t)MAXFRAMESIZE + 1);
+    if (p == NULL || body == NULL)
+        goto destroyparser;
+
+    int const fd = fileno(f);
+    memset(body, '{', (size_t)MAXFRAMESIZE + 1);
+    uint32_t const len = MAXFRAMESIZE + 1;
+    if (write(fd, &len, sizeof(len)) != sizeof(len) || write(fd, body, len) != (ssize_t)len)
+        goto destroyparser;
+    if (writeframe(fd, "{\"op\":\"remove\",\"path\":\"/r\"}") != 0)
+        goto destroyparser;
+    if (lseek(fd, 0, SEEK_SET) != 0)
+        goto destroyparser;
+
+    Command cmd;
+    int nrejected = 0;
+    int nparsed = 0;
+    while (parserinput(p, fd) > 0)
+    {
+        int rc;
+        while ((rc = parsecommand(p, &cmd, NULL)) != 0)
+        {
+            nrejected += rc < 0;
+            nparsed += rc > 0 && cmd.op == Opremove && strcmp(cmd.pathop.path.s, "/r") == 0;
+        }
+    }
+
+    if (nrejected != 1 || nparsed != 1)
+    {
+        eprintf("expected one rejected and one parsed frame, got %d and %d\n", nrejected, nparsed);
+        goto destroyparser;
+    }
+
+    ret = 0;
+
+destroyparser:
+    free(body);
+    parserdestroy(p);
+    (void)fclose(f);
+    return ret;
+}
+
+/* A batch of MAXBATCHOPS of the longest paths outgrows the daemon's buffer, which grows to take it */
+static int testparserbatchlimit(void)
+{
+    int ret = -1;
+    FILE *f = tmpfile();
+    if (f == NULL)
+        return -1;
+
+    Parser *p = parsercreate((size_t)MAXRECORDSIZE * 2);
+    char *json = malloc(MAXFRAMESIZE);
+    if (p == NULL || json == NULL)
+        goto destroyparser;
+
+    char path[PATH_MAX];
+    memset(path, 'a', sizeof(path) - 1);
+    path[0] = '/';
+    path[sizeof(path) - 1] = '\0';
+
+    size_t n = (size_t)snprintf(json, MAXFRAMESIZE, "{\"op\":\"batch\",\"ops\":[");
+    for (int i = 0; i < MAXBATCHOPS; ++i)
+    {
+        (void)snprintf(path + 1, 6, "%05d", i);
+        path[6] = 'a';
+        n += (size_t)snprintf(json + n, MAXFRAMESIZE - n, "%s{\"op\":\"remove\",\"path\":\"%s\"}", i ? "," : "", path);
+    }
+    n += (size_t)snprintf(json + n, MAXFRAMESIZE - n, "]}");
+    if (n >= MAXFRAMESIZE)
+    {
+        eprintf("batch of %d entries does not fit in %d bytes\n", MAXBATCHOPS, MAXFRAMESIZE);
+        goto destroyparser;
+    }
+
+    int const fd = fileno(f);
+    if (writeframe(fd, json) != 0 || writeframe(fd, "{\"op\":\"add\",\"path\":\"/r\"}") != 0)
+        goto destroyparser;
+    if (lseek(fd, 0, SEEK_SET) != 0)
+        goto destroyparser;
+
+    Command cmd;
+    int nparsed = 0;
+    while (parserinput(p, fd) > 0)
+    {
+        int rc;
+        while ((rc = parsecommand(p, &cmd, NULL)) > 0)
+        {
+            if (nparsed == 0)
+            {
+                (void)snprintf(path + 1, 6, "%05d", MAXBATCHOPS - 1);
+                path[6] = 'a';
+                Command const *last = &cmd.batchop.cmds[MAXBATCHOPS - 1];
+                if (cmd.op != Opbatch || cmd.batchop.ncmds != MAXBATCHOPS || last->op != Opremove || strcmp(last->pathop.path.s, path) != 0)
+                {
+                    eprintf("batch at the limit decoded wrongly\n");
+                    goto destroyparser;
+                }
+            }
+            else if (cmd.op != Opadd || strcmp(cmd.pathop.path.s, "/r") != 0)
+            {
+                eprintf("frame after the batch decoded wrongly\n");
+                goto destroyparser;
+            }
+            nparsed++;
+        }
+        if (rc < 0)
+        {
+            eprintf("frame %d: parse failed\n", nparsed);
+            goto destroyparser;
+        }
+    }
+
+    if (nparsed != 2)
+    {
+        eprintf("expected the batch and one more frame, got %d\n", nparsed);
+        goto destroyparser;
+    }
+
+    ret = 0;
+
+destroyparser:
+    free(json);
+    parserdestroy(p);
+    (void)fclose(f);
+    return ret;
+}
+
+static int parseone(Parser *p, int const fds[2], char const *json, Command *cmd)
+{
+    if (writeframe(fds[1], json) != 0)
+        return -2;
+    for (;;)
+    {
+        int rc = parsecommand(p, cmd, NULL);
+        if (rc != 0)
+            return rc;
+        if (parserinput(p, fds[0]) <= 0)
+            return -2;
+    }
+}
+
+/* Fields are matched by key in any order, unknown keys are ignored, batches nest only add and remove */
+static int testparserfields(void)
+{
+    int ret = -1;
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+
+    Parser *p = parsercreate((size_t)MAXRECORDSIZE * 2);
+    if (p == NULL)
+        goto closepipe;
+
+    Command cmd;
+    if (parseone(p, fds, "{\"terms\":\"a b\",\"x\":1,\"op\":\"query\",\"queryId\":\"q1\"}", &cmd) != 1)
+    {
+        eprintf("query frame was not parsed\n");
+        goto destroyparser;
+    }
+    if (cmd.op != Opquery || strcmp(cmd.queryop.queryid.s, "q1") != 0 || cmd.queryop.terms.len != 3 || strcmp(cmd.queryop.repofilter.s, "") != 0)
+    {
+        eprintf("query fields decoded wrongly\n");
+        goto destroyparser;
+    }
+
+    if (parseone(p, fds, "{\"op\":\"batch\",\"ops\":[{\"op\":\"add\",\"path\":\"/a\"},{\"path\":\"/b\",\"op\":\"remove\"}]}", &cmd) != 1)
+    {
+        eprintf("batch frame was not parsed\n");
+        goto destroyparser;
+    }
+    if (cmd.op != Opbatch || cmd.batchop.ncmds != 2 || cmd.batchop.cmds[1].op != Opremove || strcmp(cmd.batchop.cmds[1].pathop.path.s, "/b") != 0)
+    {
+        eprintf("batch entries decoded wrongly\n");
+        goto destroyparser;
+    }
+
+    /* Strings are unescaped in place, so the decoded text is shorter than the frame's */
+    if (parseone(p, fds, "{\"op\":\"add\",\"path\":\"/a\\\"b\\u00e9\"}", &cmd) != 1)
+    {
+        eprintf("escaped frame was not parsed\n");
+        goto destroyparser;
+    }
+    if (cmd.pathop.path.len != 6 || strcmp(cmd.pathop.path.s, "/a\"b\xC3\xA9") != 0)
+    {
+        eprintf("escaped path decoded wrongly: %s\n", cmd.pathop.path.s);
+        goto destroyparser;
+    }
+
+    char const *const bad[] = {
+        "{\"op\":\"batch\",\"ops\":[{\"op\":\"query\",\"queryId\":\"q\",\"terms\":\"t\"}]}",
+        "{\"op\":\"batch\",\"ops\":{}}",
+        "{\"op\":\"adds\",\"path\":\"/r\"}",
+        "{\"op\":\"query\",\"terms\":\"a\"}",
+        "{\"op\":\"add\",\"path\":1}",
+    };
+    for (size_t i = 0; i < NELEM(bad); ++i)
+    {
+        if (parseone(p, fds, bad[i], &cmd) != -1)
+        {
+            eprintf("accepted %s\n", bad[i]);
+            goto destroyparser;
+        }
+    }
+
+    ret = 0;
+
+destroyparser:
+    parserdestroy(p);
+closepipe:
+    close(fds[0]);
+    close(fds[1]);
+    return ret;
+}
+
+static int run(void)
+{
+    int failures = 0;
+
+    /* Every op name and field key has a slot of its own */
+    if (parserslots() != 0)
+        failures++;
+    if (testparserframes() != 0)
+        failures++;
+    if (testparseroversize() != 0)
+        failures++;
+    if (testparserresync() != 0)
+        failures++;
+    if (testparserbatchlimit() != 0)
+        failures++;
+    if (testparserfields() != 0)
+        failures++;
+
+    return failures;
+}
+
+static Test const test = {
+    .name = "parser",
+    .run = run,
+};
+
+__attribute__((constructor)) static void init(void)
+{
+    testadd(&test);
+}
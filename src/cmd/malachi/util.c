@@ -1,5 +1,6 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "malachi.h"
 
@@ -15,34 +16,9 @@ int eprintf(char *fmt, ...)
     return n;
 }
 
-void loginfo(char const *fmt, ...)
+double clocksec(void)
 {
-    va_list args;
-    va_start(args, fmt);
-    printf("[INFO] ");
-    vprintf(fmt, args);
-    printf("\n");
-    va_end(args);
-}
-
-void logerror(char const *fmt, ...)
-{
-    va_list args;
-    va_start(args, fmt);
-    (void)fprintf(stderr, "[ERROR] ");
-    (void)vfprintf(stderr, fmt, args);
-    (void)fprintf(stderr, "\n");
-    va_end(args);
-}
-
-void logdebug(char const *fmt, ...)
-{
-    if (!debug)
-        return;
-    va_list args;
-    va_start(args, fmt);
-    printf("[DEBUG] ");
-    vprintf(fmt, args);
-    printf("\n");
-    va_end(args);
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
 }